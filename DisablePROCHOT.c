@@ -17,118 +17,3833 @@ static EFI_BOOT_SERVICES *BS;
 static EFI_RUNTIME_SERVICES *RT;
 static EFI_HANDLE IM;
 
-static EFI_GUID gEfiGlobalVariableGuid = EFI_GLOBAL_VARIABLE;
 static EFI_GUID gEfiLoadedImageProtocolGuid = LOADED_IMAGE_PROTOCOL;
+#ifndef DRIVER_BUILD  // boot-option walk and chainload: the application only
+static EFI_GUID gEfiGlobalVariableGuid = EFI_GLOBAL_VARIABLE;
 static EFI_GUID gEfiLoadedImageDevicePathProtocolGuid = {
     0xbc62157e, 0x3e33, 0x4fec, {0x99, 0x20, 0x2d, 0x3b, 0x36, 0xd7, 0x50, 0xdf}};
 static EFI_GUID gEfiDevicePathProtocolGuid = {
     0x09576e91, 0x6d3f, 0x11d2, {0x8e, 0x39, 0x00, 0xa0, 0xc9, 0x69, 0x72, 0x3b}};
+static EFI_GUID gEfiBlockIoProtocolGuid = BLOCK_IO_PROTOCOL;
+#endif
+// Owner of every DisablePROCHOT* variable (records, caches, settings).
+static EFI_GUID gDisablePROCHOTVendorGuid = {
+    0x9f0c4e2a, 0x6b1d, 0x4c3e, {0x8a, 0x5f, 0x2d, 0x71, 0xc4, 0x0b, 0x93, 0xe6}};
+
+// ---------------------------------------------------------------------------
+// Deferred log
+// ---------------------------------------------------------------------------
+// A console write is a synchronous GOP render plus a serial write, several
+// milliseconds a line, so messages go to a ring of lines instead, each with
+// the TSC at its start and a severity. PublishLog keeps the ring in a volatile
+// variable at handoff and prints it only when an error was logged (or as the
+// log_console setting says). The ring is sized so the rendered text fits the
+// common 8 KiB variable limit; the oldest lines are dropped past that.
+#define LOG_LINES 64
+#define LOG_LINE_CHARS 80
+
+enum { LOG_INFO, LOG_WARN, LOG_ERROR };
+
+#define LOG_CONSOLE_AUTO 0  // print the log only if an error was logged
+#define LOG_CONSOLE_ALWAYS 1
+#define LOG_CONSOLE_NEVER 2
+
+#ifdef SILENT
+static void Log(UINT8 level, CHAR16 *s) {
+  (void)level;
+  (void)s;  // no log at all; LTO strips the now-unused string literals
+}
+#else
+typedef struct {
+  UINT64 Tsc;  // when the line was started
+  UINT8 Level;
+  UINT8 Length;
+  CHAR8 Text[LOG_LINE_CHARS];  // ASCII; longer lines are cut
+} LOG_LINE;
+
+static LOG_LINE gLog[LOG_LINES];
+static UINTN gLogLines;   // lines started so far; the newest LOG_LINES are kept
+static BOOLEAN gLogOpen;  // the newest line hasn't seen its '\n' yet
+static UINT8 gLogWorst;
+
+static uint64_t AsmReadTsc(void);
+
+// Appends to the open line; a line's severity is the highest of its pieces.
+static void Log(UINT8 level, CHAR16 *s) {
+  LOG_LINE *line = gLogOpen ? &gLog[(gLogLines - 1) % LOG_LINES] : NULL;
+
+  for (; *s; ++s) {
+    if (*s == L'\r') continue;
+    if (!line) {
+      line = &gLog[gLogLines++ % LOG_LINES];
+      line->Tsc = AsmReadTsc();
+      line->Level = LOG_INFO;
+      line->Length = 0;
+      gLogOpen = TRUE;
+    }
+    if (line->Level < level) line->Level = level;
+    if (gLogWorst < level) gLogWorst = level;
+    if (*s == L'\n') {
+      gLogOpen = FALSE;
+      line = NULL;
+    } else if (line->Length < LOG_LINE_CHARS) {
+      line->Text[line->Length++] = *s < 0x7F ? (CHAR8)*s : '?';
+    }
+  }
+}
+#endif
+
+static void Output(CHAR16 *s) { Log(LOG_INFO, s); }
+
+// Decimal formatter for the few counts we report; writes into a caller buffer.
+static CHAR16 *FormatDec(UINTN v, CHAR16 buf[21]) {
+  CHAR16 *p = buf + 20;
+  *p = L'\0';
+  do {
+    *--p = (CHAR16)(L'0' + v % 10);
+    v /= 10;
+  } while (v);
+  return p;
+}
+
+static void OutputNum(CHAR16 *prefix, UINTN v, CHAR16 *suffix) {
+  CHAR16 buf[21];
+  Output(prefix);
+  Output(FormatDec(v, buf));
+  Output(suffix);
+}
+
+static CHAR16 *FormatHex(UINT64 v, CHAR16 buf[19]) {
+  CHAR16 *p = buf + 18;
+  *p = L'\0';
+  do {
+    *--p = L"0123456789ABCDEF"[v & 0xF];
+    v >>= 4;
+  } while (v);
+  *--p = L'x';
+  *--p = L'0';
+  return p;
+}
+
+static void OutputHex(CHAR16 *prefix, UINT64 v, CHAR16 *suffix) {
+  CHAR16 buf[19];
+  Output(prefix);
+  Output(FormatHex(v, buf));
+  Output(suffix);
+}
+
+static INTN CompareMem(const void *a, const void *b, UINTN n) {
+  const UINT8 *x = a, *y = b;
+  for (UINTN i = 0; i < n; i++)
+    if (x[i] != y[i]) return (INTN)x[i] - (INTN)y[i];
+  return 0;
+}
+
+static void CopyMem(void *d, const void *s, UINTN n) {
+  UINT8 *dd = d;
+  const UINT8 *ss = s;
+  for (UINTN i = 0; i < n; i++) dd[i] = ss[i];
+}
+
+static void ZeroMem(void *d, UINTN n) {
+  UINT8 *dd = d;
+  for (UINTN i = 0; i < n; i++) dd[i] = 0;
+}
+
+static void FreePool(void *p) { BS->FreePool(p); }
+
+// First File() node of `dp`, or NULL.
+static EFI_DEVICE_PATH_PROTOCOL *FindFilePathNode(EFI_DEVICE_PATH_PROTOCOL *dp) {
+  EFI_DEVICE_PATH_PROTOCOL *node = dp;
+  while (node && !IsDevicePathEnd(node)) {
+    if (DevicePathType(node) == MEDIA_DEVICE_PATH &&
+        DevicePathSubType(node) == MEDIA_FILEPATH_DP)
+      return node;
+    node = NextDevicePathNode(node);
+  }
+  return NULL;
+}
+
+#ifndef DRIVER_BUILD
+static UINTN DevicePathSize(EFI_DEVICE_PATH_PROTOCOL *dp) {
+  EFI_DEVICE_PATH_PROTOCOL *n = dp;
+  UINTN sz = 0;
+  while (n) {
+    UINTN l = (UINTN)DevicePathNodeLength(n);
+    if (l < sizeof(EFI_DEVICE_PATH_PROTOCOL)) return 0;
+    sz += l;
+    if (IsDevicePathEnd(n)) return sz;
+    n = NextDevicePathNode(n);
+  }
+  return 0;
+}
+
+
+// ---------------------------------------------------------------------------
+// Partition signature index
+// ---------------------------------------------------------------------------
+// Every Block IO handle whose device path ends in an HD() node, keyed by that
+// node's GPT GUID or MBR signature. Built on the first short-form lookup with
+// one LocateHandleBuffer, so a Boot#### entry on any disk expands with a table
+// scan instead of a firmware connect-all. The paths are the firmware's own
+// protocol instances; the table is static, so indexing allocates nothing.
+#define SIGNATURE_TYPE_MBR 0x01
+#define SIGNATURE_TYPE_GUID 0x02
+#define MAX_PARTITIONS 128
+
+typedef struct {
+  HARDDRIVE_DEVICE_PATH *Hd;      // the partition's HD() node
+  EFI_DEVICE_PATH_PROTOCOL *Path; // full path of the partition, End included
+} PARTITION_ENTRY;
+
+static PARTITION_ENTRY gPartitions[MAX_PARTITIONS];
+static UINTN gPartitionCount;
+static BOOLEAN gPartitionsIndexed;
+
+static HARDDRIVE_DEVICE_PATH *LastHdNode(EFI_DEVICE_PATH_PROTOCOL *dp) {
+  HARDDRIVE_DEVICE_PATH *hd = NULL;
+  for (; !IsDevicePathEnd(dp); dp = NextDevicePathNode(dp)) {
+    if (DevicePathNodeLength(dp) < sizeof(EFI_DEVICE_PATH_PROTOCOL)) return NULL;
+    hd = DevicePathType(dp) == MEDIA_DEVICE_PATH &&
+                 DevicePathSubType(dp) == MEDIA_HARDDRIVE_DP &&
+                 DevicePathNodeLength(dp) >= sizeof(HARDDRIVE_DEVICE_PATH)
+             ? (HARDDRIVE_DEVICE_PATH *)dp
+             : NULL;
+  }
+  return hd;
+}
+
+static void PartitionIndexBuild(void) {
+  EFI_HANDLE *handles = NULL;
+  UINTN count = 0, i;
+
+  gPartitionsIndexed = TRUE;
+  if (!BS->LocateHandleBuffer ||
+      EFI_ERROR(BS->LocateHandleBuffer(ByProtocol, &gEfiBlockIoProtocolGuid, NULL, &count,
+                                       &handles)) ||
+      !handles)
+    return;
+  for (i = 0; i < count && gPartitionCount < MAX_PARTITIONS; ++i) {
+    EFI_DEVICE_PATH_PROTOCOL *dp = NULL;
+    HARDDRIVE_DEVICE_PATH *hd;
+    if (EFI_ERROR(BS->HandleProtocol(handles[i], &gEfiDevicePathProtocolGuid, (void **)&dp)) ||
+        !dp || !(hd = LastHdNode(dp)))
+      continue;  // whole disks and non-partition devices
+    gPartitions[gPartitionCount].Hd = hd;
+    gPartitions[gPartitionCount].Path = dp;
+    gPartitionCount++;
+  }
+  FreePool(handles);
+}
+
+static void PartitionIndexReset(void) {
+  gPartitionCount = 0;
+  gPartitionsIndexed = FALSE;
+}
+
+// GPT partitions match on the partition GUID; MBR ones on the disk signature
+// and partition number, since every partition of a disk shares the signature.
+static EFI_DEVICE_PATH_PROTOCOL *PartitionLookup(HARDDRIVE_DEVICE_PATH *key) {
+  UINTN i;
+  if (key->SignatureType != SIGNATURE_TYPE_GUID && key->SignatureType != SIGNATURE_TYPE_MBR)
+    return NULL;
+  if (!gPartitionsIndexed) PartitionIndexBuild();
+  for (i = 0; i < gPartitionCount; ++i) {
+    HARDDRIVE_DEVICE_PATH *hd = gPartitions[i].Hd;
+    if (hd->SignatureType != key->SignatureType) continue;
+    if (key->SignatureType == SIGNATURE_TYPE_GUID) {
+      if (!CompareMem(hd->Signature, key->Signature, 16)) return gPartitions[i].Path;
+    } else if (!CompareMem(hd->Signature, key->Signature, 4) &&
+               hd->PartitionNumber == key->PartitionNumber) {
+      return gPartitions[i].Path;
+    }
+  }
+  return NULL;
+}
+
+// Joins a partition's full path (End stripped) with `tail` (End included).
+static EFI_DEVICE_PATH_PROTOCOL *AppendToPartition(EFI_DEVICE_PATH_PROTOCOL *partition,
+                                                  EFI_DEVICE_PATH_PROTOCOL *tail) {
+  EFI_DEVICE_PATH_PROTOCOL *out;
+  UINTN devLen = DevicePathSize(partition), tlen = DevicePathSize(tail);
+
+  if (devLen < 4 || tlen < 4) return NULL;
+  devLen -= 4;  // strip the partition path's End node
+  if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, devLen + tlen, (void **)&out)) || !out)
+    return NULL;
+  CopyMem(out, partition, devLen);             // hardware path to the partition
+  CopyMem((UINT8 *)out + devLen, tail, tlen);  // target's nodes after HD() + End
+  return out;
+}
+
+// This firmware's Boot#### entries are short-form (HD(sig)/File, no hardware
+// prefix) and its LoadImage won't expand them (EFI_NOT_FOUND). Rebuild a FULL
+// path: the partition whose HD() signature the entry names, looked up in the
+// partition index, + the nodes after HD(). If that partition isn't indexed,
+// the partition we were loaded from + the target's File node + End. Returns
+// NULL on failure (caller falls back to short-form).
+static EFI_DEVICE_PATH_PROTOCOL *BuildFullPath(EFI_DEVICE_PATH_PROTOCOL *target) {
+  EFI_LOADED_IMAGE *li = NULL;
+  EFI_DEVICE_PATH_PROTOCOL *devDp = NULL, *targFile, *out;
+  UINTN devLen, tlen;
+  UINT8 *p;
+
+  if (DevicePathType(target) == MEDIA_DEVICE_PATH &&
+      DevicePathSubType(target) == MEDIA_HARDDRIVE_DP &&
+      DevicePathNodeLength(target) >= sizeof(HARDDRIVE_DEVICE_PATH) &&
+      (devDp = PartitionLookup((HARDDRIVE_DEVICE_PATH *)target)))
+    return AppendToPartition(devDp, NextDevicePathNode(target));
+
+  if (EFI_ERROR(BS->HandleProtocol(IM, &gEfiLoadedImageProtocolGuid, (void **)&li)) || !li)
+    return NULL;
+  if (EFI_ERROR(BS->HandleProtocol(li->DeviceHandle, &gEfiDevicePathProtocolGuid,
+                                   (void **)&devDp)) ||
+      !devDp)
+    return NULL;
+  targFile = FindFilePathNode(target);
+  if (!targFile) return NULL;
+
+  devLen = DevicePathSize(devDp);
+  if (devLen < 4) return NULL;
+  devLen -= 4;  // strip the partition path's End node
+  tlen = (UINTN)DevicePathNodeLength(targFile);
+
+  if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, devLen + tlen + 4, (void **)&out)) || !out)
+    return NULL;
+  p = (UINT8 *)out;
+  CopyMem(p, devDp, devLen);             // hardware path to our partition
+  CopyMem(p + devLen, targFile, tlen);   // target's File node
+  p[devLen + tlen + 0] = 0x7f;           // End-of-device-path
+  p[devLen + tlen + 1] = 0xff;
+  p[devLen + tlen + 2] = 0x04;
+  p[devLen + tlen + 3] = 0x00;
+  return out;
+}
+#endif  // !DRIVER_BUILD
+
+// ---------------------------------------------------------------------------
+// MSR read/write helpers
+//
+// Hosted tests (test/governor, test/s3) build with -DMOCK_MSR and define MSR
+// and CPUID access themselves.
+// ---------------------------------------------------------------------------
+#ifdef MOCK_MSR
+static uint64_t AsmWriteMsr64(uint32_t index, uint64_t val);
+static uint64_t AsmReadMsr64(uint32_t index);
+static void AsmCpuid(uint32_t leaf, uint32_t subleaf, uint32_t r[4]);
+#else
+static uint64_t AsmWriteMsr64(uint32_t index, uint64_t val) {
+  uint32_t low = (uint32_t)(val);
+  uint32_t high = (uint32_t)(val >> 32);
+  __asm__ __volatile__("wrmsr" : : "c"(index), "a"(low), "d"(high) : "memory");
+  return val;
+}
+
+static uint64_t AsmReadMsr64(uint32_t index) {
+  uint32_t low, high;
+  __asm__ __volatile__("rdmsr" : "=a"(low), "=d"(high) : "c"(index) : "memory");
+  return ((uint64_t)high << 32) | low;
+}
+
+static void AsmCpuid(uint32_t leaf, uint32_t subleaf, uint32_t r[4]) {
+  __asm__ __volatile__("cpuid"
+                       : "=a"(r[0]), "=b"(r[1]), "=c"(r[2]), "=d"(r[3])
+                       : "a"(leaf), "c"(subleaf));
+}
+#endif
+
+static uint64_t AsmReadTsc(void) {
+  uint32_t low, high;
+  __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+  return ((uint64_t)high << 32) | low;
+}
+
+// ---------------------------------------------------------------------------
+// Fault-tolerant MSR access
+//
+// While armed, a #GP handler patched into the IDT recovers from faults raised
+// by the rdmsr/wrmsr in SafeMsrRead/SafeMsrWrite: it skips the instruction and
+// sets r8, which the accessor returns as its fault flag. The state lives in
+// registers, so every CPU sharing the IDT (EDK2 APs load the BSP's) can use it
+// at once; an AP with an IDT of its own gets the gate patched there for each
+// dispatch pass. Any other #GP goes on to the firmware's handler. Probe results
+// are cached per MSR for the boot.
+// ---------------------------------------------------------------------------
+// UINT64 EFIAPI SafeMsrRead(UINT32 msr, UINT64 *value)   -> 0, or 1 on #GP
+// UINT64 EFIAPI SafeMsrWrite(UINT32 msr, UINT64 value)   -> 0, or 1 on #GP
+__asm__(".text\n"
+        ".globl SafeMsrRead\n"
+        "SafeMsrRead:\n"
+        "  movq %rdx, %r9\n"
+        "  xorl %r8d, %r8d\n"
+        "SafeMsrReadInsn:\n"
+        "  rdmsr\n"
+        "  shlq $32, %rdx\n"
+        "  orq %rdx, %rax\n"
+        "  movq %rax, (%r9)\n"
+        "  movq %r8, %rax\n"
+        "  ret\n"
+        ".globl SafeMsrWrite\n"
+        "SafeMsrWrite:\n"
+        "  movq %rdx, %rax\n"
+        "  shrq $32, %rdx\n"
+        "  xorl %r8d, %r8d\n"
+        "SafeMsrWriteInsn:\n"
+        "  wrmsr\n"
+        "  movq %r8, %rax\n"
+        "  ret\n"
+        // Entry: [rsp] error code, [rsp+8] faulting RIP.
+        ".globl SafeMsrGpHandler\n"
+        "SafeMsrGpHandler:\n"
+        "  pushq %rax\n"
+        "  leaq SafeMsrReadInsn(%rip), %rax\n"
+        "  cmpq %rax, 16(%rsp)\n"
+        "  je 1f\n"
+        "  leaq SafeMsrWriteInsn(%rip), %rax\n"
+        "  cmpq %rax, 16(%rsp)\n"
+        "  je 1f\n"
+        "  popq %rax\n"
+        "  jmpq *SafeMsrPrevGp(%rip)\n"
+        "1:\n"
+        "  addq $2, 16(%rsp)\n"  // past the 2-byte rdmsr/wrmsr
+        "  movl $1, %r8d\n"
+        "  popq %rax\n"
+        "  addq $8, %rsp\n"
+        "  iretq\n"
+        ".data\n"
+        ".balign 8\n"
+        ".globl SafeMsrPrevGp\n"
+        "SafeMsrPrevGp:\n"
+        "  .quad 0\n"
+        ".text\n");
+
+extern UINT64 EFIAPI SafeMsrRead(UINT32 msr, UINT64 *value);
+extern UINT64 EFIAPI SafeMsrWrite(UINT32 msr, UINT64 value);
+extern const UINT8 SafeMsrGpHandler[];
+extern UINT64 SafeMsrPrevGp;
+
+#define EXCEPT_GP_FAULT 13
+
+typedef struct __attribute__((packed)) {
+  UINT16 Limit;
+  UINT64 Base;
+} IDT_REGISTER;
+
+typedef struct __attribute__((packed)) {
+  UINT16 OffsetLow;
+  UINT16 Selector;
+  UINT8 Ist;
+  UINT8 Attributes;
+  UINT16 OffsetMid;
+  UINT32 OffsetHigh;
+  UINT32 Reserved;
+} IDT_GATE;
+
+static IDT_GATE *gArmedGate;  // NULL: raw MSR access
+static IDT_GATE gSavedGate;
+static volatile UINT8 gGateLock;  // serialises APs patching a shared private IDT
+
+static UINT64 GateTarget(const IDT_GATE *gate) {
+  return (UINT64)gate->OffsetLow | ((UINT64)gate->OffsetMid << 16) |
+         ((UINT64)gate->OffsetHigh << 32);
+}
+
+// Point the calling CPU's #GP vector at SafeMsrGpHandler, returning the gate
+// in *armed and its old contents in *saved. FALSE if the IDT has no #GP entry
+// or the vector is already ours (an IDT shared with a CPU armed earlier).
+static BOOLEAN SafeMsrPatch(IDT_GATE **armed, IDT_GATE *saved) {
+  IDT_REGISTER idtr;
+  IDT_GATE *gate;
+  UINT64 handler = (UINT64)(UINTN)SafeMsrGpHandler;
+  BOOLEAN patched = FALSE;
+
+  __asm__ __volatile__("sidt %0" : "=m"(idtr));
+  if (idtr.Limit < (EXCEPT_GP_FAULT + 1) * sizeof(IDT_GATE) - 1) return FALSE;
+  gate = (IDT_GATE *)(UINTN)idtr.Base + EXCEPT_GP_FAULT;
+  while (__atomic_test_and_set(&gGateLock, __ATOMIC_ACQUIRE)) __asm__ __volatile__("pause");
+  if (GateTarget(gate) != handler) {
+    *saved = *gate;
+    if (armed == &gArmedGate) SafeMsrPrevGp = GateTarget(gate);
+    gate->OffsetLow = (UINT16)handler;
+    gate->OffsetMid = (UINT16)(handler >> 16);
+    gate->OffsetHigh = (UINT32)(handler >> 32);
+    *armed = gate;
+    patched = TRUE;
+  }
+  __atomic_clear(&gGateLock, __ATOMIC_RELEASE);
+  return patched;
+}
+
+// Arm the BSP until SafeMsrDisarm. APs that loaded an IDT of their own are
+// armed per pass by ApplyPolicyOnCpu; their non-MSR faults chain to the BSP's
+// previous handler, which on EDK2 is the same common exception entry.
+static void SafeMsrArm(void) {
+  if (gArmedGate) return;
+  SafeMsrPatch(&gArmedGate, &gSavedGate);
+}
+
+static void SafeMsrDisarm(void) {
+  if (!gArmedGate) return;
+  *gArmedGate = gSavedGate;
+  gArmedGate = NULL;
+}
+
+// EFI_UNSUPPORTED if the read faulted (no such MSR).
+static EFI_STATUS MsrRead(UINT32 msr, UINT64 *value) {
+  if (!gArmedGate) {
+    *value = AsmReadMsr64(msr);
+    return EFI_SUCCESS;
+  }
+  return SafeMsrRead(msr, value) ? EFI_UNSUPPORTED : EFI_SUCCESS;
+}
+
+// EFI_ACCESS_DENIED if the write faulted (read-only, locked or reserved bits).
+static EFI_STATUS MsrWrite(UINT32 msr, UINT64 value) {
+  if (!gArmedGate) {
+    AsmWriteMsr64(msr, value);
+    return EFI_SUCCESS;
+  }
+  return SafeMsrWrite(msr, value) ? EFI_ACCESS_DENIED : EFI_SUCCESS;
+}
+
+#define MSR_SUPPORTED 0x01  // reads without faulting
+#define MSR_WRITABLE 0x02   // writing the current value back didn't fault
+#define MSR_LOCKED 0x04     // the given lock bit was set; write not tried
+#define MSR_READ_ONLY 0x08  // writing the current value back faulted
+#define MSR_CAPS_MAX 64
+
+static struct {
+  UINT32 Msr;
+  UINT8 Caps;
+} gMsrCaps[MSR_CAPS_MAX];
+static UINTN gMsrCapsCount;
+static BOOLEAN gMsrCapsChanged;  // probed or upgraded since the map was loaded
+
+// What the calling CPU allows on `msr`, probed once per boot: a read and, only
+// if `write` says the policy is about to write it, the value written back
+// unless lockBit (< 64) is set. A map entry probed read-only is completed by
+// the first caller that needs the write. Unarmed, everything is assumed to
+// work, as with raw access.
+static UINT8 MsrProbe(UINT32 msr, UINT8 lockBit, BOOLEAN write) {
+  UINT64 v;
+  UINT8 caps = 0;
+  UINTN i;
+
+  if (!gArmedGate) return MSR_SUPPORTED | MSR_WRITABLE;
+  for (i = 0; i < gMsrCapsCount; ++i)
+    if (gMsrCaps[i].Msr == msr) break;
+  if (i < gMsrCapsCount &&
+      (!write || gMsrCaps[i].Caps != MSR_SUPPORTED))  // write known, or no MSR
+    return gMsrCaps[i].Caps;
+
+  if (!EFI_ERROR(MsrRead(msr, &v))) {
+    caps = MSR_SUPPORTED;
+    if (lockBit < 64 && ((v >> lockBit) & 1))
+      caps |= MSR_LOCKED;
+    else if (write)
+      caps |= EFI_ERROR(MsrWrite(msr, v)) ? MSR_READ_ONLY : MSR_WRITABLE;
+  }
+  if (i == gMsrCapsCount && gMsrCapsCount < MSR_CAPS_MAX) gMsrCapsCount++;
+  if (i < gMsrCapsCount) {
+    gMsrCaps[i].Msr = msr;
+    gMsrCaps[i].Caps = caps;
+    gMsrCapsChanged = TRUE;
+  }
+  return caps;
+}
+
+// App settings; the profile's "set key=value" lines change them.
+typedef struct {
+  BOOLEAN Resident;
+  UINT32 ResidentIntervalMs;
+  BOOLEAN Diagnostics;
+  BOOLEAN HwpEnable;  // set IA32_PM_ENABLE where firmware left HWP off
+  BOOLEAN Governor;
+  UINT32 GovernorIntervalMs;
+  UINT8 GovernorTripC;        // throttle at or above this
+  UINT8 GovernorHysteresisC;  // release this far below the trip point
+  UINT8 GovernorRatio;        // ratio while throttled
+  UINT8 LogConsole;           // LOG_CONSOLE_*
+  UINT8 FixClamps;            // 1 << CLAMP_* for each clamp fix turned on
+} SETTINGS;
+
+static SETTINGS gSettings = {FALSE, 100, FALSE, FALSE, FALSE, 100, 95, 5, 8, LOG_CONSOLE_AUTO, 0};
+
+// ---------------------------------------------------------------------------
+// MSR policy
+//
+// A table of masked read-modify-writes. For each entry the thread leading its
+// scope writes (msr & ~Mask) | Value unless the MSR's lock bit is set, then
+// every thread reads it back. The built-in table is the original full unlock;
+// a profile next to the app on the ESP replaces it.
+// ---------------------------------------------------------------------------
+#define MSR_POWER_CTL 0x1FC
+#define POWER_CTL_BD_PROCHOT (1ULL << 0)
+#define POWER_CTL_VR_THERM_ALERT_DISABLE (1ULL << 24)
+#define POWER_CTL_C1E (1ULL << 1)
+#define MSR_PKG_CST_CONFIG_CONTROL 0xE2
+#define PKG_CST_LIMIT_MASK 0xFULL  // bits 3:0, encoding is model specific
+#define PKG_CST_LOCK_BIT 15
+#define MSR_UNCORE_RATIO_LIMIT 0x620
+#define UNCORE_RATIO_MAX_MASK 0x7FULL    // bits 6:0
+#define UNCORE_RATIO_MIN_MASK 0x7F00ULL  // bits 14:8
+
+// MSR scopes, as a bitmask of which scopes a given thread leads.
+#define SCOPE_THREAD 0x1
+#define SCOPE_CORE 0x2
+#define SCOPE_MODULE 0x4
+#define SCOPE_PACKAGE 0x8
+
+#define LOCK_NONE 0xFF
+#define MATCH_ANY 0xFFFF
+#define POLICY_MAX_ENTRIES 32
+
+typedef struct {
+  UINT32 Msr;
+  UINT8 Scope;    // SCOPE_* whose leader writes it
+  UINT8 LockBit;  // bit that makes the MSR read-only, or LOCK_NONE
+  UINT16 Family;  // CPUID display family, or MATCH_ANY
+  UINT16 Model;   // CPUID display model, or MATCH_ANY
+  UINT64 Mask;    // bits the entry owns
+  UINT64 Value;   // their wanted state, within Mask
+} POLICY_ENTRY;
+
+// Per-entry outcome, bumped atomically from every CPU.
+typedef struct {
+  UINT32 Written;    // leaders that wrote it
+  UINT32 Unchanged;  // leaders that found it already set
+  UINT32 Locked;     // leaders that found the lock bit set
+  UINT32 Verified;   // threads that read it back as wanted
+  UINT32 Failed;     // threads that read it back wrong
+  BOOLEAN Skipped;   // CPU family/model doesn't match, or Fault
+  UINT8 Fault;       // MSR_FAULT_*, from the BSP's probe
+} POLICY_RESULT;
+
+static POLICY_ENTRY gPolicy[POLICY_MAX_ENTRIES] = {
+    {MSR_POWER_CTL, SCOPE_CORE, LOCK_NONE, MATCH_ANY, MATCH_ANY,
+     POWER_CTL_BD_PROCHOT | POWER_CTL_VR_THERM_ALERT_DISABLE,
+     POWER_CTL_VR_THERM_ALERT_DISABLE},
+};
+static UINTN gPolicyCount = 1;
+static POLICY_RESULT gPolicyResult[POLICY_MAX_ENTRIES];
+static BOOLEAN gPolicyFromProfile;
+
+#define MSR_FAULT_READ 1   // not implemented
+#define MSR_FAULT_WRITE 2  // rejects writes
+
+#define ATOMIC_INC(x) __atomic_fetch_add(&(x), 1, __ATOMIC_RELAXED)
+#define ATOMIC_ADD(x, n) __atomic_fetch_add(&(x), (n), __ATOMIC_RELAXED)
+
+static void CpuFamilyModel(UINT16 *family, UINT16 *model) {
+  uint32_t r[4], base;
+  AsmCpuid(1, 0, r);
+  base = (r[0] >> 8) & 0xF;
+  *family = (UINT16)(base == 0xF ? base + ((r[0] >> 20) & 0xFF) : base);
+  *model = (UINT16)((r[0] >> 4) & 0xF);
+  if (base == 0x6 || base == 0xF) *model |= (UINT16)(((r[0] >> 16) & 0xF) << 4);
+}
+
+static BOOLEAN GenuineIntel(void) {
+  uint32_t r[4];
+
+  AsmCpuid(0, 0, r);
+  return r[1] == 0x756E6547 && r[3] == 0x49656E69 && r[2] == 0x6C65746E;
+}
+
+// GenuineIntel, family 6: where the model-specific MSRs below are defined.
+static BOOLEAN IntelFamily6(void) {
+  UINT16 family, model;
+
+  if (!GenuineIntel()) return FALSE;
+  CpuFamilyModel(&family, &model);
+  return family == 6;
+}
+
+// Reset the outcome counters and rule out entries meant for other CPUs, or
+// whose MSR faults here (probed on the BSP). Writability is only probed for
+// entries the BSP doesn't already hold at the policy value.
+static void PreparePolicy(void) {
+  UINT16 family, model;
+  UINT64 v;
+  UINTN i;
+
+  CpuFamilyModel(&family, &model);
+  for (i = 0; i < gPolicyCount; ++i) {
+    POLICY_RESULT *r = &gPolicyResult[i];
+    UINT8 caps;
+    r->Written = r->Unchanged = r->Locked = r->Verified = r->Failed = 0;
+    r->Fault = 0;
+    r->Skipped = (gPolicy[i].Family != MATCH_ANY && gPolicy[i].Family != family) ||
+                 (gPolicy[i].Model != MATCH_ANY && gPolicy[i].Model != model);
+    if (r->Skipped) continue;
+    caps = MsrProbe(gPolicy[i].Msr, gPolicy[i].LockBit,
+                    EFI_ERROR(MsrRead(gPolicy[i].Msr, &v)) ||
+                        (v & gPolicy[i].Mask) != gPolicy[i].Value);
+    if (!(caps & MSR_SUPPORTED))
+      r->Fault = MSR_FAULT_READ;
+    else if (caps & MSR_READ_ONLY)
+      r->Fault = MSR_FAULT_WRITE;
+    r->Skipped = r->Fault != 0;
+  }
+}
+
+static BOOLEAN PolicyLocked(POLICY_ENTRY *e, uint64_t v) {
+  return e->LockBit != LOCK_NONE && ((v >> e->LockBit) & 1);
+}
+
+// Write pass on the calling CPU: only the entries whose scope it leads.
+static void WritePolicyEntries(UINT8 leads) {
+  UINTN i;
+
+  for (i = 0; i < gPolicyCount; ++i) {
+    POLICY_ENTRY *e = &gPolicy[i];
+    POLICY_RESULT *r = &gPolicyResult[i];
+    uint64_t v;
+
+    if (r->Skipped || !(leads & e->Scope)) continue;
+    if (EFI_ERROR(MsrRead(e->Msr, &v))) {
+      ATOMIC_INC(r->Failed);  // faults here though not on the BSP
+    } else if (PolicyLocked(e, v)) {
+      ATOMIC_INC(r->Locked);
+    } else if ((v & e->Mask) == e->Value) {
+      ATOMIC_INC(r->Unchanged);
+    } else if (EFI_ERROR(MsrWrite(e->Msr, (v & ~e->Mask) | e->Value))) {
+      ATOMIC_INC(r->Failed);
+    } else {
+      ATOMIC_INC(r->Written);
+    }
+  }
+}
+
+// Verify pass on the calling CPU; returns how many entries didn't take here.
+// Locked MSRs are reported by the write pass, not counted again as failures.
+static UINT16 VerifyPolicyEntries(void) {
+  UINT16 failed = 0;
+  UINTN i;
+
+  for (i = 0; i < gPolicyCount; ++i) {
+    POLICY_ENTRY *e = &gPolicy[i];
+    POLICY_RESULT *r = &gPolicyResult[i];
+    uint64_t v;
+
+    if (r->Skipped) continue;
+    if (EFI_ERROR(MsrRead(e->Msr, &v))) {
+      ATOMIC_INC(r->Failed);
+      failed++;
+      continue;
+    }
+    if (PolicyLocked(e, v)) continue;
+    if ((v & e->Mask) == e->Value) {
+      ATOMIC_INC(r->Verified);
+    } else {
+      ATOMIC_INC(r->Failed);
+      failed++;
+    }
+  }
+  return failed;
+}
+
+// Resident mode's check on the calling CPU: rewrite the entries in watch
+// (bit i: gPolicy[i]) of the scopes it leads that no longer hold. Returns how
+// many had to be rewritten.
+static UINT32 ReassertPolicy(UINT32 watch, UINT8 leads) {
+  UINT32 rewrites = 0;
+  UINTN i;
+
+  for (i = 0; i < gPolicyCount; ++i) {
+    POLICY_ENTRY *e = &gPolicy[i];
+    uint64_t v;
+
+    if (!(watch & (1u << i)) || !(leads & e->Scope)) continue;
+    v = AsmReadMsr64(e->Msr);
+    if (PolicyLocked(e, v) || (v & e->Mask) == e->Value) continue;
+    AsmWriteMsr64(e->Msr, (v & ~e->Mask) | e->Value);
+    rewrites++;
+  }
+  return rewrites;
+}
+
+// ---------------------------------------------------------------------------
+// Throttle diagnostics
+//
+// Opt-in ("set diagnostics=on"): every core leader takes a snapshot before and
+// after the policy, in the same dispatch as the MSR writes. It holds the
+// thermal status, the perf-limit reasons, the effective frequency from
+// APERF/MPERF over a fixed busy window and, on package leaders, package power
+// from the RAPL energy counter over the same window. The result goes to
+// DisablePROCHOTDiagnostics so fleet monitoring can see which clamp was active
+// and what the unlock recovered.
+// ---------------------------------------------------------------------------
+#define MSR_MPERF 0xE7
+#define MSR_APERF 0xE8
+#define MSR_THERM_STATUS 0x19C
+#define MSR_PACKAGE_THERM_STATUS 0x1B1
+#define MSR_RAPL_POWER_UNIT 0x606
+#define MSR_PKG_ENERGY_STATUS 0x611
+#define MSR_CORE_PERF_LIMIT_REASONS 0x64F
+#define MSR_GT_PERF_LIMIT_REASONS 0x6B0
+#define MSR_RING_PERF_LIMIT_REASONS 0x6B1
+
+// Sources a snapshot reads, decided once from CPUID. The reads go through
+// MsrRead, so an MSR that faults anyway (a hypervisor, a model the table gets
+// wrong) leaves its field 0 instead of hanging the dispatch.
+#define DIAG_SRC_THERM 0x01
+#define DIAG_SRC_PKG_THERM 0x02
+#define DIAG_SRC_LIMIT_REASONS 0x04
+#define DIAG_SRC_APERF_MPERF 0x08
+#define DIAG_SRC_PKG_ENERGY 0x10
+
+#define DIAG_WINDOW_US 10000  // RAPL updates about every 1 ms
+#define DIAG_MAX_CPUS 128     // keeps the record under 8 KB
+
+typedef struct __attribute__((packed)) {
+  UINT32 ThermStatus;       // IA32_THERM_STATUS, low half
+  UINT32 PkgThermStatus;    // IA32_PACKAGE_THERM_STATUS, low half
+  UINT32 CoreLimitReasons;  // low halves of 0x64F, 0x6B0, 0x6B1
+  UINT32 GtLimitReasons;
+  UINT32 RingLimitReasons;
+  UINT32 EffectiveMhz;   // TSC rate * dAPERF / dMPERF
+  UINT32 PkgMilliwatts;  // package leaders only
+} DIAG_SAMPLE;
+
+typedef struct __attribute__((packed)) {
+  UINT32 ApicId;
+  DIAG_SAMPLE Before;
+  DIAG_SAMPLE After;
+} DIAG_CPU;
+
+#define DIAG_RECORD_SIGNATURE 0x47445044  // 'DPDG'
+#define DIAG_RECORD_VERSION 1
+
+typedef struct __attribute__((packed)) {
+  UINT32 Signature;
+  UINT16 Version;
+  UINT16 Count;  // DIAG_CPU entries that follow
+  UINT32 Sources;
+  UINT32 TscKhz;
+  UINT32 WindowUs;
+  UINT16 Cores;  // cores sampled; more than Count if the record was cut
+  UINT16 Reserved;
+} DIAG_RECORD_HEADER;
+
+// Family 6 client parts with the perf-limit-reason MSRs (and RAPL): Haswell
+// through Meteor Lake.
+static const UINT8 kLimitReasonModels[] = {
+    0x3C, 0x45, 0x46, 0x3D, 0x47, 0x4E, 0x5E, 0x8E, 0x9E, 0xA5, 0xA6, 0xA7,
+    0x7D, 0x7E, 0x8C, 0x8D, 0x97, 0x9A, 0xB7, 0xBA, 0xBF, 0xAA, 0xAC};
+
+static UINT32 DiagSources(void) {
+  uint32_t r[4];
+  UINT32 sources = 0;
+  UINT16 family, model;
+  UINTN i;
+
+  AsmCpuid(0, 0, r);
+  if (r[0] < 6) return 0;
+  AsmCpuid(6, 0, r);
+  if (r[2] & 1) sources |= DIAG_SRC_APERF_MPERF;
+  if (!GenuineIntel()) return sources;
+  if (r[0] & 0x01) sources |= DIAG_SRC_THERM;
+  if (r[0] & 0x40) sources |= DIAG_SRC_PKG_THERM;
+  CpuFamilyModel(&family, &model);
+  for (i = 0; family == 6 && i < sizeof(kLimitReasonModels); ++i)
+    if (kLimitReasonModels[i] == model)
+      sources |= DIAG_SRC_LIMIT_REASONS | DIAG_SRC_PKG_ENERGY;
+  return sources;
+}
+
+// Low half of `msr`, 0 if it faults.
+static UINT32 DiagRead32(UINT32 msr) {
+  UINT64 v;
+  return EFI_ERROR(MsrRead(msr, &v)) ? 0 : (UINT32)v;
+}
+
+// MPERF then APERF; FALSE if either faults.
+static BOOLEAN DiagReadPerf(UINT64 *m, UINT64 *a) {
+  return !EFI_ERROR(MsrRead(MSR_MPERF, m)) && !EFI_ERROR(MsrRead(MSR_APERF, a));
+}
+
+// Package energy counter and its RAPL energy status unit; FALSE if either faults.
+static BOOLEAN DiagReadEnergy(UINT64 *e, UINT64 *esu) {
+  if (EFI_ERROR(MsrRead(MSR_PKG_ENERGY_STATUS, e)) ||
+      EFI_ERROR(MsrRead(MSR_RAPL_POWER_UNIT, esu)))
+    return FALSE;
+  *esu = (*esu >> 8) & 0x1F;
+  return TRUE;
+}
+
+// Snapshot on the calling CPU; spins for windowTicks of TSC.
+static void DiagSample(DIAG_SAMPLE *s, UINT8 leads, UINT32 sources, UINT64 windowTicks,
+                       UINT32 tscKhz) {
+  BOOLEAN energy = (sources & DIAG_SRC_PKG_ENERGY) && (leads & SCOPE_PACKAGE);
+  BOOLEAN perf = (sources & DIAG_SRC_APERF_MPERF) != 0;
+  UINT64 a0 = 0, m0 = 0, e0 = 0, a1, m1, e1, esu, t0, t1;
+
+  if (sources & DIAG_SRC_THERM) s->ThermStatus = DiagRead32(MSR_THERM_STATUS);
+  if (sources & DIAG_SRC_PKG_THERM) s->PkgThermStatus = DiagRead32(MSR_PACKAGE_THERM_STATUS);
+  if (sources & DIAG_SRC_LIMIT_REASONS) {
+    s->CoreLimitReasons = DiagRead32(MSR_CORE_PERF_LIMIT_REASONS);
+    s->GtLimitReasons = DiagRead32(MSR_GT_PERF_LIMIT_REASONS);
+    s->RingLimitReasons = DiagRead32(MSR_RING_PERF_LIMIT_REASONS);
+  }
+
+  perf = perf && DiagReadPerf(&m0, &a0);
+  energy = energy && DiagReadEnergy(&e0, &esu);
+  t0 = AsmReadTsc();
+  do {
+    t1 = AsmReadTsc();
+  } while (t1 - t0 < windowTicks);
+
+  if (perf && DiagReadPerf(&m1, &a1)) {
+    UINT64 dm = m1 - m0, da = a1 - a0;
+    s->EffectiveMhz = dm ? (UINT32)(da * tscKhz / dm / 1000) : 0;
+  }
+  if (energy && DiagReadEnergy(&e1, &esu)) {
+    // 32-bit counter in 1/2^ESU J; uJ over the window's us is W.
+    UINT64 de = (UINT32)(e1 - e0);
+    UINT64 us = tscKhz ? (t1 - t0) * 1000 / tscKhz : 0;
+    s->PkgMilliwatts = us ? (UINT32)(((de * 1000000) >> esu) * 1000 / us) : 0;
+  }
+}
+
+// Compact the core leaders' snapshots into the record and publish it.
+static void PublishDiagnostics(DIAG_CPU *cpus, BOOLEAN *sampled, UINTN count,
+                               UINT32 sources, UINT32 tscKhz) {
+  static struct __attribute__((packed)) {
+    DIAG_RECORD_HEADER Header;
+    DIAG_CPU Cpu[DIAG_MAX_CPUS];
+  } rec;
+  UINTN i, cores = 0;
+
+  rec.Header.Signature = DIAG_RECORD_SIGNATURE;
+  rec.Header.Version = DIAG_RECORD_VERSION;
+  rec.Header.Sources = sources;
+  rec.Header.TscKhz = tscKhz;
+  rec.Header.WindowUs = DIAG_WINDOW_US;
+  for (i = 0; i < count; ++i) {
+    if (!sampled[i]) continue;
+    if (cores < DIAG_MAX_CPUS) rec.Cpu[cores] = cpus[i];
+    cores++;
+  }
+  rec.Header.Cores = (UINT16)cores;
+  rec.Header.Count = (UINT16)(cores < DIAG_MAX_CPUS ? cores : DIAG_MAX_CPUS);
+  RT->SetVariable(L"DisablePROCHOTDiagnostics", &gDisablePROCHOTVendorGuid,
+                  EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS,
+                  sizeof(rec.Header) + rec.Header.Count * sizeof(DIAG_CPU), &rec);
+
+  OutputNum(L"Diagnostics: ", cores, L" cores sampled");
+  if (!cores) {
+    Output(L"\r\n");
+    return;
+  }
+  // The first core leader sampled, as recorded first.
+  OutputNum(L", CPU ", rec.Cpu[0].ApicId, L" at ");
+  OutputNum(L"", rec.Cpu[0].Before.EffectiveMhz, L" -> ");
+  OutputNum(L"", rec.Cpu[0].After.EffectiveMhz, L" MHz\r\n");
+}
+
+// ---------------------------------------------------------------------------
+// HWP requests per core type
+//
+// Profile "hwp <p|e|all> min= max= desired= epp=" lines give each core type its
+// own IA32_HWP_REQUEST fields (ratios, EPP 0 = performance .. 255 = energy).
+// In the write pass every thread with HWP (CPUID 6) looks up its core type
+// (CPUID 0x1A on hybrid parts; everything else counts as a P-core), turns HWP
+// on if allowed, then rewrites the fields it was given and reads them back.
+// HWP_REQUEST is per thread, so there's no leader here.
+// ---------------------------------------------------------------------------
+#define MSR_PM_ENABLE 0x770
+#define MSR_HWP_REQUEST 0x774
+
+#define CPUID6_HWP (1u << 7)
+#define CPUID6_HWP_EPP (1u << 10)
+#define CPUID7_EDX_HYBRID (1u << 15)
+#define CPUID1A_CORE_ATOM 0x20
+
+enum { HWP_CORE_P, HWP_CORE_E, HWP_CORE_TYPES };
+
+// HWP_CONFIG.Set bits, in HWP_REQUEST field order.
+#define HWP_MIN 0x1       // bits 7:0
+#define HWP_MAX 0x2       // bits 15:8
+#define HWP_DESIRED 0x4   // bits 23:16, 0 = hardware picks
+#define HWP_EPP 0x8       // bits 31:24
+
+typedef struct {
+  UINT8 Set;  // HWP_* fields to program; 0 leaves the core type alone
+  UINT8 Field[4];
+} HWP_CONFIG;
+
+static HWP_CONFIG gHwp[HWP_CORE_TYPES];
+
+static struct {
+  UINT32 Programmed[HWP_CORE_TYPES];  // threads whose request reads back right
+  UINT32 Enabled;                     // threads we turned HWP on for
+  UINT32 Disabled;                    // HWP off and hwp_enable not set
+  UINT32 Unsupported;                 // no HWP in CPUID, or its MSRs fault
+  UINT32 NoEpp;                       // EPP asked for but not implemented
+  UINT32 Failed;                      // request didn't read back
+} gHwpResult;
+
+static UINT8 HwpCoreType(void) {
+  uint32_t r[4], maxLeaf;
+
+  AsmCpuid(0, 0, r);
+  maxLeaf = r[0];
+  if (maxLeaf < 0x1A) return HWP_CORE_P;
+  AsmCpuid(7, 0, r);
+  if (!(r[3] & CPUID7_EDX_HYBRID)) return HWP_CORE_P;
+  AsmCpuid(0x1A, 0, r);
+  return (r[0] >> 24) == CPUID1A_CORE_ATOM ? HWP_CORE_E : HWP_CORE_P;
+}
+
+// Write pass on the calling CPU.
+static void ApplyHwp(void) {
+  uint32_t r[4];
+  HWP_CONFIG *c;
+  UINT8 type, set;
+  UINT64 v, want;
+  UINTN f;
+
+  if (!(gHwp[HWP_CORE_P].Set | gHwp[HWP_CORE_E].Set)) return;
+  AsmCpuid(0, 0, r);
+  if (r[0] < 6) {
+    ATOMIC_INC(gHwpResult.Unsupported);
+    return;
+  }
+  AsmCpuid(6, 0, r);
+  if (!(r[0] & CPUID6_HWP)) {
+    ATOMIC_INC(gHwpResult.Unsupported);
+    return;
+  }
+  type = HwpCoreType();
+  c = &gHwp[type];
+  set = c->Set;
+  if (!set) return;
+  if ((set & HWP_EPP) && !(r[0] & CPUID6_HWP_EPP)) {
+    ATOMIC_INC(gHwpResult.NoEpp);
+    set &= (UINT8)~HWP_EPP;
+  }
+
+  if (EFI_ERROR(MsrRead(MSR_PM_ENABLE, &v))) {
+    ATOMIC_INC(gHwpResult.Unsupported);
+    return;
+  }
+  if (!(v & 1)) {
+    // Once set, PM_ENABLE stays set until reset.
+    if (!gSettings.HwpEnable) {
+      ATOMIC_INC(gHwpResult.Disabled);
+      return;
+    }
+    if (EFI_ERROR(MsrWrite(MSR_PM_ENABLE, v | 1))) {
+      ATOMIC_INC(gHwpResult.Unsupported);
+      return;
+    }
+    ATOMIC_INC(gHwpResult.Enabled);
+  }
+
+  if (EFI_ERROR(MsrRead(MSR_HWP_REQUEST, &v))) {
+    ATOMIC_INC(gHwpResult.Failed);
+    return;
+  }
+  want = v;
+  for (f = 0; f < 4; ++f) {
+    if (!(set & (1u << f))) continue;
+    want = (want & ~(0xFFULL << (f * 8))) | ((UINT64)c->Field[f] << (f * 8));
+  }
+  if (want != v && EFI_ERROR(MsrWrite(MSR_HWP_REQUEST, want))) {
+    ATOMIC_INC(gHwpResult.Failed);
+    return;
+  }
+  if (EFI_ERROR(MsrRead(MSR_HWP_REQUEST, &v)) || v != want) {
+    ATOMIC_INC(gHwpResult.Failed);
+    return;
+  }
+  ATOMIC_INC(gHwpResult.Programmed[type]);
+}
+
+static void ReportHwp(void) {
+  if (!(gHwp[HWP_CORE_P].Set | gHwp[HWP_CORE_E].Set)) return;
+  OutputNum(L"HWP: ", gHwpResult.Programmed[HWP_CORE_P], L" P-core and ");
+  OutputNum(L"", gHwpResult.Programmed[HWP_CORE_E], L" E-core threads programmed\r\n");
+  if (gHwpResult.Enabled) OutputNum(L"HWP: enabled on ", gHwpResult.Enabled, L" CPUs\r\n");
+  if (gHwpResult.Disabled)
+    OutputNum(L"HWP: off on ", gHwpResult.Disabled, L" CPUs, set hwp_enable=on to turn it on\r\n");
+  if (gHwpResult.Unsupported)
+    OutputNum(L"HWP: not supported on ", gHwpResult.Unsupported, L" CPUs\r\n");
+  if (gHwpResult.NoEpp)
+    OutputNum(L"HWP: no EPP on ", gHwpResult.NoEpp, L" CPUs, epp ignored there\r\n");
+  if (gHwpResult.Failed) {
+    Log(LOG_WARN, L"HWP: request did not take on ");
+    OutputNum(L"", gHwpResult.Failed, L" CPUs\r\n");
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Clamp scanner
+//
+// PROCHOT isn't the only way firmware slows a CPU down. On Intel family 6 the
+// BSP also checks, against what the CPU reports it can do: turbo disabled by
+// IA32_MISC_ENABLE bit 38 or by EE_TURBO_DISABLE (POWER_CTL bit 19), an
+// IA32_PERF_CTL request below the base ratio while HWP is off, PL1/PL2 far
+// below the package TDP, and a config-TDP level below the fastest one. Each
+// clamp found is reported. Those whose "set fix_<name>=on" is in the profile
+// are appended to the policy table as masked writes, so they get the same
+// probe, lock check, readback, record, S3 replay and resident re-checks as any
+// other entry. The outcome goes to DisablePROCHOTClamps.
+// ---------------------------------------------------------------------------
+#define MSR_PLATFORM_INFO 0xCE
+#define MSR_PERF_CTL 0x199
+#define PERF_CTL_RATIO_MASK 0xFF00ULL  // bits 15:8
+#define MSR_MISC_ENABLE 0x1A0
+#define MISC_ENABLE_TURBO_DISABLE (1ULL << 38)
+#define MSR_TURBO_RATIO_LIMIT 0x1AD
+#define POWER_CTL_EE_TURBO_DISABLE (1ULL << 19)
+#define MSR_PKG_POWER_LIMIT 0x610
+#define PKG_PL1_MASK 0x7FFFULL  // bits 14:0, RAPL power units
+#define PKG_PL2_SHIFT 32
+#define PKG_POWER_LIMIT_LOCK_BIT 63
+#define MSR_PKG_POWER_INFO 0x614  // TDP in bits 14:0, same units
+#define MSR_CONFIG_TDP_NOMINAL 0x648
+#define MSR_CONFIG_TDP_LEVEL1 0x649
+#define MSR_CONFIG_TDP_LEVEL2 0x64A
+#define MSR_CONFIG_TDP_CONTROL 0x64B
+#define CONFIG_TDP_LEVEL_MASK 0x3ULL
+#define CONFIG_TDP_LOCK_BIT 31
+
+#define CLAMP_RECORD_SIGNATURE 0x4C435044  // 'DPCL'
+#define CLAMP_RECORD_VERSION 1
+
+enum {
+  CLAMP_TURBO,
+  CLAMP_EE_TURBO,
+  CLAMP_MIN_RATIO,
+  CLAMP_POWER_LIMITS,
+  CLAMP_CONFIG_TDP,
+  CLAMP_COUNT
+};
+
+// Per-clamp state, as recorded.
+enum {
+  CLAMP_UNSUPPORTED,  // not checked: not Intel family 6, or an MSR faulted
+  CLAMP_ABSENT,       // checked, not clamped
+  CLAMP_FOUND,        // clamped, its fix not enabled (or no room in the table)
+  CLAMP_LOCKED,       // clamped and the MSR is locked
+  CLAMP_FIXING,       // fix queued; the policy apply resolves it to one below
+  CLAMP_FIXED,        // fix read back on every CPU that has the MSR unlocked
+  CLAMP_FAILED,       // fix skipped, locked on some CPU or read back wrong
+};
+
+static const struct {
+  UINT32 Msr;
+  const char *Key;  // "set <Key>=on" enables the fix
+  CHAR16 *Name;
+  CHAR16 *Hint;
+} kClamps[CLAMP_COUNT] = {
+    {MSR_MISC_ENABLE, "fix_turbo", L"turbo disabled (IA32_MISC_ENABLE bit 38)",
+     L"set fix_turbo=on"},
+    {MSR_POWER_CTL, "fix_ee_turbo", L"turbo disabled (EE_TURBO_DISABLE, POWER_CTL bit 19)",
+     L"set fix_ee_turbo=on"},
+    {MSR_PERF_CTL, "fix_min_ratio", L"IA32_PERF_CTL ratio below base", L"set fix_min_ratio=on"},
+    {MSR_PKG_POWER_LIMIT, "fix_power_limits", L"PL1/PL2 far below TDP",
+     L"set fix_power_limits=on"},
+    {MSR_CONFIG_TDP_CONTROL, "fix_config_tdp", L"low config-TDP level selected",
+     L"set fix_config_tdp=on"},
+};
+
+typedef struct __attribute__((packed)) {
+  UINT32 Signature;
+  UINT16 Version;
+  UINT8 Count;    // CLAMP_COUNT
+  UINT8 Scanned;  // 0: not an Intel family 6 CPU, nothing checked
+  UINT8 Fix;      // enabled fixes, 1 << CLAMP_*
+  UINT8 Reserved[3];
+} CLAMP_RECORD_HEADER;
+
+typedef struct __attribute__((packed)) {
+  UINT32 Msr;
+  UINT8 State;  // CLAMP_* state
+  UINT8 Reserved[3];
+  UINT64 Value;  // the MSR as the scan found it on the BSP
+} CLAMP_RECORD_ENTRY;
+
+static struct {
+  BOOLEAN Scanned;
+  UINT8 State[CLAMP_COUNT];
+  UINT8 Entry[CLAMP_COUNT];  // gPolicy index of the fix while CLAMP_FIXING
+  UINT64 Value[CLAMP_COUNT];
+} gClamps;
+
+// Record one checked clamp and, if it's there, unlocked and its fix enabled,
+// queue (msr & ~mask) | value as a policy entry.
+static void ClampCheck(UINTN id, UINT64 v, BOOLEAN clamped, UINT8 scope, UINT8 lockBit,
+                       UINT64 mask, UINT64 value) {
+  POLICY_ENTRY e = {kClamps[id].Msr, scope, lockBit, MATCH_ANY, MATCH_ANY, mask, value};
+
+  gClamps.Value[id] = v;
+  if (!clamped) {
+    gClamps.State[id] = CLAMP_ABSENT;
+  } else if (PolicyLocked(&e, v)) {
+    gClamps.State[id] = CLAMP_LOCKED;
+  } else if (!(gSettings.FixClamps & (1u << id))) {
+    gClamps.State[id] = CLAMP_FOUND;
+  } else if (gPolicyCount == POLICY_MAX_ENTRIES) {
+    Log(LOG_WARN, L"Clamp fix ignored, policy table full\r\n");
+    gClamps.State[id] = CLAMP_FOUND;
+  } else {
+    gClamps.Entry[id] = (UINT8)gPolicyCount;
+    gPolicy[gPolicyCount++] = e;
+    gClamps.State[id] = CLAMP_FIXING;
+  }
+}
+
+// Runs on the BSP with the #GP handler armed, after the profile is loaded and
+// before the policy is applied.
+static void ScanClamps(void) {
+  uint32_t r[4];
+  UINT64 info = 0, v, tdp, pl1, pl2, mask, value;
+  UINT8 base = 0, turbo = 0, ratio[3], best;
+  BOOLEAN hwp = FALSE, hasTurbo;
+  UINTN i, levels;
+
+  gClamps.Scanned = IntelFamily6();
+  if (!gClamps.Scanned) return;
+  AsmCpuid(0, 0, r);
+  if (r[0] >= 6) {
+    AsmCpuid(6, 0, r);
+    hwp = (r[0] & CPUID6_HWP) && !EFI_ERROR(MsrRead(MSR_PM_ENABLE, &v)) && (v & 1);
+  }
+  if (!EFI_ERROR(MsrRead(MSR_PLATFORM_INFO, &info))) {
+    base = (UINT8)(info >> 8);
+    if (!EFI_ERROR(MsrRead(MSR_TURBO_RATIO_LIMIT, &v))) turbo = (UINT8)v;
+  }
+
+  // The part has turbo if its 1-core turbo ratio is above base. CPUID 6 can't
+  // tell: its turbo bit reads 0 while MISC_ENABLE bit 38 is set.
+  hasTurbo = base && turbo > base;
+  if (base && turbo && !EFI_ERROR(MsrRead(MSR_MISC_ENABLE, &v)))
+    ClampCheck(CLAMP_TURBO, v, hasTurbo && (v & MISC_ENABLE_TURBO_DISABLE), SCOPE_THREAD,
+               LOCK_NONE, MISC_ENABLE_TURBO_DISABLE, 0);
+  if (base && turbo && !EFI_ERROR(MsrRead(MSR_POWER_CTL, &v)))
+    ClampCheck(CLAMP_EE_TURBO, v, hasTurbo && (v & POWER_CTL_EE_TURBO_DISABLE), SCOPE_CORE,
+               LOCK_NONE, POWER_CTL_EE_TURBO_DISABLE, 0);
+  // With HWP on, IA32_PERF_CTL is ignored.
+  if (base && !EFI_ERROR(MsrRead(MSR_PERF_CTL, &v)))
+    ClampCheck(CLAMP_MIN_RATIO, v, !hwp && ((v & PERF_CTL_RATIO_MASK) >> 8) < base,
+               SCOPE_THREAD, LOCK_NONE, PERF_CTL_RATIO_MASK,
+               (UINT64)(hasTurbo ? turbo : base) << 8);
+
+  // "Far below": PL1 under half the TDP, or PL2 under the TDP. Fixed to TDP
+  // and 1.25 x TDP, only the low ones.
+  if (!EFI_ERROR(MsrRead(MSR_PKG_POWER_INFO, &v)) && (tdp = v & PKG_PL1_MASK) &&
+      !EFI_ERROR(MsrRead(MSR_PKG_POWER_LIMIT, &v))) {
+    pl1 = v & PKG_PL1_MASK;
+    pl2 = (v >> PKG_PL2_SHIFT) & PKG_PL1_MASK;
+    mask = value = 0;
+    if (pl1 < tdp / 2) {
+      mask |= PKG_PL1_MASK;
+      value |= pl1 = tdp;
+    }
+    if (pl2 < tdp) {
+      pl2 = tdp * 5 / 4 > PKG_PL1_MASK ? PKG_PL1_MASK : tdp * 5 / 4;
+      mask |= PKG_PL1_MASK << PKG_PL2_SHIFT;
+      value |= (pl2 < pl1 ? pl1 : pl2) << PKG_PL2_SHIFT;
+    }
+    ClampCheck(CLAMP_POWER_LIMITS, v, mask != 0, SCOPE_PACKAGE, PKG_POWER_LIMIT_LOCK_BIT, mask,
+               value);
+  }
+
+  // PLATFORM_INFO bits 34:33 count the extra config-TDP levels; each level's
+  // ratio is in its own MSR.
+  levels = base ? (UINTN)((info >> 33) & 3) : 0;
+  if (base && !levels) gClamps.State[CLAMP_CONFIG_TDP] = CLAMP_ABSENT;
+  if (levels && levels < 3 && !EFI_ERROR(MsrRead(MSR_CONFIG_TDP_NOMINAL, &v))) {
+    ratio[0] = (UINT8)v;
+    for (i = 1; i <= levels; ++i) {
+      if (EFI_ERROR(MsrRead(i == 1 ? MSR_CONFIG_TDP_LEVEL1 : MSR_CONFIG_TDP_LEVEL2, &v))) break;
+      ratio[i] = (UINT8)(v >> 16);
+    }
+    if (i > levels && !EFI_ERROR(MsrRead(MSR_CONFIG_TDP_CONTROL, &v))) {
+      for (best = 0, i = 1; i <= levels; ++i)
+        if (ratio[i] > ratio[best]) best = (UINT8)i;
+      i = (UINTN)(v & CONFIG_TDP_LEVEL_MASK);
+      ClampCheck(CLAMP_CONFIG_TDP, v, i <= levels && ratio[i] < ratio[best], SCOPE_PACKAGE,
+                 CONFIG_TDP_LOCK_BIT, CONFIG_TDP_LEVEL_MASK, best);
+    }
+  }
+}
+
+// After the policy apply: resolve the queued fixes, log every clamp still
+// there and publish the record.
+static void ReportClamps(void) {
+  static struct __attribute__((packed)) {
+    CLAMP_RECORD_HEADER Header;
+    CLAMP_RECORD_ENTRY Entry[CLAMP_COUNT];
+  } rec;
+  UINTN i, found = 0, fixed = 0;
+
+  for (i = 0; i < CLAMP_COUNT; ++i) {
+    UINT8 *state = &gClamps.State[i];
+
+    if (*state == CLAMP_FIXING) {
+      // Entry[i] is only set for a queued fix.
+      POLICY_RESULT *r = &gPolicyResult[gClamps.Entry[i]];
+      *state = r->Skipped || r->Locked || r->Failed ? CLAMP_FAILED : CLAMP_FIXED;
+    }
+    if (*state >= CLAMP_FOUND) found++;
+    if (*state == CLAMP_FOUND) {
+      Log(LOG_WARN, L"Clamp found: ");
+      Output(kClamps[i].Name);
+      Output(L"; ");
+      Output(kClamps[i].Hint);
+      Output(L" to remove it\r\n");
+    } else if (*state == CLAMP_LOCKED) {
+      Log(LOG_WARN, L"Clamp locked by firmware: ");
+      Output(kClamps[i].Name);
+      Output(L"\r\n");
+    } else if (*state == CLAMP_FAILED) {
+      Log(LOG_WARN, L"Clamp fix did not take: ");
+      Output(kClamps[i].Name);
+      Output(L"\r\n");
+    } else if (*state == CLAMP_FIXED) {
+      fixed++;
+      Output(L"Clamp removed: ");
+      Output(kClamps[i].Name);
+      Output(L"\r\n");
+    }
+    rec.Entry[i].Msr = kClamps[i].Msr;
+    rec.Entry[i].State = *state;
+    rec.Entry[i].Value = gClamps.Value[i];
+  }
+  if (!gClamps.Scanned) {
+    Output(L"Clamp scan: not an Intel family 6 CPU, skipped\r\n");
+  } else {
+    OutputNum(L"Clamp scan: ", found, L" found, ");
+    OutputNum(L"", fixed, L" removed\r\n");
+  }
+
+  rec.Header.Signature = CLAMP_RECORD_SIGNATURE;
+  rec.Header.Version = CLAMP_RECORD_VERSION;
+  rec.Header.Count = CLAMP_COUNT;
+  rec.Header.Scanned = gClamps.Scanned;
+  rec.Header.Fix = gSettings.FixClamps;
+  RT->SetVariable(L"DisablePROCHOTClamps", &gDisablePROCHOTVendorGuid,
+                  EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS, sizeof(rec),
+                  &rec);
+}
+
+// ---------------------------------------------------------------------------
+// Capability cache
+//
+// MsrProbe's map of which policy MSRs exist, are writable or locked only
+// changes with the hardware, its microcode or the firmware. The BSP
+// fingerprints those (CPUID 1 signature, IA32_BIOS_SIGN_ID revision on Intel,
+// SMBIOS type 0 strings) and keeps the map in the non-volatile
+// DisablePROCHOTCapabilities next to it. A later boot with the same
+// fingerprint preloads gMsrCaps with one GetVariable and probes only MSRs the
+// map doesn't have yet. The core-type mix (threads per core type) is part of
+// the fingerprint too, but is only known once every CPU has run the write
+// pass: a changed mix re-probes the map after the apply. The record is
+// rewritten only when it changed.
+// ---------------------------------------------------------------------------
+#define MSR_BIOS_SIGN_ID 0x8B
+#define CAP_CACHE_SIGNATURE 0x50435044  // 'DPCP'
+#define CAP_CACHE_VERSION 3
+
+static EFI_GUID gSmbiosTableGuid = {
+    0xeb9d2d31, 0x2d88, 0x11d3, {0x9a, 0x16, 0x00, 0x90, 0x27, 0x3f, 0xc1, 0x4d}};
+static EFI_GUID gSmbios3TableGuid = {
+    0xf2fd1544, 0x9794, 0x4a2c, {0x99, 0x2e, 0xe5, 0xbb, 0xcf, 0x20, 0xe3, 0x94}};
+
+typedef struct __attribute__((packed)) {
+  UINT32 CpuSignature;  // CPUID 1 EAX: family, model, stepping
+  UINT32 Microcode;     // IA32_BIOS_SIGN_ID bits 63:32
+  UINT32 BiosHash;      // FNV-1a of the SMBIOS type 0 strings, 0 without SMBIOS
+  UINT16 Threads[HWP_CORE_TYPES];  // enabled threads per core type (P, E)
+} CAP_FINGERPRINT;
+
+typedef struct __attribute__((packed)) {
+  UINT32 Signature;
+  UINT16 Version;
+  UINT8 Count;  // entries that follow, 5 bytes each
+  UINT8 Reserved;
+  UINT32 Checksum;  // FNV-1a of everything after this field
+  CAP_FINGERPRINT Fingerprint;
+  struct __attribute__((packed)) {
+    UINT32 Msr;
+    UINT8 Caps;  // MSR_SUPPORTED | MSR_WRITABLE | MSR_LOCKED | MSR_READ_ONLY
+  } Entry[MSR_CAPS_MAX];
+} CAP_CACHE;
+
+#define CAP_CACHE_HEADER (sizeof(CAP_CACHE) - sizeof(((CAP_CACHE *)0)->Entry))
+#define CAP_CACHE_SIZE(n) (CAP_CACHE_HEADER + (n) * sizeof(((CAP_CACHE *)0)->Entry[0]))
+
+static CAP_FINGERPRINT gCapFingerprint;
+static BOOLEAN gCapFingerprinted;  // gCapFingerprint taken this boot
+static UINTN gCapCached;  // gMsrCaps entries that came from the record
+static UINT16 gCapCachedThreads[HWP_CORE_TYPES];  // the record's core-type mix
+static UINT32 gCoreThreads[HWP_CORE_TYPES];       // counted in the write pass
+
+#define FNV1A_BASIS 0x811c9dc5
+
+static UINT32 Fnv1aMore(UINT32 h, const void *p, UINTN n) {
+  const UINT8 *b = p;
+  for (UINTN i = 0; i < n; i++) h = (h ^ b[i]) * 0x01000193;
+  return h;
+}
+
+static UINT32 Fnv1a(const void *p, UINTN n) { return Fnv1aMore(FNV1A_BASIS, p, n); }
+
+// FNV-1a of the fingerprint and the entries; Count must be in range.
+static UINT32 CapCacheChecksum(const CAP_CACHE *c) {
+  return Fnv1a(&c->Fingerprint,
+               CAP_CACHE_SIZE(c->Count) - (CAP_CACHE_HEADER - sizeof(CAP_FINGERPRINT)));
+}
+
+// Hash of the BIOS vendor, version and release date strings (SMBIOS type 0),
+// from the 3.x entry point if there is one, else the 2.x one.
+static UINT32 SmbiosBiosHash(void) {
+  UINT8 *table = NULL, *p, *end;
+  UINT64 address = 0;
+  UINT32 size = 0;
+  UINT16 size16;
+  UINTN i;
+
+  for (i = 0; i < ST->NumberOfTableEntries; ++i) {
+    EFI_CONFIGURATION_TABLE *t = &ST->ConfigurationTable[i];
+    UINT8 *ep = t->VendorTable;
+    if (!CompareMem(&t->VendorGuid, &gSmbios3TableGuid, sizeof(EFI_GUID))) {
+      CopyMem(&size, ep + 0x0C, sizeof(size));  // structure table maximum size
+      CopyMem(&address, ep + 0x10, sizeof(address));
+      break;
+    }
+    if (!CompareMem(&t->VendorGuid, &gSmbiosTableGuid, sizeof(EFI_GUID))) {
+      CopyMem(&size16, ep + 0x16, sizeof(size16));
+      size = size16;
+      address = 0;
+      CopyMem(&address, ep + 0x18, sizeof(UINT32));
+    }
+  }
+  if (!address || !size) return 0;
+
+  table = (UINT8 *)(UINTN)address;
+  end = table + size;
+  for (p = table; p + 4 <= end && p[1] >= 4 && p[0] != 127;) {
+    UINT8 *strings = p + p[1], *s = strings;
+    while (s + 1 < end && (s[0] || s[1])) ++s;
+    if (p[0] == 0) return Fnv1a(strings, (UINTN)(s - strings));
+    p = s + 2;
+  }
+  return 0;
+}
+
+// The BSP's part of the fingerprint; Threads is filled in after the write pass.
+static void CapFingerprint(CAP_FINGERPRINT *f) {
+  uint32_t r[4];
+  UINT64 v;
+
+  ZeroMem(f, sizeof(*f));
+  AsmCpuid(1, 0, r);
+  f->CpuSignature = r[0];
+  // 0x8B is something else elsewhere. On Intel the revision is only latched
+  // into it by a CPUID 1 after it's cleared.
+  if (GenuineIntel()) {
+    MsrWrite(MSR_BIOS_SIGN_ID, 0);
+    AsmCpuid(1, 0, r);
+    if (!EFI_ERROR(MsrRead(MSR_BIOS_SIGN_ID, &v))) f->Microcode = (UINT32)(v >> 32);
+  }
+  f->BiosHash = SmbiosBiosHash();
+}
+
+// gCapFingerprint, taken on first use: the turbo factory values and the cache
+// share it, and taking it writes 0x8B and walks SMBIOS.
+static const CAP_FINGERPRINT *BspFingerprint(void) {
+  if (!gCapFingerprinted) CapFingerprint(&gCapFingerprint);
+  gCapFingerprinted = TRUE;
+  return &gCapFingerprint;
+}
+
+// Runs on the BSP with the #GP handler armed, before PreparePolicy: preload
+// gMsrCaps from the record if it was taken on this CPU, microcode and firmware.
+static void LoadCapCache(void) {
+  CAP_CACHE c;
+  UINTN size = sizeof(c), i;
+
+  ZeroMem(gCoreThreads, sizeof(gCoreThreads));
+  gMsrCapsChanged = FALSE;
+  if (!gArmedGate) return;
+  BspFingerprint();
+  if (EFI_ERROR(RT->GetVariable(L"DisablePROCHOTCapabilities", &gDisablePROCHOTVendorGuid,
+                                NULL, &size, &c))) {
+    Output(L"Capability cache miss\r\n");
+    return;
+  }
+  if (size < CAP_CACHE_HEADER || c.Signature != CAP_CACHE_SIGNATURE ||
+      c.Version != CAP_CACHE_VERSION || c.Count > MSR_CAPS_MAX ||
+      size != CAP_CACHE_SIZE(c.Count) || c.Checksum != CapCacheChecksum(&c)) {
+    Log(LOG_WARN, L"Capability cache corrupt\r\n");
+    return;
+  }
+  if (CompareMem(&c.Fingerprint, &gCapFingerprint,
+                 sizeof(CAP_FINGERPRINT) - sizeof(c.Fingerprint.Threads))) {
+    Output(L"Capability cache stale (CPU, microcode or firmware changed)\r\n");
+    return;
+  }
+  for (i = 0; i < c.Count; ++i) {
+    gMsrCaps[i].Msr = c.Entry[i].Msr;
+    gMsrCaps[i].Caps = c.Entry[i].Caps;
+  }
+  gMsrCapsCount = gCapCached = c.Count;
+  CopyMem(gCapCachedThreads, c.Fingerprint.Threads, sizeof(gCapCachedThreads));
+  OutputNum(L"Capability cache hit, ", c.Count, L" MSRs\r\n");
+}
+
+// After the write and verify passes: complete the fingerprint with the
+// core-type mix they counted. A mix other than the record's (cores disabled or
+// enabled in setup) throws the map away and probes the policy MSRs again, read
+// only now that the writes are done. Then save the map if it changed.
+static void StoreCapCache(void) {
+  CAP_CACHE c;
+  UINTN i;
+
+  if (!gArmedGate) return;
+  for (i = 0; i < HWP_CORE_TYPES; ++i) gCapFingerprint.Threads[i] = (UINT16)gCoreThreads[i];
+  if (gCapCached && CompareMem(gCapCachedThreads, gCapFingerprint.Threads,
+                               sizeof(gCapCachedThreads))) {
+    Output(L"Capability cache stale (core-type mix changed)\r\n");
+    gMsrCapsCount = gCapCached = 0;
+    for (i = 0; i < gPolicyCount; ++i)
+      if (!gPolicyResult[i].Skipped || gPolicyResult[i].Fault)
+        MsrProbe(gPolicy[i].Msr, gPolicy[i].LockBit, FALSE);
+  }
+  if (!gMsrCapsChanged) return;
+
+  ZeroMem(&c, sizeof(c));
+  c.Signature = CAP_CACHE_SIGNATURE;
+  c.Version = CAP_CACHE_VERSION;
+  c.Count = (UINT8)gMsrCapsCount;
+  c.Fingerprint = gCapFingerprint;
+  for (i = 0; i < gMsrCapsCount; ++i) {
+    c.Entry[i].Msr = gMsrCaps[i].Msr;
+    c.Entry[i].Caps = gMsrCaps[i].Caps;
+  }
+  c.Checksum = CapCacheChecksum(&c);
+  if (!EFI_ERROR(RT->SetVariable(L"DisablePROCHOTCapabilities", &gDisablePROCHOTVendorGuid,
+                                 EFI_VARIABLE_NON_VOLATILE |
+                                     EFI_VARIABLE_BOOTSERVICE_ACCESS |
+                                     EFI_VARIABLE_RUNTIME_ACCESS,
+                                 CAP_CACHE_SIZE(c.Count), &c)))
+    OutputNum(L"Capability cache updated, ", c.Count, L" MSRs\r\n");
+}
+
+// ---------------------------------------------------------------------------
+// Turbo ratio limits
+//
+// Profile "turbo <n>=<ratio>..." lines set the turbo ratio for n active cores
+// (core group n on server parts): byte n-1 of MSR_TURBO_RATIO_LIMIT, then of
+// 0x1AE and 0x1AF for n = 9..24 on the parts that use them that way. The
+// first time the app sees a CPU, microcode and firmware (the capability
+// cache's fingerprint, without the core-type mix) it saves the three MSRs as
+// firmware left them to the non-volatile DisablePROCHOTTurboFactory, so a
+// later boot still knows the factory values after they were overridden (a
+// warm reset keeps MSRs). Each requested ratio is clamped to the factory ratio
+// of its own bucket and appended to the policy table as package-scope
+// entries, which every thread reads back. Nothing is written unless
+// PLATFORM_INFO bit 28 says the limits are programmable.
+// ---------------------------------------------------------------------------
+#define PLATFORM_INFO_TURBO_PROGRAMMABLE (1ULL << 28)
+#define TURBO_MSRS 3  // MSR_TURBO_RATIO_LIMIT .. +2
+#define TURBO_BUCKETS (TURBO_MSRS * 8)
+#define TURBO_SEMAPHORE (1ULL << 63)  // in 0x1AF: use the overrides
+
+// Parts whose 0x1AE (and 0x1AF) hold more per-core-count ratios. Elsewhere
+// 0x1AE, where it exists, holds the core-group sizes, so only n = 1..8 apply.
+static const struct {
+  UINT8 Model;
+  UINT8 Msrs;
+  BOOLEAN Semaphore;  // the overrides only count with TURBO_SEMAPHORE set
+} kTurboModels[] = {
+    {0x3E, 2, FALSE},  // Ivy Bridge-EP
+    {0x3F, 3, TRUE},   // Haswell-EP
+    {0x4F, 3, TRUE},   // Broadwell-EP
+    {0x56, 3, TRUE},   // Broadwell-DE
+};
+
+#define TURBO_FACTORY_SIGNATURE 0x46545044  // 'DPTF'
+#define TURBO_FACTORY_VERSION 2
+
+typedef struct __attribute__((packed)) {
+  UINT32 Signature;
+  UINT16 Version;
+  UINT8 Valid;  // bit k: Limit[k] was readable
+  UINT8 Reserved;
+  UINT32 CpuSignature;  // CPU, microcode and firmware the values belong to
+  UINT32 Microcode;
+  UINT32 BiosHash;
+  UINT64 Limit[TURBO_MSRS];
+} TURBO_FACTORY;
+
+static struct {
+  UINT32 Set;  // bit n-1: bucket n requested
+  UINT8 Ratio[TURBO_BUCKETS];
+  UINT8 Entry[TURBO_MSRS];  // gPolicy index + 1 of each MSR's entry, 0 if none
+} gTurbo;
+
+// The saved factory values, or this boot's if none are saved for this CPU,
+// microcode and firmware yet.
+static BOOLEAN TurboFactory(TURBO_FACTORY *f) {
+  const CAP_FINGERPRINT *fp = BspFingerprint();
+  UINT64 v;
+  UINTN size = sizeof(*f), k;
+
+  if (!EFI_ERROR(RT->GetVariable(L"DisablePROCHOTTurboFactory", &gDisablePROCHOTVendorGuid,
+                                 NULL, &size, f)) &&
+      size == sizeof(*f) && f->Signature == TURBO_FACTORY_SIGNATURE &&
+      f->Version == TURBO_FACTORY_VERSION && f->CpuSignature == fp->CpuSignature &&
+      f->Microcode == fp->Microcode && f->BiosHash == fp->BiosHash && (f->Valid & 1))
+    return TRUE;
+
+  ZeroMem(f, sizeof(*f));
+  f->Signature = TURBO_FACTORY_SIGNATURE;
+  f->Version = TURBO_FACTORY_VERSION;
+  f->CpuSignature = fp->CpuSignature;
+  f->Microcode = fp->Microcode;
+  f->BiosHash = fp->BiosHash;
+  for (k = 0; k < TURBO_MSRS; ++k) {
+    if (EFI_ERROR(MsrRead((UINT32)(MSR_TURBO_RATIO_LIMIT + k), &v))) continue;
+    f->Limit[k] = v;
+    f->Valid |= (UINT8)(1u << k);
+  }
+  if (!(f->Valid & 1)) return FALSE;
+  RT->SetVariable(L"DisablePROCHOTTurboFactory", &gDisablePROCHOTVendorGuid,
+                  EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS |
+                      EFI_VARIABLE_RUNTIME_ACCESS,
+                  sizeof(*f), f);
+  return TRUE;
+}
+
+// Runs on the BSP with the #GP handler armed, before the policy is applied.
+static void PrepareTurbo(void) {
+  TURBO_FACTORY factory;
+  POLICY_ENTRY e = {0, SCOPE_PACKAGE, LOCK_NONE, MATCH_ANY, MATCH_ANY, 0, 0};
+  UINT64 info;
+  UINT16 family, model;
+  UINT8 clamped = 0, msrs = 1;
+  BOOLEAN semaphore = FALSE;
+  UINTN k, b, first = gPolicyCount;
+
+  if (!gTurbo.Set) return;
+  if (!IntelFamily6()) {
+    Log(LOG_WARN, L"Turbo ratio limits: not an Intel family 6 CPU, skipped\r\n");
+    return;
+  }
+  if (EFI_ERROR(MsrRead(MSR_PLATFORM_INFO, &info)) ||
+      !(info & PLATFORM_INFO_TURBO_PROGRAMMABLE) || !TurboFactory(&factory)) {
+    Log(LOG_WARN, L"Turbo ratio limits: not programmable on this CPU, skipped\r\n");
+    return;
+  }
+  CpuFamilyModel(&family, &model);
+  for (k = 0; k < sizeof(kTurboModels) / sizeof(kTurboModels[0]); ++k) {
+    if (kTurboModels[k].Model != model) continue;
+    msrs = kTurboModels[k].Msrs;
+    semaphore = kTurboModels[k].Semaphore;
+  }
+  if (gTurbo.Set >> (msrs * 8))
+    Log(LOG_WARN, L"Turbo ratio limits: core counts above 8 not programmable here, ignored\r\n");
+
+  for (k = 0; k < msrs; ++k) {
+    BOOLEAN needSemaphore = semaphore && k == TURBO_MSRS - 1 && gPolicyCount > first;
+    if (!((gTurbo.Set >> (k * 8)) & 0xFF) && !needSemaphore) continue;
+    if (!((factory.Valid >> k) & 1)) {
+      Log(LOG_WARN, L"Turbo ratio limits: MSR ");
+      OutputHex(L"", MSR_TURBO_RATIO_LIMIT + k, L" not implemented on this CPU, skipped\r\n");
+      continue;
+    }
+    if (gPolicyCount == POLICY_MAX_ENTRIES) {
+      Log(LOG_WARN, L"Turbo ratio limits ignored, policy table full\r\n");
+      return;
+    }
+    e.Msr = (UINT32)(MSR_TURBO_RATIO_LIMIT + k);
+    e.Mask = e.Value = 0;
+    for (b = 0; b < 8; ++b) {
+      UINT8 ratio = gTurbo.Ratio[k * 8 + b], factoryRatio = (UINT8)(factory.Limit[k] >> (b * 8));
+      if (!((gTurbo.Set >> (k * 8 + b)) & 1)) continue;
+      if (ratio > factoryRatio) {
+        ratio = factoryRatio;
+        clamped++;
+      }
+      e.Mask |= 0xFFULL << (b * 8);
+      e.Value |= (UINT64)ratio << (b * 8);
+    }
+    if (needSemaphore) {
+      e.Mask |= TURBO_SEMAPHORE;
+      e.Value |= TURBO_SEMAPHORE;
+    }
+    gTurbo.Entry[k] = (UINT8)(gPolicyCount + 1);
+    gPolicy[gPolicyCount++] = e;
+  }
+  if (clamped) {
+    Log(LOG_WARN, L"Turbo ratio limits: ");
+    OutputNum(L"", clamped, L" ratios clamped to their factory values\r\n");
+  }
+}
+
+static void ReportTurbo(void) {
+  UINTN k;
+
+  for (k = 0; k < TURBO_MSRS; ++k) {
+    POLICY_RESULT *r;
+    if (!gTurbo.Entry[k]) continue;
+    r = &gPolicyResult[gTurbo.Entry[k] - 1];
+    if (r->Skipped || r->Locked + r->Failed) continue;  // ReportPolicy says why
+    OutputHex(L"Turbo ratio limits: MSR ", MSR_TURBO_RATIO_LIMIT + k, L" set on ");
+    OutputNum(L"", r->Written + r->Unchanged, L" packages, read back on ");
+    OutputNum(L"", r->Verified, L" CPUs\r\n");
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Multi-processor dispatch
+//
+// The BSP alone only reaches its own core/package; on multi-socket boxes and
+// hybrid parts the other packages stay clamped. EFI_MP_SERVICES_PROTOCOL runs
+// the same procedure on every AP; CPUID topology picks one thread per MSR
+// scope to do the write, and every thread reads the result back.
+// ---------------------------------------------------------------------------
+#define PROCESSOR_AS_BSP_BIT 0x00000001
+#define PROCESSOR_ENABLED_BIT 0x00000002
+
+typedef struct {
+  UINT32 Package;
+  UINT32 Core;
+  UINT32 Thread;
+} CPU_PHYSICAL_LOCATION;
+
+typedef struct {
+  UINT64 ProcessorId;  // APIC ID
+  UINT32 StatusFlag;
+  CPU_PHYSICAL_LOCATION Location;
+  UINT32 ExtendedInformation[6];  // PI 1.7 CPU_V2_EXTENDED_TOPOLOGY; unused
+} PROCESSOR_INFORMATION;
+
+typedef struct _MP_SERVICES_PROTOCOL MP_SERVICES_PROTOCOL;
+typedef VOID(EFIAPI *AP_PROCEDURE)(VOID *arg);
+
+struct _MP_SERVICES_PROTOCOL {
+  EFI_STATUS(EFIAPI *GetNumberOfProcessors)(MP_SERVICES_PROTOCOL *self, UINTN *count,
+                                            UINTN *enabled);
+  EFI_STATUS(EFIAPI *GetProcessorInfo)(MP_SERVICES_PROTOCOL *self, UINTN cpu,
+                                       PROCESSOR_INFORMATION *info);
+  EFI_STATUS(EFIAPI *StartupAllAPs)(MP_SERVICES_PROTOCOL *self, AP_PROCEDURE proc,
+                                    BOOLEAN singleThread, EFI_EVENT waitEvent,
+                                    UINTN timeoutUs, VOID *arg, UINTN **failedCpus);
+  EFI_STATUS(EFIAPI *StartupThisAP)(MP_SERVICES_PROTOCOL *self, AP_PROCEDURE proc,
+                                    UINTN cpu, EFI_EVENT waitEvent, UINTN timeoutUs,
+                                    VOID *arg, BOOLEAN *finished);
+  EFI_STATUS(EFIAPI *SwitchBSP)(MP_SERVICES_PROTOCOL *self, UINTN cpu, BOOLEAN enableOld);
+  EFI_STATUS(EFIAPI *EnableDisableAP)(MP_SERVICES_PROTOCOL *self, UINTN cpu,
+                                      BOOLEAN enable, UINT32 *health);
+  EFI_STATUS(EFIAPI *WhoAmI)(MP_SERVICES_PROTOCOL *self, UINTN *cpu);
+};
+
+static EFI_GUID gEfiMpServiceProtocolGuid = {
+    0x3fdda605, 0xa76e, 0x4f46, {0xad, 0x29, 0x12, 0xf4, 0x53, 0x1b, 0x3d, 0x08}};
+
+typedef struct {
+  UINT32 ApicId;
+  UINT8 Enabled;
+  UINT8 Leads;  // SCOPE_* this thread writes for
+  volatile UINT8 Done;
+  UINT16 Failed;  // policy entries that didn't read back right on this thread
+  IDT_GATE *Gate;  // #GP gate this thread patched in a private IDT, or NULL
+  IDT_GATE SavedGate;
+} CPU_SLOT;
+
+enum { PASS_WRITE, PASS_VERIFY, PASS_DIAG_BEFORE, PASS_DIAG_AFTER, PASS_DISARM, PASS_REASSERT };
+
+static UINT32 gApGates;  // private IDTs patched by ApplyPolicyOnCpu
+
+typedef struct {
+  MP_SERVICES_PROTOCOL *Mp;  // NULL: BSP only
+  CPU_SLOT *Slots;
+  UINTN Count;
+  UINT8 Pass;  // PASS_*
+  // Diagnostics, when enabled: one snapshot pair per slot.
+  DIAG_CPU *Diag;
+  BOOLEAN *Sampled;
+  UINT32 DiagSources;
+  UINT32 TscKhz;
+  UINT64 DiagWindow;  // TSC ticks
+  // Resident mode: entries to keep, and how many the pass rewrote.
+  UINT32 Watch;
+  UINT32 Rewrites;
+} MP_DISPATCH;
+
+// x2APIC-ID shift per scope from CPUID 0x1F (or 0xB): the scope ID of a thread
+// is its APIC ID with the lower level's bits shifted out. FALSE if the CPU
+// doesn't enumerate extended topology.
+static BOOLEAN GetTopologyShifts(UINT32 shift[4]) {
+  uint32_t r[4];
+  uint32_t leaf, sub, coreShift = 0, moduleShift = 0, pkgShift = 0;
+  BOOLEAN haveModule = FALSE;
+
+  AsmCpuid(0, 0, r);
+  if (r[0] >= 0x1F) {
+    AsmCpuid(0x1F, 0, r);
+    leaf = r[1] ? 0x1F : 0xB;
+  } else if (r[0] >= 0xB) {
+    leaf = 0xB;
+  } else {
+    return FALSE;
+  }
+
+  for (sub = 0; sub < 8; ++sub) {
+    uint32_t type, bits;
+    AsmCpuid(leaf, sub, r);
+    type = (r[2] >> 8) & 0xFF;
+    bits = r[0] & 0x1F;
+    if (type == 0) break;
+    if (type == 1) coreShift = bits;    // SMT
+    if (type == 2) moduleShift = bits;  // Core
+    if (type == 3) haveModule = TRUE;   // Module
+    pkgShift = bits;                    // last level enumerated -> package
+  }
+  if (sub == 0) return FALSE;
+
+  shift[0] = 0;
+  shift[1] = coreShift;
+  shift[2] = haveModule ? moduleShift : coreShift;
+  shift[3] = pkgShift;
+  return TRUE;
+}
+
+// Mark, for each scope, the first enabled thread carrying each scope ID as its
+// leader.
+static void AssignScopeLeaders(CPU_SLOT *slots, UINTN count,
+                               CPU_PHYSICAL_LOCATION *locs) {
+  UINT32 shift[4];
+  BOOLEAN cpuidTopo = GetTopologyShifts(shift);
+  UINTN i, j, s;
+
+  for (i = 0; i < count; ++i) {
+    slots[i].Leads = 0;
+    if (!slots[i].Enabled) continue;
+    for (s = 0; s < 4; ++s) {
+      BOOLEAN first = TRUE;
+      for (j = 0; j < i && first; ++j) {
+        if (!slots[j].Enabled) continue;
+        if (cpuidTopo) {
+          first = (slots[i].ApicId >> shift[s]) != (slots[j].ApicId >> shift[s]);
+        } else {
+          // No extended topology: use the firmware's package/core/thread.
+          first = s == 0 || locs[i].Package != locs[j].Package ||
+                  (s < 2 && locs[i].Core != locs[j].Core);
+        }
+      }
+      if (first) slots[i].Leads |= (UINT8)(1u << s);
+    }
+  }
+}
+
+// Fill one slot per logical CPU from MP Services. FALSE (BSP only) when the
+// protocol is missing, there are no APs, or allocation fails.
+static BOOLEAN InitDispatch(MP_DISPATCH *d) {
+  CPU_PHYSICAL_LOCATION *locs;
+  UINTN count = 0, enabled = 0, i;
+
+  if (EFI_ERROR(BS->LocateProtocol(&gEfiMpServiceProtocolGuid, NULL, (void **)&d->Mp)) ||
+      !d->Mp || EFI_ERROR(d->Mp->GetNumberOfProcessors(d->Mp, &count, &enabled)) ||
+      enabled < 2)
+    return FALSE;
+  if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, count * sizeof(CPU_SLOT),
+                                 (void **)&d->Slots)))
+    return FALSE;
+  if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, count * sizeof(*locs), (void **)&locs))) {
+    FreePool(d->Slots);
+    return FALSE;
+  }
+
+  d->Count = count;
+  for (i = 0; i < count; ++i) {
+    PROCESSOR_INFORMATION info;
+    CPU_SLOT *slot = &d->Slots[i];
+    slot->Done = 0;
+    slot->Failed = 0;
+    slot->Gate = NULL;
+    slot->Enabled = !EFI_ERROR(d->Mp->GetProcessorInfo(d->Mp, i, &info)) &&
+                    (info.StatusFlag & PROCESSOR_ENABLED_BIT);
+    slot->ApicId = slot->Enabled ? (UINT32)info.ProcessorId : 0;
+    if (slot->Enabled)
+      locs[i] = info.Location;
+    else
+      ZeroMem(&locs[i], sizeof(locs[i]));  // never compared: disabled slots lead nothing
+  }
+  AssignScopeLeaders(d->Slots, count, locs);
+  FreePool(locs);
+  return TRUE;
+}
+
+// Dispatch on the BSP alone, which then leads every scope.
+static void InitBspDispatch(MP_DISPATCH *d, CPU_SLOT *bsp) {
+  bsp->Enabled = 1;
+  bsp->Gate = NULL;
+  bsp->Leads = SCOPE_THREAD | SCOPE_CORE | SCOPE_MODULE | SCOPE_PACKAGE;
+  d->Mp = NULL;
+  d->Slots = bsp;
+  d->Count = 1;
+}
+
+static void EFIAPI ApplyPolicyOnCpu(VOID *arg) {
+  MP_DISPATCH *d = arg;
+  UINTN self = 0;
+  CPU_SLOT *slot;
+
+  if (d->Mp && EFI_ERROR(d->Mp->WhoAmI(d->Mp, &self))) return;
+  if (self >= d->Count) return;
+  slot = &d->Slots[self];
+  // The BSP's IDT is armed already; one an AP loaded for itself is not.
+  // Resident ticks only touch entries that held, and are never disarmed.
+  if (gArmedGate && !slot->Gate && d->Pass != PASS_DISARM && d->Pass != PASS_REASSERT &&
+      SafeMsrPatch(&slot->Gate, &slot->SavedGate))
+    ATOMIC_INC(gApGates);
+
+  switch (d->Pass) {
+  case PASS_WRITE:
+    WritePolicyEntries(slot->Leads);
+    ApplyHwp();
+    ATOMIC_INC(gCoreThreads[HwpCoreType()]);
+    break;
+  case PASS_VERIFY:
+    slot->Failed = VerifyPolicyEntries();
+    slot->Done = 1;
+    break;
+  case PASS_DIAG_BEFORE:
+  case PASS_DIAG_AFTER:
+    if (!(slot->Leads & SCOPE_CORE)) break;
+    d->Diag[self].ApicId = slot->ApicId;
+    DiagSample(d->Pass == PASS_DIAG_BEFORE ? &d->Diag[self].Before : &d->Diag[self].After,
+               slot->Leads, d->DiagSources, d->DiagWindow, d->TscKhz);
+    d->Sampled[self] = TRUE;
+    break;
+  case PASS_DISARM:
+    if (slot->Gate) *slot->Gate = slot->SavedGate;
+    slot->Gate = NULL;
+    break;
+  case PASS_REASSERT:
+    ATOMIC_ADD(d->Rewrites, ReassertPolicy(d->Watch, slot->Leads));
+    break;
+  }
+}
+
+// Run one pass on every enabled CPU: the BSP first, then all APs concurrently.
+// A timeout or error is logged; the APs it left out show up in the readback.
+// Resident mode's passes aren't logged, it counts them in its record instead.
+static EFI_STATUS DispatchPass(MP_DISPATCH *d, UINT8 pass) {
+  EFI_STATUS status;
+
+  d->Pass = pass;
+  ApplyPolicyOnCpu(d);
+  if (!d->Mp) return EFI_SUCCESS;
+  // Blocking dispatch on purpose: in non-blocking mode EDK2 only notices AP
+  // completion from a 100 ms poll timer, which would dwarf the work itself.
+  status = d->Mp->StartupAllAPs(d->Mp, ApplyPolicyOnCpu, FALSE, NULL, 100000, d, NULL);
+  if (!EFI_ERROR(status) || pass == PASS_REASSERT) return status;
+  Log(LOG_ERROR, L"MP dispatch: pass ");
+  if (status == EFI_TIMEOUT) {
+    OutputNum(L"", pass, L" timed out, some CPUs did not finish\r\n");
+  } else {
+    OutputNum(L"", pass, L" ");
+    OutputHex(L"failed (", status, L")\r\n");
+  }
+  return status;
+}
+
+static UINTN gPolicyCpus, gPolicyCpusVerified;
+
+static UINT32 TscKhz(void);
+
+// Zeroed snapshot buffers for every slot; FALSE leaves diagnostics off.
+static BOOLEAN InitDiagnostics(MP_DISPATCH *d) {
+  UINTN i;
+
+  d->Diag = NULL;
+  d->Sampled = NULL;
+  if (!gSettings.Diagnostics) return FALSE;
+  if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, d->Count * sizeof(DIAG_CPU),
+                                 (void **)&d->Diag)) ||
+      EFI_ERROR(BS->AllocatePool(EfiLoaderData, d->Count * sizeof(BOOLEAN),
+                                 (void **)&d->Sampled))) {
+    if (d->Diag) FreePool(d->Diag);
+    d->Diag = NULL;
+    return FALSE;
+  }
+  ZeroMem(d->Diag, d->Count * sizeof(DIAG_CPU));
+  for (i = 0; i < d->Count; ++i) d->Sampled[i] = FALSE;
+  d->DiagSources = DiagSources();
+  d->TscKhz = TscKhz();
+  d->DiagWindow = (UINT64)d->TscKhz * DIAG_WINDOW_US / 1000;
+  return TRUE;
+}
+
+// Apply the policy on every enabled CPU. Writes and readbacks are separate
+// passes so a thread never checks a scope its leader hasn't written yet; the
+// wall time is two rounds of IPIs plus the MSR work, independent of core count.
+static void ApplyPolicyAllCpus(void) {
+  static CPU_SLOT bspOnly;
+  MP_DISPATCH d;
+  UINTN i, reported = 0;
+
+  if (!InitDispatch(&d)) InitBspDispatch(&d, &bspOnly);
+
+  LoadCapCache();
+  PreparePolicy();
+  if (InitDiagnostics(&d)) DispatchPass(&d, PASS_DIAG_BEFORE);
+  DispatchPass(&d, PASS_WRITE);
+  DispatchPass(&d, PASS_VERIFY);
+  StoreCapCache();
+  if (d.Diag) {
+    DispatchPass(&d, PASS_DIAG_AFTER);
+    PublishDiagnostics(d.Diag, d.Sampled, d.Count, d.DiagSources, d.TscKhz);
+    FreePool(d.Diag);
+    FreePool(d.Sampled);
+  }
+  // Only needed when some AP runs on an IDT of its own; none do on EDK2.
+  if (gApGates) {
+    DispatchPass(&d, PASS_DISARM);
+    gApGates = 0;
+  }
+
+  gPolicyCpus = gPolicyCpusVerified = 0;
+  for (i = 0; i < d.Count; ++i) {
+    CPU_SLOT *slot = &d.Slots[i];
+    if (!slot->Enabled) continue;
+    gPolicyCpus++;
+    if (slot->Done && !slot->Failed) {
+      gPolicyCpusVerified++;
+    } else if (reported++ < 8) {
+      Log(LOG_ERROR, L"Unlock did not take on CPU ");
+      OutputNum(L"", i, L"\r\n");
+    }
+  }
+  OutputNum(L"Unlock readback: ", gPolicyCpusVerified, L"/");
+  OutputNum(L"", gPolicyCpus, L" CPUs\r\n");
+  ReportHwp();
+  if (d.Mp) FreePool(d.Slots);
+}
+
+// ---------------------------------------------------------------------------
+// Policy profile
+//
+// DisablePROCHOT.cfg, next to the .efi on the ESP, replaces the built-in table.
+// One entry per line; '#' starts a comment:
+//
+//   msr 0x610 mask=0x7FFF value=0x118 scope=package family=6 model=0x8C
+//   msr 0x1FC mask=0x1000001 value=0x1000000 scope=core
+//
+// Keys: mask, value (within mask), scope (thread|core|module|package, default
+// package), family and model (CPUID display values, default any), lock (bit
+// index or "none"; defaults to the known lock bit of the MSR, if any).
+//
+// "set <key>=<value>" lines change app settings rather than the table:
+//
+//   set resident=on                # keep re-applying until ExitBootServices
+//   set resident_interval_ms=100
+//   set diagnostics=on             # throttle snapshot before/after the apply
+//   set hwp_enable=on              # turn HWP on where firmware left it off
+//   set governor=on                # throttle on measured heat instead
+//   set governor_trip_c=95         # 50..120
+//   set governor_hysteresis_c=5    # 1..30
+//   set governor_ratio=8           # 1..255
+//   set governor_interval_ms=100   # 10..60000
+//   set fix_turbo=on               # remove a clamp the scanner finds; also
+//                                  # fix_ee_turbo, fix_min_ratio,
+//                                  # fix_power_limits, fix_config_tdp
+//
+// A "latency key=value..." line adds the low-latency entries to whichever
+// table is in use: uncore_min/uncore_max (MSR_UNCORE_RATIO_LIMIT ratios),
+// pkg_cstate_limit (MSR_PKG_CST_CONFIG_CONTROL bits 3:0, honouring its lock)
+// and c1e=on|off (MSR_POWER_CTL bit 1).
+//
+// "hwp <p|e|all> key=value..." lines set IA32_HWP_REQUEST fields per core
+// type: min, max, desired (ratios) and epp, each 0..255; unset fields are kept.
+//
+// "turbo <n>=<ratio>..." lines set the turbo ratio limit for n active cores,
+// n = 1..24 ("all" for 1..8), each ratio 1..255; unset ones are kept.
+// ---------------------------------------------------------------------------
+static EFI_GUID gEfiSimpleFileSystemProtocolGuid = SIMPLE_FILE_SYSTEM_PROTOCOL;
+static EFI_GUID gEfiFileInfoGuid = EFI_FILE_INFO_ID;
+
+#define PROFILE_MAX_BYTES 4096  // a larger profile is rejected, not truncated
+
+// Lock bits of the MSRs we know, used when an entry doesn't name one.
+static const struct {
+  UINT32 Msr;
+  UINT8 Bit;
+} kKnownLocks[] = {
+    {0x0E2, 15},  // MSR_PKG_CST_CONFIG_CONTROL
+    {0x601, 31},  // MSR_VR_CURRENT_CONFIG (PP0 current limit)
+    {0x610, 63},  // MSR_PKG_POWER_LIMIT
+    {0x64B, 31},  // MSR_CONFIG_TDP_CONTROL
+};
+
+static BOOLEAN IsSpace(CHAR8 c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+// Length of the token at p, up to whitespace, '=' or end.
+static UINTN TokenLen(CHAR8 *p, CHAR8 *end) {
+  UINTN n = 0;
+  while (p + n < end && !IsSpace(p[n]) && p[n] != '=') n++;
+  return n;
+}
+
+static BOOLEAN TokenIs(CHAR8 *p, UINTN n, const char *word) {
+  UINTN i;
+  for (i = 0; i < n; i++)
+    if (!word[i] || p[i] != (CHAR8)word[i]) return FALSE;
+  return word[n] == '\0';
+}
+
+// Decimal or 0x-prefixed hex, the whole token.
+static BOOLEAN ParseNumber(CHAR8 *p, UINTN n, UINT64 *out) {
+  UINT64 v = 0;
+  UINTN i = 0, base = 10;
+
+  if (n > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+    base = 16;
+    i = 2;
+  }
+  if (i == n) return FALSE;
+  for (; i < n; i++) {
+    CHAR8 c = p[i];
+    UINT64 digit;
+    if (c >= '0' && c <= '9') {
+      digit = (UINT64)(c - '0');
+    } else if (base == 16 && (c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+      digit = (UINT64)((c | 0x20) - 'a' + 10);
+    } else {
+      return FALSE;
+    }
+    v = v * base + digit;
+  }
+  *out = v;
+  return TRUE;
+}
+
+static BOOLEAN ParseScope(CHAR8 *p, UINTN n, UINT8 *scope) {
+  if (TokenIs(p, n, "thread")) *scope = SCOPE_THREAD;
+  else if (TokenIs(p, n, "core")) *scope = SCOPE_CORE;
+  else if (TokenIs(p, n, "module")) *scope = SCOPE_MODULE;
+  else if (TokenIs(p, n, "package")) *scope = SCOPE_PACKAGE;
+  else return FALSE;
+  return TRUE;
+}
+
+static BOOLEAN ParseSwitch(CHAR8 *p, UINTN n, BOOLEAN *out) {
+  if (TokenIs(p, n, "on")) *out = TRUE;
+  else if (TokenIs(p, n, "off")) *out = FALSE;
+  else return FALSE;
+  return TRUE;
+}
+
+// Cut the comment off a line and skip leading blanks; FALSE if nothing is left.
+static BOOLEAN TrimLine(CHAR8 **p, CHAR8 **end) {
+  for (CHAR8 *q = *p; q < *end; q++)
+    if (*q == '#') *end = q;
+  while (*p < *end && IsSpace(**p)) (*p)++;
+  return *p < *end;
+}
+
+// Apply a "set key=value" line to gSettings. FALSE if the line isn't one or is
+// malformed (left for ParseProfileLine to reject).
+static BOOLEAN ParseSettingLine(CHAR8 *p, CHAR8 *end) {
+  CHAR8 *key, *val;
+  UINTN i, n, keyLen, valLen;
+  UINT64 v;
+  BOOLEAN on;
+
+  if (!TrimLine(&p, &end)) return FALSE;
+  n = TokenLen(p, end);
+  if (!TokenIs(p, n, "set")) return FALSE;
+  p += n;
+  while (p < end && IsSpace(*p)) p++;
+  key = p;
+  keyLen = TokenLen(p, end);
+  p += keyLen;
+  if (p == end || *p != '=') return FALSE;
+  val = ++p;
+  valLen = TokenLen(p, end);
+  p += valLen;
+  while (p < end && IsSpace(*p)) p++;
+  if (p != end) return FALSE;
+
+  if (TokenIs(key, keyLen, "resident")) return ParseSwitch(val, valLen, &gSettings.Resident);
+  if (TokenIs(key, keyLen, "diagnostics"))
+    return ParseSwitch(val, valLen, &gSettings.Diagnostics);
+  if (TokenIs(key, keyLen, "hwp_enable")) return ParseSwitch(val, valLen, &gSettings.HwpEnable);
+  if (TokenIs(key, keyLen, "governor")) return ParseSwitch(val, valLen, &gSettings.Governor);
+  if (TokenIs(key, keyLen, "resident_interval_ms")) {
+    if (!ParseNumber(val, valLen, &v) || v < 10 || v > 60000) return FALSE;
+    gSettings.ResidentIntervalMs = (UINT32)v;
+    return TRUE;
+  }
+  if (TokenIs(key, keyLen, "governor_interval_ms")) {
+    if (!ParseNumber(val, valLen, &v) || v < 10 || v > 60000) return FALSE;
+    gSettings.GovernorIntervalMs = (UINT32)v;
+    return TRUE;
+  }
+  if (TokenIs(key, keyLen, "governor_trip_c")) {
+    if (!ParseNumber(val, valLen, &v) || v < 50 || v > 120) return FALSE;
+    gSettings.GovernorTripC = (UINT8)v;
+    return TRUE;
+  }
+  if (TokenIs(key, keyLen, "governor_hysteresis_c")) {
+    if (!ParseNumber(val, valLen, &v) || v < 1 || v > 30) return FALSE;
+    gSettings.GovernorHysteresisC = (UINT8)v;
+    return TRUE;
+  }
+  if (TokenIs(key, keyLen, "governor_ratio")) {
+    if (!ParseNumber(val, valLen, &v) || v < 1 || v > 255) return FALSE;
+    gSettings.GovernorRatio = (UINT8)v;
+    return TRUE;
+  }
+  if (TokenIs(key, keyLen, "log_console")) {
+    if (TokenIs(val, valLen, "auto")) gSettings.LogConsole = LOG_CONSOLE_AUTO;
+    else if (TokenIs(val, valLen, "always")) gSettings.LogConsole = LOG_CONSOLE_ALWAYS;
+    else if (TokenIs(val, valLen, "never")) gSettings.LogConsole = LOG_CONSOLE_NEVER;
+    else return FALSE;
+    return TRUE;
+  }
+  for (i = 0; i < CLAMP_COUNT; ++i) {
+    if (!TokenIs(key, keyLen, kClamps[i].Key)) continue;
+    if (!ParseSwitch(val, valLen, &on)) return FALSE;
+    gSettings.FixClamps = (UINT8)(on ? gSettings.FixClamps | (1u << i)
+                                     : gSettings.FixClamps & ~(1u << i));
+    return TRUE;
+  }
+  return FALSE;
+}
+
+// Apply a "hwp <p|e|all> key=value..." line to gHwp. FALSE if the line isn't
+// one or is malformed; a malformed line changes nothing.
+static BOOLEAN ParseHwpLine(CHAR8 *p, CHAR8 *end) {
+  static const char *const kFields[4] = {"min", "max", "desired", "epp"};
+  HWP_CONFIG c = {0, {0, 0, 0, 0}};
+  UINT8 first, last, t;
+  UINT64 v;
+  UINTN n, f;
+
+  if (!TrimLine(&p, &end)) return FALSE;
+  n = TokenLen(p, end);
+  if (!TokenIs(p, n, "hwp")) return FALSE;
+  p += n;
+  while (p < end && IsSpace(*p)) p++;
+  n = TokenLen(p, end);
+  if (TokenIs(p, n, "p")) first = last = HWP_CORE_P;
+  else if (TokenIs(p, n, "e")) first = last = HWP_CORE_E;
+  else if (TokenIs(p, n, "all")) first = HWP_CORE_P, last = HWP_CORE_E;
+  else return FALSE;
+  p += n;
+
+  for (;;) {
+    CHAR8 *key, *val;
+    UINTN keyLen, valLen;
+
+    while (p < end && IsSpace(*p)) p++;
+    if (p == end) break;
+    key = p;
+    keyLen = TokenLen(p, end);
+    p += keyLen;
+    if (p == end || *p != '=') return FALSE;
+    val = ++p;
+    valLen = TokenLen(p, end);
+    p += valLen;
+    if (!ParseNumber(val, valLen, &v) || v > 0xFF) return FALSE;
+    for (f = 0; f < 4 && !TokenIs(key, keyLen, kFields[f]); ++f)
+      ;
+    if (f == 4) return FALSE;
+    c.Set |= (UINT8)(1u << f);
+    c.Field[f] = (UINT8)v;
+  }
+  if (!c.Set) return FALSE;
+  if ((c.Set & HWP_MIN) && (c.Set & HWP_MAX) && c.Field[0] > c.Field[1]) return FALSE;
+
+  for (t = first; t <= last; ++t) {
+    for (f = 0; f < 4; ++f)
+      if (c.Set & (1u << f)) gHwp[t].Field[f] = c.Field[f];
+    gHwp[t].Set |= c.Set;
+  }
+  return TRUE;
+}
+
+// Apply a "turbo <n>=<ratio>..." line to gTurbo; "all=" stands for n = 1..8.
+// FALSE if the line isn't one or is malformed; a malformed line changes nothing.
+static BOOLEAN ParseTurboLine(CHAR8 *p, CHAR8 *end) {
+  UINT32 set = 0;
+  UINT8 ratio[TURBO_BUCKETS];
+  UINT64 v, bucket;
+  UINTN n, b;
+
+  if (!TrimLine(&p, &end)) return FALSE;
+  n = TokenLen(p, end);
+  if (!TokenIs(p, n, "turbo")) return FALSE;
+  p += n;
+
+  for (;;) {
+    CHAR8 *key, *val;
+    UINTN keyLen, valLen;
+
+    while (p < end && IsSpace(*p)) p++;
+    if (p == end) break;
+    key = p;
+    keyLen = TokenLen(p, end);
+    p += keyLen;
+    if (p == end || *p != '=') return FALSE;
+    val = ++p;
+    valLen = TokenLen(p, end);
+    p += valLen;
+    if (!ParseNumber(val, valLen, &v) || !v || v > 0xFF) return FALSE;
+    if (TokenIs(key, keyLen, "all")) {
+      for (b = 0; b < 8; ++b) ratio[b] = (UINT8)v;
+      set |= 0xFF;
+    } else if (ParseNumber(key, keyLen, &bucket) && bucket >= 1 && bucket <= TURBO_BUCKETS) {
+      ratio[bucket - 1] = (UINT8)v;
+      set |= 1u << (bucket - 1);
+    } else {
+      return FALSE;
+    }
+  }
+  if (!set) return FALSE;
+
+  for (b = 0; b < TURBO_BUCKETS; ++b)
+    if ((set >> b) & 1) gTurbo.Ratio[b] = ratio[b];
+  gTurbo.Set |= set;
+  return TRUE;
+}
+
+// Expand a "latency key=value..." line into policy entries; returns how many
+// (0 if the line isn't one or is malformed).
+static UINTN ParseLatencyLine(CHAR8 *p, CHAR8 *end, POLICY_ENTRY out[3]) {
+  POLICY_ENTRY uncore = {MSR_UNCORE_RATIO_LIMIT, SCOPE_PACKAGE, LOCK_NONE,
+                         MATCH_ANY, MATCH_ANY, 0, 0};
+  POLICY_ENTRY cst = {MSR_PKG_CST_CONFIG_CONTROL, SCOPE_CORE, PKG_CST_LOCK_BIT,
+                      MATCH_ANY, MATCH_ANY, 0, 0};
+  POLICY_ENTRY c1e = {MSR_POWER_CTL, SCOPE_CORE, LOCK_NONE, MATCH_ANY, MATCH_ANY, 0, 0};
+  UINT64 v, min = 0, max = 0;
+  BOOLEAN on;
+  UINTN n, count = 0;
+
+  if (!TrimLine(&p, &end)) return 0;
+  n = TokenLen(p, end);
+  if (!TokenIs(p, n, "latency")) return 0;
+  p += n;
+
+  for (;;) {
+    CHAR8 *key, *val;
+    UINTN keyLen, valLen;
+
+    while (p < end && IsSpace(*p)) p++;
+    if (p == end) break;
+    key = p;
+    keyLen = TokenLen(p, end);
+    p += keyLen;
+    if (p == end || *p != '=') return 0;
+    val = ++p;
+    valLen = TokenLen(p, end);
+    p += valLen;
+
+    if (TokenIs(key, keyLen, "c1e")) {
+      if (!ParseSwitch(val, valLen, &on)) return 0;
+      c1e.Mask = POWER_CTL_C1E;
+      c1e.Value = on ? POWER_CTL_C1E : 0;
+    } else if (!ParseNumber(val, valLen, &v)) {
+      return 0;
+    } else if (TokenIs(key, keyLen, "uncore_min") && v <= UNCORE_RATIO_MAX_MASK) {
+      min = v;
+      uncore.Mask |= UNCORE_RATIO_MIN_MASK;
+      uncore.Value |= v << 8;
+    } else if (TokenIs(key, keyLen, "uncore_max") && v <= UNCORE_RATIO_MAX_MASK) {
+      max = v;
+      uncore.Mask |= UNCORE_RATIO_MAX_MASK;
+      uncore.Value |= v;
+    } else if (TokenIs(key, keyLen, "pkg_cstate_limit") && v <= PKG_CST_LIMIT_MASK) {
+      cst.Mask = PKG_CST_LIMIT_MASK;
+      cst.Value = v;
+    } else {
+      return 0;
+    }
+  }
+  if (uncore.Mask == (UNCORE_RATIO_MIN_MASK | UNCORE_RATIO_MAX_MASK) && min > max) return 0;
+
+  if (uncore.Mask) out[count++] = uncore;
+  if (cst.Mask) out[count++] = cst;
+  if (c1e.Mask) out[count++] = c1e;
+  return count;
+}
+
+// Parse "msr <index> key=value..." into *e. Blank and comment-only lines
+// return FALSE with *blank set.
+static BOOLEAN ParseProfileLine(CHAR8 *p, CHAR8 *end, POLICY_ENTRY *e, BOOLEAN *blank) {
+  BOOLEAN haveMask = FALSE, haveValue = FALSE, haveLock = FALSE;
+  UINT64 v;
+  UINTN n, i;
+
+  *blank = !TrimLine(&p, &end);
+  if (*blank) return FALSE;
+
+  n = TokenLen(p, end);
+  if (!TokenIs(p, n, "msr")) return FALSE;
+  p += n;
+  while (p < end && IsSpace(*p)) p++;
+  n = TokenLen(p, end);
+  if (!ParseNumber(p, n, &v) || v > 0xFFFFFFFF) return FALSE;
+  e->Msr = (UINT32)v;
+  e->Scope = SCOPE_PACKAGE;
+  e->LockBit = LOCK_NONE;
+  e->Family = e->Model = MATCH_ANY;
+  p += n;
+
+  for (;;) {
+    CHAR8 *key, *val;
+    UINTN keyLen, valLen;
+
+    while (p < end && IsSpace(*p)) p++;
+    if (p == end) break;
+    key = p;
+    keyLen = TokenLen(p, end);
+    p += keyLen;
+    if (p == end || *p != '=') return FALSE;
+    val = ++p;
+    valLen = TokenLen(p, end);
+    p += valLen;
+
+    if (TokenIs(key, keyLen, "scope")) {
+      if (!ParseScope(val, valLen, &e->Scope)) return FALSE;
+    } else if (TokenIs(key, keyLen, "lock")) {
+      haveLock = TRUE;
+      if (TokenIs(val, valLen, "none")) continue;
+      if (!ParseNumber(val, valLen, &v) || v > 63) return FALSE;
+      e->LockBit = (UINT8)v;
+    } else {
+      if (!ParseNumber(val, valLen, &v)) return FALSE;
+      if (TokenIs(key, keyLen, "mask")) {
+        e->Mask = v;
+        haveMask = TRUE;
+      } else if (TokenIs(key, keyLen, "value")) {
+        e->Value = v;
+        haveValue = TRUE;
+      } else if (TokenIs(key, keyLen, "family") && v < MATCH_ANY) {
+        e->Family = (UINT16)v;
+      } else if (TokenIs(key, keyLen, "model") && v < MATCH_ANY) {
+        e->Model = (UINT16)v;
+      } else {
+        return FALSE;
+      }
+    }
+  }
+
+  if (!haveMask || !haveValue || !e->Mask || (e->Value & ~e->Mask)) return FALSE;
+  if (!haveLock)
+    for (i = 0; i < sizeof(kKnownLocks) / sizeof(kKnownLocks[0]); ++i)
+      if (kKnownLocks[i].Msr == e->Msr) e->LockBit = kKnownLocks[i].Bit;
+  return TRUE;
+}
+
+// Open a file in the directory the app was loaded from.
+static EFI_FILE_HANDLE OpenSiblingFile(CHAR16 *name) {
+  EFI_LOADED_IMAGE *li = NULL;
+  EFI_FILE_IO_INTERFACE *fs = NULL;
+  EFI_FILE_HANDLE root = NULL, file = NULL;
+  EFI_DEVICE_PATH_PROTOCOL *node;
+  CHAR16 path[256], *dir;
+  UINTN dirLen, slash = 0, i;
+
+  if (EFI_ERROR(BS->HandleProtocol(IM, &gEfiLoadedImageProtocolGuid, (void **)&li)) || !li ||
+      !(node = FindFilePathNode(li->FilePath)))
+    return NULL;
+  dir = (CHAR16 *)((UINT8 *)node + sizeof(EFI_DEVICE_PATH_PROTOCOL));
+  dirLen = (DevicePathNodeLength(node) - sizeof(EFI_DEVICE_PATH_PROTOCOL)) / sizeof(CHAR16);
+  for (i = 0; i < dirLen && dir[i]; ++i)
+    if (dir[i] == L'\\') slash = i + 1;
+  i = 0;
+  while (name[i]) i++;
+  if (slash + i + 1 > sizeof(path) / sizeof(path[0])) return NULL;
+  CopyMem(path, dir, slash * sizeof(CHAR16));
+  CopyMem(path + slash, name, (i + 1) * sizeof(CHAR16));
+
+  if (EFI_ERROR(BS->HandleProtocol(li->DeviceHandle, &gEfiSimpleFileSystemProtocolGuid,
+                                   (void **)&fs)) ||
+      !fs || EFI_ERROR(fs->OpenVolume(fs, &root)))
+    return NULL;
+  if (EFI_ERROR(root->Open(root, &file, path, EFI_FILE_MODE_READ, 0))) file = NULL;
+  root->Close(root);
+  return file;
+}
+
+// Read all of `file` (at most PROFILE_MAX_BYTES) into a new pool buffer.
+// Read may return less than asked, so it loops until GetInfo's size is in; a
+// file that ends early is an error rather than a cut-off last line.
+static EFI_STATUS ReadProfile(EFI_FILE_HANDLE file, CHAR8 **buf, UINTN *size) {
+  UINT64 info[(SIZE_OF_EFI_FILE_INFO + 512) / sizeof(UINT64)];
+  UINTN done, chunk = sizeof(info);
+  EFI_STATUS status;
+
+  *buf = NULL;
+  if (EFI_ERROR(status = file->GetInfo(file, &gEfiFileInfoGuid, &chunk, info))) return status;
+  if (((EFI_FILE_INFO *)info)->FileSize > PROFILE_MAX_BYTES) return EFI_BAD_BUFFER_SIZE;
+  *size = (UINTN)((EFI_FILE_INFO *)info)->FileSize;
+  if (EFI_ERROR(status = BS->AllocatePool(EfiLoaderData, *size + 1, (void **)buf))) {
+    *buf = NULL;
+    return status;
+  }
+  for (done = 0; done < *size; done += chunk) {
+    chunk = *size - done;
+    if (EFI_ERROR(status = file->Read(file, &chunk, *buf + done))) break;
+    if (!chunk) status = EFI_END_OF_FILE;
+    if (EFI_ERROR(status)) break;
+  }
+  if (EFI_ERROR(status)) {
+    FreePool(*buf);
+    *buf = NULL;
+  }
+  return status;
+}
+
+// Replace the built-in table with DisablePROCHOT.cfg if it has any valid
+// entries. Missing file: keep the built-in table silently.
+static void LoadPolicyProfile(void) {
+  static POLICY_ENTRY parsed[POLICY_MAX_ENTRIES], latency[3];
+  EFI_FILE_HANDLE file = OpenSiblingFile(L"DisablePROCHOT.cfg");
+  CHAR8 *buf, *line, *end;
+  UINTN size = 0, count = 0, lineNo = 0, latencyCount = 0, n;
+  BOOLEAN blank = FALSE;
+  EFI_STATUS status;
+
+  if (!file) return;
+  status = ReadProfile(file, &buf, &size);
+  file->Close(file);
+  if (status == EFI_BAD_BUFFER_SIZE) {
+    Log(LOG_ERROR, L"Policy profile over ");
+    OutputNum(L"", PROFILE_MAX_BYTES, L" bytes, using built-in policy\r\n");
+    return;
+  }
+  if (EFI_ERROR(status)) {
+    Log(LOG_WARN, L"Policy profile unreadable, using built-in policy\r\n");
+    return;
+  }
+
+  for (line = buf; line < buf + size; line = end + 1) {
+    end = line;
+    while (end < buf + size && *end != '\n') end++;
+    lineNo++;
+    if (ParseSettingLine(line, end) || ParseHwpLine(line, end) || ParseTurboLine(line, end))
+      continue;
+    if ((n = ParseLatencyLine(line, end, latency))) {
+      latencyCount = n;  // a later line replaces an earlier one
+      continue;
+    }
+    if (count < POLICY_MAX_ENTRIES && ParseProfileLine(line, end, &parsed[count], &blank)) {
+      count++;
+    } else if (!blank) {
+      Log(LOG_WARN, L"Policy profile line ");
+      OutputNum(L"", lineNo, L" ignored\r\n");
+    }
+  }
+  FreePool(buf);
+
+  if (!count) {
+    Log(LOG_WARN, L"Policy profile has no entries, using built-in policy\r\n");
+  } else {
+    CopyMem(gPolicy, parsed, count * sizeof(POLICY_ENTRY));
+    gPolicyCount = count;
+    gPolicyFromProfile = TRUE;
+    OutputNum(L"Policy profile: ", count, L" entries\r\n");
+  }
+  if (!latencyCount) return;
+  if (gPolicyCount + latencyCount > POLICY_MAX_ENTRIES) {
+    Log(LOG_WARN, L"Low-latency profile ignored, policy table full\r\n");
+    return;
+  }
+  CopyMem(gPolicy + gPolicyCount, latency, latencyCount * sizeof(POLICY_ENTRY));
+  gPolicyCount += latencyCount;
+  gPolicyFromProfile = TRUE;
+  OutputNum(L"Low-latency profile: ", latencyCount, L" entries\r\n");
+}
+
+// ---------------------------------------------------------------------------
+// S3 resume replay
+//
+// S3 resume re-runs firmware init, which can re-enable BD PROCHOT. The PI boot
+// script has no MSR opcode, so the applied entries are copied, with a small
+// replay routine, into ACPI NVS below 4 GB and registered as a DISPATCH_2
+// opcode through EFI_S3_SAVE_STATE_PROTOCOL. On resume the firmware's boot
+// script executor calls it (64-bit, MS ABI) on the BSP before the OS runs, so
+// thread- and core-scoped entries only reach the BSP's core there. EDK2 locks
+// the boot script at SMM ready-to-lock, before BDS loads any Driver#### or
+// Boot#### image, so there the write is always refused; test/s3 runs the stub
+// on the host instead.
+// ---------------------------------------------------------------------------
+typedef struct _S3_SAVE_STATE_PROTOCOL S3_SAVE_STATE_PROTOCOL;
+struct _S3_SAVE_STATE_PROTOCOL {
+  EFI_STATUS(EFIAPI *Write)(const S3_SAVE_STATE_PROTOCOL *self, UINTN opCode, ...);
+  VOID *Insert;
+  VOID *Label;
+  VOID *Compare;
+};
+
+static EFI_GUID gEfiS3SaveStateProtocolGuid = {
+    0xe857caf6, 0xc046, 0x45dc, {0xbe, 0x3f, 0xee, 0x07, 0x65, 0xfb, 0xa8, 0x87}};
+
+#define BOOT_SCRIPT_DISPATCH_2_OPCODE 0x09
+
+// Replay table the stub walks; LockBit >= 64 means none.
+typedef struct __attribute__((packed)) {
+  UINT32 Msr;
+  UINT32 LockBit;
+  UINT64 Mask;
+  UINT64 Value;
+} S3_REPLAY_ENTRY;
+
+typedef struct __attribute__((packed)) {
+  UINT32 Count;
+  UINT32 Reserved;
+  S3_REPLAY_ENTRY Entry[POLICY_MAX_ENTRIES];
+} S3_REPLAY_TABLE;
+
+// EFI_STATUS EFIAPI S3ReplayStub(EFI_HANDLE unused, S3_REPLAY_TABLE *table)
+// Position independent and self-contained: it runs from its NVS copy, long
+// after this image is gone. Same masked read-modify-write and lock check as
+// WritePolicyEntries.
+__asm__(".text\n"
+        ".globl S3ReplayStub\n"
+        ".globl S3ReplayStubEnd\n"
+        "S3ReplayStub:\n"
+        "  movl (%rdx), %r8d\n"   // entry count
+        "  leaq 8(%rdx), %r9\n"   // first entry
+        "1:\n"
+        "  testl %r8d, %r8d\n"
+        "  jz 3f\n"
+        "  movl (%r9), %ecx\n"
+        "  rdmsr\n"
+        "  shlq $32, %rdx\n"
+        "  orq %rdx, %rax\n"
+        "  movl 4(%r9), %ecx\n"   // lock bit
+        "  cmpl $64, %ecx\n"
+        "  jae 2f\n"
+        "  btq %rcx, %rax\n"
+        "  jc 4f\n"               // locked: leave it alone
+        "2:\n"
+        "  movq 8(%r9), %r10\n"
+        "  notq %r10\n"
+        "  andq %r10, %rax\n"
+        "  orq 16(%r9), %rax\n"
+        "  movq %rax, %rdx\n"
+        "  shrq $32, %rdx\n"
+        "  movl (%r9), %ecx\n"
+        "  wrmsr\n"
+        "4:\n"
+        "  addq $24, %r9\n"
+        "  decl %r8d\n"
+        "  jmp 1b\n"
+        "3:\n"
+        "  xorl %eax, %eax\n"
+        "  ret\n"
+        "S3ReplayStubEnd:\n");
+
+extern const UINT8 S3ReplayStub[], S3ReplayStubEnd[];
+
+#define S3_REPLAY_TABLE_OFFSET 0x100  // stub first, table after it, one page
+
+static BOOLEAN gS3ReplayRegistered;
+
+static void RegisterS3Replay(void) {
+  S3_SAVE_STATE_PROTOCOL *s3 = NULL;
+  EFI_PHYSICAL_ADDRESS page = 0xFFFFFFFF;
+  S3_REPLAY_TABLE *table;
+  UINTN stubSize = (UINTN)(S3ReplayStubEnd - S3ReplayStub), i;
+  EFI_STATUS status;
+
+  if (EFI_ERROR(BS->LocateProtocol(&gEfiS3SaveStateProtocolGuid, NULL, (void **)&s3)) ||
+      !s3) {
+    Log(LOG_WARN, L"S3 resume replay not registered: no S3 Save State protocol\r\n");
+    return;
+  }
+  if (stubSize > S3_REPLAY_TABLE_OFFSET ||
+      EFI_ERROR(BS->AllocatePages(AllocateMaxAddress, EfiACPIMemoryNVS, 1, &page))) {
+    Log(LOG_WARN, L"S3 resume replay not registered: no ACPI NVS memory\r\n");
+    return;
+  }
+
+  CopyMem((void *)(UINTN)page, S3ReplayStub, stubSize);
+  table = (S3_REPLAY_TABLE *)(UINTN)(page + S3_REPLAY_TABLE_OFFSET);
+  table->Count = 0;
+  table->Reserved = 0;
+  for (i = 0; i < gPolicyCount; ++i) {
+    POLICY_RESULT *r = &gPolicyResult[i];
+    S3_REPLAY_ENTRY *e = &table->Entry[table->Count];
+    if (r->Skipped || !(r->Written + r->Unchanged)) continue;
+    e->Msr = gPolicy[i].Msr;
+    e->LockBit = gPolicy[i].LockBit;  // LOCK_NONE (0xFF) is >= 64
+    e->Mask = gPolicy[i].Mask;
+    e->Value = gPolicy[i].Value;
+    table->Count++;
+  }
+  if (!table->Count) {
+    BS->FreePages(page, 1);
+    return;
+  }
+
+  status = s3->Write(s3, BOOT_SCRIPT_DISPATCH_2_OPCODE, page,
+                     page + S3_REPLAY_TABLE_OFFSET);
+  if (EFI_ERROR(status)) {
+    // Always on EDK2: the script is locked before any Driver####/Boot#### runs.
+    BS->FreePages(page, 1);
+    Log(LOG_WARN, L"S3 resume replay not registered: ");
+    OutputHex(L"boot script rejected it (", status, L")\r\n");
+    return;
+  }
+  gS3ReplayRegistered = TRUE;
+  OutputNum(L"S3 resume replay registered for ", table->Count, L" MSRs\r\n");
+}
+
+// ---------------------------------------------------------------------------
+// Resident mode
+//
+// Some firmware and ECs set BD PROCHOT again after our write, during later
+// driver connection or in the next-stage loader. With "set resident=on" the
+// app keeps watching while the chainloaded image runs (we stay loaded: it is
+// started from our efi_main): a periodic timer re-checks the entries that held
+// after the apply and rewrites any that were undone, and an ExitBootServices
+// callback does a final pass. The timer runs at TPL_CALLBACK, so it dispatches
+// to every scope leader like the apply does; when another caller has the APs
+// busy, that tick covers the BSP alone. The ExitBootServices pass runs at
+// TPL_NOTIFY and is BSP-only. Counters and the coverage go to
+// DisablePROCHOTResident.
+// ---------------------------------------------------------------------------
+#define RESIDENT_RECORD_SIGNATURE 0x53525044  // 'DPRS'
+#define RESIDENT_RECORD_VERSION 2
+
+typedef struct __attribute__((packed)) {
+  UINT32 Signature;
+  UINT16 Version;
+  UINT16 Watched;      // entries being kept
+  UINT32 IntervalMs;
+  UINT32 Checks;       // timer ticks so far
+  UINT32 Reasserted;   // ticks that found at least one entry undone
+  UINT32 Rewrites;     // entries rewritten over all ticks
+  UINT16 Cpus;         // CPUs each tick checks (1: BSP only)
+  UINT16 ExitCpus;     // CPUs the ExitBootServices pass checks
+  UINT32 BspOnlyTicks; // ticks the APs were busy or timed out
+} RESIDENT_RECORD;
+
+static struct {
+  EFI_EVENT Timer;
+  EFI_EVENT ExitBootServices;
+  UINT32 Watch;        // bit i: gPolicy[i] held after the apply
+  UINT32 PublishEvery; // ticks between record updates when nothing changed
+  UINT32 ExitRewrites; // final pass; too late to publish
+  MP_DISPATCH Dispatch;
+  CPU_SLOT Bsp;        // the slot when dispatching on the BSP alone
+  RESIDENT_RECORD Rec;
+} gResident;
+
+static void PublishResident(void) {
+  RT->SetVariable(L"DisablePROCHOTResident", &gDisablePROCHOTVendorGuid,
+                  EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS,
+                  sizeof(gResident.Rec), &gResident.Rec);
+}
+
+// TPL_CALLBACK, so SetVariable is still allowed here.
+static void EFIAPI ResidentTick(EFI_EVENT event, VOID *context) {
+  MP_DISPATCH *d = &gResident.Dispatch;
+  UINT32 rewrites;
+  (void)event;
+  (void)context;
+
+  d->Rewrites = 0;
+  if (EFI_ERROR(DispatchPass(d, PASS_REASSERT))) gResident.Rec.BspOnlyTicks++;
+  rewrites = d->Rewrites;
+  gResident.Rec.Checks++;
+  if (rewrites) {
+    gResident.Rec.Reasserted++;
+    gResident.Rec.Rewrites += rewrites;
+  }
+  if (rewrites || gResident.Rec.Checks % gResident.PublishEvery == 0) PublishResident();
+}
+
+// TPL_NOTIFY inside ExitBootServices: MSRs only, no services.
+static void EFIAPI ResidentExitBootServices(EFI_EVENT event, VOID *context) {
+  (void)event;
+  (void)context;
+  gResident.ExitRewrites =
+      ReassertPolicy(gResident.Watch, SCOPE_THREAD | SCOPE_CORE | SCOPE_MODULE | SCOPE_PACKAGE);
+}
+
+// Arm the timer and the ExitBootServices pass for the entries that hold now
+// on the BSP; the ticks check them on every CPU.
+static void StartResident(void) {
+  MP_DISPATCH *d = &gResident.Dispatch;
+  UINTN i;
+
+  if (!gSettings.Resident) return;
+  gResident.Watch = 0;
+  gResident.Rec.Watched = 0;
+  for (i = 0; i < gPolicyCount; ++i) {
+    POLICY_ENTRY *e = &gPolicy[i];
+    uint64_t v;
+
+    if (gPolicyResult[i].Skipped) continue;
+    v = AsmReadMsr64(e->Msr);
+    if (PolicyLocked(e, v) || (v & e->Mask) != e->Value) continue;
+    gResident.Watch |= 1u << i;
+    gResident.Rec.Watched++;
+  }
+  if (!gResident.Watch) {
+    Log(LOG_WARN, L"Resident mode: policy did not take, nothing to keep\r\n");
+    return;
+  }
+
+  if (EFI_ERROR(BS->CreateEvent(EVT_TIMER | EVT_NOTIFY_SIGNAL, TPL_CALLBACK, ResidentTick,
+                                NULL, &gResident.Timer))) {
+    Log(LOG_WARN, L"Resident mode unavailable: no timer event\r\n");
+    return;
+  }
+  if (EFI_ERROR(BS->CreateEvent(EVT_SIGNAL_EXIT_BOOT_SERVICES, TPL_NOTIFY,
+                                ResidentExitBootServices, NULL,
+                                &gResident.ExitBootServices)))
+    gResident.ExitBootServices = NULL;
+  if (!InitDispatch(d)) InitBspDispatch(d, &gResident.Bsp);
+  d->Watch = gResident.Watch;
+
+  gResident.Rec.Signature = RESIDENT_RECORD_SIGNATURE;
+  gResident.Rec.Version = RESIDENT_RECORD_VERSION;
+  gResident.Rec.IntervalMs = gSettings.ResidentIntervalMs;
+  gResident.Rec.Cpus = 0;
+  for (i = 0; i < d->Count; ++i)
+    if (d->Slots[i].Enabled) gResident.Rec.Cpus++;
+  gResident.Rec.ExitCpus = gResident.ExitBootServices ? 1 : 0;
+  gResident.PublishEvery = 1000 / gSettings.ResidentIntervalMs;
+  if (!gResident.PublishEvery) gResident.PublishEvery = 1;
+  PublishResident();
+  BS->SetTimer(gResident.Timer, TimerPeriodic, (UINT64)gSettings.ResidentIntervalMs * 10000);
+
+  OutputNum(L"Resident mode: keeping ", gResident.Rec.Watched, L" entries on ");
+  OutputNum(L"", gResident.Rec.Cpus, L" CPUs, ");
+  OutputNum(L"every ", gSettings.ResidentIntervalMs, L" ms\r\n");
+}
+
+#ifndef DRIVER_BUILD
+// The chainloaded image returned (or nothing was started): we're about to be
+// unloaded, so the callbacks must go. A driver stays loaded and keeps them.
+static void StopResident(void) {
+  if (gResident.Timer) {
+    BS->SetTimer(gResident.Timer, TimerCancel, 0);
+    BS->CloseEvent(gResident.Timer);
+    gResident.Timer = NULL;
+    PublishResident();
+  }
+  if (gResident.ExitBootServices) {
+    BS->CloseEvent(gResident.ExitBootServices);
+    gResident.ExitBootServices = NULL;
+  }
+  if (gResident.Dispatch.Mp) {
+    FreePool(gResident.Dispatch.Slots);
+    gResident.Dispatch.Mp = NULL;
+  }
+}
+#endif
+
+// ---------------------------------------------------------------------------
+// Thermal governor
+//
+// Opt-in ("set governor=on"): with BD PROCHOT off, a timer reads the BSP's
+// core and package temperature (TjMax minus the digital readout) and throttles
+// only on measured heat. At the trip point the BSP's requested ratio drops to
+// governor_ratio (the HWP max when HWP is on, else IA32_PERF_CTL); it goes back
+// once the temperature is the hysteresis below the trip point. Pre-boot the
+// APs idle, so the BSP's request sets the clock. Like resident mode it keeps
+// running while the chainloaded image runs, and the original request is put
+// back at ExitBootServices so the OS starts unthrottled. The governor owns the
+// request MSR while it runs: resident mode stops keeping any policy entry on
+// it, which would otherwise undo a throttle on its next tick. Peaks and
+// throttle counts go to DisablePROCHOTGovernor.
+// ---------------------------------------------------------------------------
+#define MSR_TEMPERATURE_TARGET 0x1A2
+#define CPUID6_DTS (1u << 0)
+#define CPUID6_PTM (1u << 6)
+#define THERM_READOUT_VALID (1ULL << 31)  // IA32_THERM_STATUS only
+
+#define GOVERNOR_RECORD_SIGNATURE 0x47545044  // 'DPTG'
+#define GOVERNOR_RECORD_VERSION 1
+
+enum { GOVERNOR_PERF_CTL = 1, GOVERNOR_HWP_MAX = 2 };
+
+typedef struct __attribute__((packed)) {
+  UINT32 Signature;
+  UINT16 Version;
+  UINT8 TjMax;         // C
+  UINT8 TripC;
+  UINT8 ReleaseC;
+  UINT8 Ratio;         // requested while throttled
+  UINT8 Method;        // GOVERNOR_*
+  UINT8 Throttled;     // at the last update
+  UINT8 PeakCoreC;     // BSP core
+  UINT8 PeakPackageC;  // 0: no package sensor
+  UINT16 Reserved;
+  UINT32 IntervalMs;
+  UINT32 Samples;
+  UINT32 Throttles;    // times the trip point was reached
+  UINT32 ThrottledMs;
+} GOVERNOR_RECORD;
+
+static struct {
+  EFI_EVENT Timer;
+  EFI_EVENT ExitBootServices;
+  UINT32 Msr;          // MSR_PERF_CTL or MSR_HWP_REQUEST
+  UINT64 Saved;        // its value when throttling started
+  BOOLEAN Package;     // package sensor present
+  UINT32 PublishEvery; // ticks between record updates when nothing changed
+  GOVERNOR_RECORD Rec;
+} gGovernor;
+
+// Degrees C from a thermal status MSR; 0 if the readout isn't valid.
+static UINT8 ReadTemperature(UINT32 msr, BOOLEAN hasValidBit) {
+  UINT64 v = AsmReadMsr64(msr);
+  UINT8 below = (UINT8)((v >> 16) & 0x7F);
+
+  if ((hasValidBit && !(v & THERM_READOUT_VALID)) || below > gGovernor.Rec.TjMax) return 0;
+  return (UINT8)(gGovernor.Rec.TjMax - below);
+}
+
+// Cap the request at the governor ratio, or put the saved one back. A
+// request already at or below the ratio is left alone, never raised.
+static void GovernorThrottle(BOOLEAN on) {
+  UINT64 v, ratio = gGovernor.Rec.Ratio;
+
+  gGovernor.Rec.Throttled = on;
+  if (!on) {
+    AsmWriteMsr64(gGovernor.Msr, gGovernor.Saved);
+    return;
+  }
+  v = gGovernor.Saved = AsmReadMsr64(gGovernor.Msr);
+  if (((v >> 8) & 0xFF) > ratio) v = (v & ~0xFF00ULL) | ratio << 8;  // PERF_CTL target / HWP maximum
+  if (gGovernor.Msr == MSR_HWP_REQUEST) {
+    if ((v & 0xFF) > ratio) v = (v & ~0xFFULL) | ratio;                      // minimum
+    if (((v >> 16) & 0xFF) > ratio) v = (v & ~0xFF0000ULL) | ratio << 16;  // desired
+  }
+  AsmWriteMsr64(gGovernor.Msr, v);
+}
+
+static void PublishGovernor(void) {
+  RT->SetVariable(L"DisablePROCHOTGovernor", &gDisablePROCHOTVendorGuid,
+                  EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS,
+                  sizeof(gGovernor.Rec), &gGovernor.Rec);
+}
+
+// TPL_CALLBACK, so SetVariable is still allowed here.
+static void EFIAPI GovernorTick(EFI_EVENT event, VOID *context) {
+  GOVERNOR_RECORD *rec = &gGovernor.Rec;
+  UINT8 core = ReadTemperature(MSR_THERM_STATUS, TRUE);
+  UINT8 pkg = gGovernor.Package ? ReadTemperature(MSR_PACKAGE_THERM_STATUS, FALSE) : 0;
+  UINT8 hot = core > pkg ? core : pkg;
+  BOOLEAN changed = FALSE;
+  (void)event;
+  (void)context;
+
+  rec->Samples++;
+  if (core > rec->PeakCoreC) {
+    rec->PeakCoreC = core;
+    changed = TRUE;
+  }
+  if (pkg > rec->PeakPackageC) {
+    rec->PeakPackageC = pkg;
+    changed = TRUE;
+  }
+  if (!rec->Throttled && hot >= rec->TripC) {
+    GovernorThrottle(TRUE);
+    rec->Throttles++;
+    changed = TRUE;
+  } else if (rec->Throttled && hot && hot <= rec->ReleaseC) {
+    GovernorThrottle(FALSE);
+    changed = TRUE;
+  }
+  if (rec->Throttled) rec->ThrottledMs += rec->IntervalMs;
+  if (changed || rec->Samples % gGovernor.PublishEvery == 0) PublishGovernor();
+}
+
+// TPL_NOTIFY inside ExitBootServices: MSRs only, no services.
+static void EFIAPI GovernorExitBootServices(EFI_EVENT event, VOID *context) {
+  (void)event;
+  (void)context;
+  if (gGovernor.Rec.Throttled) GovernorThrottle(FALSE);
+}
+
+// Take the request MSR away from resident mode.
+static void GovernorClaimMsr(void) {
+  UINTN i, dropped = 0;
+
+  for (i = 0; i < gPolicyCount; ++i) {
+    if (!(gResident.Watch & (1u << i)) || gPolicy[i].Msr != gGovernor.Msr) continue;
+    gResident.Watch &= ~(1u << i);
+    gResident.Rec.Watched--;
+    dropped++;
+  }
+  gResident.Dispatch.Watch = gResident.Watch;
+  if (dropped) {
+    OutputHex(L"Resident mode: MSR ", gGovernor.Msr, L" left to the thermal governor\r\n");
+    if (gResident.Timer) PublishResident();
+  }
+}
+
+// Needs the digital thermal sensor and TjMax; run while the fault handler is
+// armed, so a missing MSR means "not started" rather than a #GP.
+static void StartGovernor(void) {
+  GOVERNOR_RECORD *rec = &gGovernor.Rec;
+  uint32_t r[4];
+  UINT64 v;
+
+  if (!gSettings.Governor) return;
+  AsmCpuid(0, 0, r);
+  if (r[0] >= 6)
+    AsmCpuid(6, 0, r);
+  else
+    r[0] = 0;
+  if (!(r[0] & CPUID6_DTS) || EFI_ERROR(MsrRead(MSR_TEMPERATURE_TARGET, &v)) ||
+      !((v >> 16) & 0xFF) || EFI_ERROR(MsrRead(MSR_THERM_STATUS, &v))) {
+    Log(LOG_WARN, L"Thermal governor: no digital thermal sensor, not started\r\n");
+    return;
+  }
+  MsrRead(MSR_TEMPERATURE_TARGET, &v);
+  rec->TjMax = (UINT8)(v >> 16);
+  gGovernor.Package = (r[0] & CPUID6_PTM) != 0;
+
+  gGovernor.Msr = MSR_PERF_CTL;
+  rec->Method = GOVERNOR_PERF_CTL;
+  if ((r[0] & CPUID6_HWP) && !EFI_ERROR(MsrRead(MSR_PM_ENABLE, &v)) && (v & 1)) {
+    gGovernor.Msr = MSR_HWP_REQUEST;
+    rec->Method = GOVERNOR_HWP_MAX;
+  }
+  if (EFI_ERROR(MsrRead(gGovernor.Msr, &v)) || EFI_ERROR(MsrWrite(gGovernor.Msr, v))) {
+    Log(LOG_WARN, L"Thermal governor: no writable performance request, not started\r\n");
+    return;
+  }
+
+  if (EFI_ERROR(BS->CreateEvent(EVT_TIMER | EVT_NOTIFY_SIGNAL, TPL_CALLBACK, GovernorTick,
+                                NULL, &gGovernor.Timer))) {
+    Log(LOG_WARN, L"Thermal governor unavailable: no timer event\r\n");
+    return;
+  }
+  if (EFI_ERROR(BS->CreateEvent(EVT_SIGNAL_EXIT_BOOT_SERVICES, TPL_NOTIFY,
+                                GovernorExitBootServices, NULL,
+                                &gGovernor.ExitBootServices)))
+    gGovernor.ExitBootServices = NULL;
+  GovernorClaimMsr();
+
+  rec->Signature = GOVERNOR_RECORD_SIGNATURE;
+  rec->Version = GOVERNOR_RECORD_VERSION;
+  rec->TripC = gSettings.GovernorTripC;
+  rec->ReleaseC = (UINT8)(gSettings.GovernorTripC - gSettings.GovernorHysteresisC);
+  rec->Ratio = gSettings.GovernorRatio;
+  rec->IntervalMs = gSettings.GovernorIntervalMs;
+  gGovernor.PublishEvery = 1000 / gSettings.GovernorIntervalMs;
+  if (!gGovernor.PublishEvery) gGovernor.PublishEvery = 1;
+  GovernorTick(NULL, NULL);  // first sample now, publishes the record
+  BS->SetTimer(gGovernor.Timer, TimerPeriodic, (UINT64)gSettings.GovernorIntervalMs * 10000);
+
+  OutputNum(L"Thermal governor: TjMax ", rec->TjMax, L" C, ");
+  OutputNum(L"ratio ", rec->Ratio, L" from ");
+  OutputNum(L"", rec->TripC, L" C until ");
+  OutputNum(L"", rec->ReleaseC, L" C, ");
+  OutputNum(L"now ", rec->PeakCoreC, L" C\r\n");
+}
+
+#ifndef DRIVER_BUILD
+// The chainloaded image returned: unthrottle and drop the callbacks before
+// we're unloaded.
+static void StopGovernor(void) {
+  if (gGovernor.Timer) {
+    BS->SetTimer(gGovernor.Timer, TimerCancel, 0);
+    BS->CloseEvent(gGovernor.Timer);
+    gGovernor.Timer = NULL;
+    if (gGovernor.Rec.Throttled) GovernorThrottle(FALSE);
+    PublishGovernor();
+  }
+  if (gGovernor.ExitBootServices) {
+    BS->CloseEvent(gGovernor.ExitBootServices);
+    gGovernor.ExitBootServices = NULL;
+  }
+}
+#endif
+
+// ---------------------------------------------------------------------------
+// A/B experiment
+//
+// Writing DisablePROCHOTExperiment (non-volatile, EXPERIMENT_CONTROL with a
+// round count and Boots = 0) starts it. Boots then alternate between a
+// baseline boot, which leaves the firmware's clamps alone, and a policy boot,
+// and both run the same fixed compute loop on the boot CPU once the policy
+// step is over. Each boot adds its throughput, APERF/MPERF frequency and
+// package energy to DisablePROCHOTExperimentResults (non-volatile, a ring of
+// the last EXPERIMENT_SAMPLES boots). After 2 * Rounds boots the control
+// variable is deleted, so every later boot applies the policy as usual.
+//
+// MSRs survive a warm reset, so a baseline boot can find an earlier policy
+// boot's values still in place. Before every policy apply (experiment or not)
+// the BSP notes what firmware left in each MSR the policy changes, in the
+// non-volatile DisablePROCHOTFirmware; a baseline boot that finds the BSP's
+// MSRs differing from it writes the firmware values back on every CPU first.
+// Without a record, a baseline whose MSRs already hold the policy is marked
+// contaminated and not measured.
+// ---------------------------------------------------------------------------
+#define EXPERIMENT_CONTROL_SIGNATURE 0x43585044  // 'DPXC'
+#define EXPERIMENT_RESULTS_SIGNATURE 0x52585044  // 'DPXR'
+#define EXPERIMENT_CONTROL_VERSION 1
+#define EXPERIMENT_RESULTS_VERSION 2
+#define EXPERIMENT_SAMPLES 32
+#define EXPERIMENT_ITERATIONS (1u << 22)  // about 20 ms; RAPL ticks every ~1 ms
+
+#define EXPERIMENT_ARM_BASELINE 0
+#define EXPERIMENT_ARM_POLICY 1
+
+#define EXPERIMENT_NO_APERF 0x01       // no APERF/MPERF, EffectiveMhz is 0
+#define EXPERIMENT_NO_ENERGY 0x02      // no RAPL package counter, EnergyUj is 0
+#define EXPERIMENT_RESTORED 0x04       // firmware values written back first
+#define EXPERIMENT_CONTAMINATED 0x08   // policy state left over; not measured
+
+// How the boot found the MSRs. UEFI doesn't report the reset type, so it is
+// inferred from them.
+enum {
+  EXPERIMENT_RESET_UNKNOWN,  // no firmware values recorded to compare with
+  EXPERIMENT_RESET_COLD,     // as firmware left them
+  EXPERIMENT_RESET_WARM,     // some still held an earlier boot's values
+};
+
+#define FIRMWARE_RECORD_SIGNATURE 0x57465044  // 'DPFW'
+#define FIRMWARE_RECORD_VERSION 1
+
+typedef struct __attribute__((packed)) {
+  UINT32 Signature;
+  UINT16 Version;
+  UINT16 Rounds;  // baseline + policy pairs to run
+  UINT16 Boots;   // experiment boots started so far
+  UINT16 Reserved;
+} EXPERIMENT_CONTROL;
+
+typedef struct __attribute__((packed)) {
+  UINT16 Boot;   // 1-based; odd boots are baselines
+  UINT8 Arm;     // EXPERIMENT_ARM_*
+  UINT8 Flags;   // EXPERIMENT_NO_*, _RESTORED, _CONTAMINATED
+  UINT8 Reset;   // EXPERIMENT_RESET_*
+  UINT8 Reserved[3];
+  UINT32 Us;     // loop wall time
+  UINT32 IterationsPerMs;
+  UINT32 EffectiveMhz;  // TSC rate * dAPERF / dMPERF over the loop
+  UINT32 EnergyUj;      // package energy over the loop
+} EXPERIMENT_SAMPLE;
+
+typedef struct __attribute__((packed)) {
+  UINT32 Signature;
+  UINT16 Version;
+  UINT16 Rounds;
+  UINT16 Count;  // valid samples
+  UINT16 Next;   // slot the next sample goes to
+  UINT8 Complete;
+  UINT8 Reserved[3];
+  UINT32 TscKhz;
+  EXPERIMENT_SAMPLE Sample[EXPERIMENT_SAMPLES];
+} EXPERIMENT_RESULTS;
+
+typedef struct __attribute__((packed)) {
+  UINT32 Msr;
+  UINT8 Scope;
+  UINT8 LockBit;
+  UINT16 Reserved;
+  UINT64 Mask;   // bits the policy writes
+  UINT64 Value;  // their state as firmware left them on the BSP, within Mask
+} FIRMWARE_ENTRY;
+
+typedef struct __attribute__((packed)) {
+  UINT32 Signature;
+  UINT16 Version;
+  UINT16 Count;
+  FIRMWARE_ENTRY Entry[POLICY_MAX_ENTRIES];
+} FIRMWARE_RECORD;
+
+#define FIRMWARE_RECORD_SIZE(n) (sizeof(FIRMWARE_RECORD) - (POLICY_MAX_ENTRIES - (n)) * \
+                                 sizeof(FIRMWARE_ENTRY))
+
+static EXPERIMENT_CONTROL gExperiment;
+static BOOLEAN gExperimentActive;
+static UINT8 gExperimentReset;   // EXPERIMENT_RESET_*
+static UINT8 gExperimentFlags;   // EXPERIMENT_RESTORED, _CONTAMINATED
+static UINT32 gExperimentResidue;  // bit i: gFirmware.Entry[i] doesn't hold on the BSP
+static volatile UINT64 gExperimentSink;  // keeps the loop from being folded away
+
+static FIRMWARE_RECORD gFirmware;
+static BOOLEAN gFirmwareLoaded;
+
+static void FirmwareLoad(void) {
+  UINTN size = sizeof(gFirmware);
+
+  if (gFirmwareLoaded) return;
+  gFirmwareLoaded = TRUE;
+  if (EFI_ERROR(RT->GetVariable(L"DisablePROCHOTFirmware", &gDisablePROCHOTVendorGuid, NULL,
+                                &size, &gFirmware)) ||
+      size < FIRMWARE_RECORD_SIZE(0) || gFirmware.Signature != FIRMWARE_RECORD_SIGNATURE ||
+      gFirmware.Version != FIRMWARE_RECORD_VERSION || gFirmware.Count > POLICY_MAX_ENTRIES ||
+      size != FIRMWARE_RECORD_SIZE(gFirmware.Count))
+    ZeroMem(&gFirmware, sizeof(gFirmware));
+}
+
+// Note `value` (within mask) as firmware's for msr. TRUE if the record changed.
+static BOOLEAN FirmwareNote(UINT32 msr, UINT8 scope, UINT8 lockBit, UINT64 mask,
+                            UINT64 value) {
+  FIRMWARE_ENTRY *f;
+  UINTN i;
+
+  for (i = 0; i < gFirmware.Count; ++i) {
+    f = &gFirmware.Entry[i];
+    if (f->Msr != msr || f->Mask != mask) continue;
+    if (f->Value == value && f->Scope == scope && f->LockBit == lockBit) return FALSE;
+    break;
+  }
+  if (i == POLICY_MAX_ENTRIES) return FALSE;
+  if (i == gFirmware.Count) gFirmware.Count++;
+  f = &gFirmware.Entry[i];
+  f->Msr = msr;
+  f->Scope = scope;
+  f->LockBit = lockBit;
+  f->Reserved = 0;
+  f->Mask = mask;
+  f->Value = value;
+  return TRUE;
+}
+
+// Runs on the BSP with the #GP handler armed, right before the policy apply:
+// note every MSR the policy is about to change (the BSP's view), and the BSP's
+// HWP request if an hwp line will rewrite it. Values the policy already holds
+// may be left over from an earlier boot, so they aren't noted.
+static void FirmwareSnapshot(void) {
+  POLICY_ENTRY *e;
+  HWP_CONFIG *c;
+  uint32_t r[4];
+  UINT64 v, mask = 0, want = 0;
+  UINT16 family, model;
+  BOOLEAN changed = FALSE;
+  UINTN i, f;
+
+  if (!gArmedGate) return;
+  FirmwareLoad();
+  CpuFamilyModel(&family, &model);
+  for (i = 0; i < gPolicyCount; ++i) {
+    e = &gPolicy[i];
+    if ((e->Family != MATCH_ANY && e->Family != family) ||
+        (e->Model != MATCH_ANY && e->Model != model) || EFI_ERROR(MsrRead(e->Msr, &v)) ||
+        PolicyLocked(e, v) || (v & e->Mask) == e->Value)
+      continue;
+    changed |= FirmwareNote(e->Msr, e->Scope, e->LockBit, e->Mask, v & e->Mask);
+  }
+
+  c = &gHwp[HwpCoreType()];
+  AsmCpuid(0, 0, r);
+  if (c->Set && r[0] >= 6) {
+    AsmCpuid(6, 0, r);
+    for (f = 0; f < 4; ++f) {
+      if (!(c->Set & (1u << f)) || (f == 3 && !(r[0] & CPUID6_HWP_EPP))) continue;
+      mask |= 0xFFULL << (f * 8);
+      want |= (UINT64)c->Field[f] << (f * 8);
+    }
+    if ((r[0] & CPUID6_HWP) && !EFI_ERROR(MsrRead(MSR_PM_ENABLE, &v)) && (v & 1) &&
+        !EFI_ERROR(MsrRead(MSR_HWP_REQUEST, &v)) && (v & mask) != want)
+      changed |= FirmwareNote(MSR_HWP_REQUEST, SCOPE_THREAD, LOCK_NONE, mask, v & mask);
+  }
+
+  if (!changed) return;
+  gFirmware.Signature = FIRMWARE_RECORD_SIGNATURE;
+  gFirmware.Version = FIRMWARE_RECORD_VERSION;
+  RT->SetVariable(L"DisablePROCHOTFirmware", &gDisablePROCHOTVendorGuid,
+                  EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS |
+                      EFI_VARIABLE_RUNTIME_ACCESS,
+                  FIRMWARE_RECORD_SIZE(gFirmware.Count), &gFirmware);
+}
+
+// How this boot found the BSP's MSRs: against the firmware record, or, without
+// one, whether a baseline already holds the policy.
+static void ExperimentCheckMsrs(BOOLEAN baseline) {
+  UINT16 family, model;
+  UINT64 v;
+  UINTN i;
+
+  FirmwareLoad();
+  gExperimentResidue = 0;
+  for (i = 0; i < gFirmware.Count; ++i) {
+    FIRMWARE_ENTRY *f = &gFirmware.Entry[i];
+    if (!EFI_ERROR(MsrRead(f->Msr, &v)) && (v & f->Mask) != f->Value)
+      gExperimentResidue |= 1u << i;
+  }
+  if (gFirmware.Count) {
+    gExperimentReset = gExperimentResidue ? EXPERIMENT_RESET_WARM : EXPERIMENT_RESET_COLD;
+    return;
+  }
+
+  gExperimentReset = EXPERIMENT_RESET_UNKNOWN;
+  if (!baseline) return;
+  CpuFamilyModel(&family, &model);
+  for (i = 0; i < gPolicyCount; ++i) {
+    POLICY_ENTRY *e = &gPolicy[i];
+    if ((e->Family != MATCH_ANY && e->Family != family) ||
+        (e->Model != MATCH_ANY && e->Model != model) || EFI_ERROR(MsrRead(e->Msr, &v)) ||
+        (v & e->Mask) != e->Value)
+      continue;
+    gExperimentFlags |= EXPERIMENT_CONTAMINATED;
+    Log(LOG_WARN, L"Experiment: MSRs already hold the policy and no firmware values are "
+                  L"recorded, baseline contaminated\r\n");
+    return;
+  }
+}
+
+// Called before the policy. TRUE: this is a baseline boot, skip the policy.
+static BOOLEAN ExperimentBegin(void) {
+  UINTN size = sizeof(gExperiment);
+
+  if (EFI_ERROR(RT->GetVariable(L"DisablePROCHOTExperiment", &gDisablePROCHOTVendorGuid, NULL,
+                                &size, &gExperiment)) ||
+      size != sizeof(gExperiment) || gExperiment.Signature != EXPERIMENT_CONTROL_SIGNATURE ||
+      gExperiment.Version != EXPERIMENT_CONTROL_VERSION || !gExperiment.Rounds ||
+      gExperiment.Boots >= 2 * gExperiment.Rounds)
+    return FALSE;
+  // Counted before the run, so a boot that never gets to record is not retried
+  // forever in the same arm.
+  gExperiment.Boots++;
+  if (EFI_ERROR(RT->SetVariable(L"DisablePROCHOTExperiment", &gDisablePROCHOTVendorGuid,
+                                EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS |
+                                    EFI_VARIABLE_RUNTIME_ACCESS,
+                                sizeof(gExperiment), &gExperiment))) {
+    Log(LOG_WARN, L"Experiment: control variable not writable, not run\r\n");
+    return FALSE;
+  }
+  gExperimentActive = TRUE;
+  OutputNum(L"Experiment: boot ", gExperiment.Boots, L" of ");
+  OutputNum(L"", 2 * (UINTN)gExperiment.Rounds,
+            gExperiment.Boots % 2 ? L", baseline (policy not applied)\r\n" : L", policy\r\n");
+  ExperimentCheckMsrs(gExperiment.Boots % 2 != 0);
+  return gExperiment.Boots % 2 != 0;
+}
+
+// Baseline boots, in place of the policy: put back, on every CPU, the firmware
+// values an earlier boot left changed. Anything that doesn't take (locked,
+// read back wrong) leaves the baseline contaminated.
+static void ExperimentRestore(void) {
+  UINTN i, n = 0;
+
+  if (!gExperimentResidue) return;
+  for (i = 0; i < gFirmware.Count; ++i) {
+    FIRMWARE_ENTRY *f = &gFirmware.Entry[i];
+    if (!(gExperimentResidue & (1u << i))) continue;
+    gPolicy[n].Msr = f->Msr;
+    gPolicy[n].Scope = f->Scope;
+    gPolicy[n].LockBit = f->LockBit;
+    gPolicy[n].Family = gPolicy[n].Model = MATCH_ANY;
+    gPolicy[n].Mask = f->Mask;
+    gPolicy[n].Value = f->Value;
+    n++;
+  }
+  gPolicyCount = n;
+  ZeroMem(gHwp, sizeof(gHwp));  // the HWP request is a restore entry now
+  gSettings.Diagnostics = FALSE;
+  OutputNum(L"Experiment: restoring ", n, L" firmware values left by an earlier boot\r\n");
+  ApplyPolicyAllCpus();
+  for (i = 0; i < n; ++i)
+    if (gPolicyResult[i].Skipped || gPolicyResult[i].Locked || gPolicyResult[i].Failed) break;
+  if (i < n) {
+    gExperimentFlags |= EXPERIMENT_CONTAMINATED;
+    Log(LOG_WARN, L"Experiment: firmware values did not all take, baseline contaminated\r\n");
+  } else {
+    gExperimentFlags |= EXPERIMENT_RESTORED;
+  }
+}
+
+// The fixed workload: a dependent xorshift-multiply chain, integer only.
+static UINT64 ExperimentLoop(UINT64 x) {
+  UINT32 i;
+  for (i = 0; i < EXPERIMENT_ITERATIONS; ++i) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    x *= 0xD6E8FEB86659FD93ull;
+  }
+  return x;
+}
+
+// Same reads as DiagSample; a source that faults is flagged as missing.
+static void ExperimentMeasure(EXPERIMENT_SAMPLE *s, UINT32 tscKhz) {
+  UINT32 sources = DiagSources();
+  BOOLEAN perf, energy;
+  UINT64 a0 = 0, m0 = 0, e0 = 0, a1, m1, e1, esu, t0, t1;
+
+  perf = (sources & DIAG_SRC_APERF_MPERF) && DiagReadPerf(&m0, &a0);
+  energy = (sources & DIAG_SRC_PKG_ENERGY) && DiagReadEnergy(&e0, &esu);
+  t0 = AsmReadTsc();
+  gExperimentSink = ExperimentLoop(t0 | 1);
+  t1 = AsmReadTsc();
+
+  s->Us = tscKhz ? (UINT32)((t1 - t0) * 1000 / tscKhz) : 0;
+  s->IterationsPerMs = s->Us ? (UINT32)((UINT64)EXPERIMENT_ITERATIONS * 1000 / s->Us) : 0;
+  perf = perf && DiagReadPerf(&m1, &a1);
+  energy = energy && DiagReadEnergy(&e1, &esu);
+  if (!perf) s->Flags |= EXPERIMENT_NO_APERF;
+  if (!energy) s->Flags |= EXPERIMENT_NO_ENERGY;
+  if (perf) {
+    UINT64 dm = m1 - m0, da = a1 - a0;
+    s->EffectiveMhz = dm ? (UINT32)(da * tscKhz / dm / 1000) : 0;
+  }
+  if (energy) s->EnergyUj = (UINT32)(((UINT64)(UINT32)(e1 - e0) * 1000000) >> esu);
+}
+
+// Called after the policy step on both arms: run the loop, append the sample.
+static void ExperimentRecord(void) {
+  static EXPERIMENT_RESULTS res;
+  EXPERIMENT_SAMPLE *s;
+  UINTN size = sizeof(res);
+  UINT32 tscKhz = TscKhz();
+
+  if (!gExperimentActive) return;
+  if (gExperiment.Boots == 1 ||
+      EFI_ERROR(RT->GetVariable(L"DisablePROCHOTExperimentResults", &gDisablePROCHOTVendorGuid,
+                                NULL, &size, &res)) ||
+      size != sizeof(res) || res.Signature != EXPERIMENT_RESULTS_SIGNATURE ||
+      res.Version != EXPERIMENT_RESULTS_VERSION || res.Next >= EXPERIMENT_SAMPLES) {
+    ZeroMem(&res, sizeof(res));  // first boot of a new experiment
+    res.Signature = EXPERIMENT_RESULTS_SIGNATURE;
+    res.Version = EXPERIMENT_RESULTS_VERSION;
+  }
+  res.Rounds = gExperiment.Rounds;
+  res.TscKhz = tscKhz;
+  s = &res.Sample[res.Next];
+  ZeroMem(s, sizeof(*s));
+  s->Boot = gExperiment.Boots;
+  s->Arm = gExperiment.Boots % 2 ? EXPERIMENT_ARM_BASELINE : EXPERIMENT_ARM_POLICY;
+  s->Reset = gExperimentReset;
+  s->Flags = gExperimentFlags;
+  if (!(s->Flags & EXPERIMENT_CONTAMINATED)) ExperimentMeasure(s, tscKhz);
+  res.Next = (UINT16)((res.Next + 1) % EXPERIMENT_SAMPLES);
+  if (res.Count < EXPERIMENT_SAMPLES) res.Count++;
+  res.Complete = gExperiment.Boots >= 2 * gExperiment.Rounds;
+  RT->SetVariable(L"DisablePROCHOTExperimentResults", &gDisablePROCHOTVendorGuid,
+                  EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS |
+                      EFI_VARIABLE_RUNTIME_ACCESS,
+                  sizeof(res), &res);
+
+  if (s->Flags & EXPERIMENT_CONTAMINATED) {
+    Output(L"Experiment: contaminated baseline recorded, not measured\r\n");
+  } else {
+    OutputNum(L"Experiment: ", s->IterationsPerMs, L" iterations/ms, ");
+    OutputNum(L"", s->EffectiveMhz, L" MHz, ");
+    OutputNum(L"", s->EnergyUj, L" uJ\r\n");
+  }
+  if (res.Complete) {
+    RT->SetVariable(L"DisablePROCHOTExperiment", &gDisablePROCHOTVendorGuid, 0, 0, NULL);
+    Output(L"Experiment complete, policy stays on\r\n");
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Applied-policy record
+//
+// What was applied, per entry, in the volatile DisablePROCHOTPolicy vendor
+// variable, so the OS can see (and re-apply) the exact policy of this boot.
+// ---------------------------------------------------------------------------
+#define POLICY_RECORD_SIGNATURE 0x4C505044  // 'DPPL'
+#define POLICY_RECORD_VERSION 2
+
+#define POLICY_STATUS_SKIPPED 0x01  // CPU family/model didn't match
+#define POLICY_STATUS_APPLIED 0x02  // written or already set on some CPU
+#define POLICY_STATUS_LOCKED 0x04   // lock bit set on some CPU
+#define POLICY_STATUS_FAILED 0x08   // read back wrong on some CPU
+#define POLICY_STATUS_UNSUPPORTED 0x10  // MSR faulted on the probe (with SKIPPED)
+
+typedef struct __attribute__((packed)) {
+  UINT32 Signature;
+  UINT16 Version;
+  UINT8 EntryCount;
+  UINT8 Source;  // 0: built-in, 1: DisablePROCHOT.cfg
+  UINT32 Cpus;
+  UINT32 CpusVerified;
+  UINT8 S3Replay;  // 1: registered in the S3 boot script
+  UINT8 Reserved[3];
+} POLICY_RECORD_HEADER;
+
+typedef struct __attribute__((packed)) {
+  UINT32 Msr;
+  UINT8 Scope;
+  UINT8 LockBit;
+  UINT8 Status;  // POLICY_STATUS_*
+  UINT8 Reserved;
+  UINT64 Mask;
+  UINT64 Value;
+  UINT32 Written;
+  UINT32 Unchanged;
+  UINT32 Locked;
+  UINT32 Verified;
+  UINT32 Failed;
+} POLICY_RECORD_ENTRY;
 
-static void Output(CHAR16 *s) {
-#ifdef SILENT
-  (void)s;  // no console output; LTO strips the now-unused string literals
-#else
-  ST->ConOut->OutputString(ST->ConOut, s);
-#endif
+static void ReportPolicy(void) {
+  static struct __attribute__((packed)) {
+    POLICY_RECORD_HEADER Header;
+    POLICY_RECORD_ENTRY Entry[POLICY_MAX_ENTRIES];
+  } rec;
+  UINTN i;
+
+  rec.Header.Signature = POLICY_RECORD_SIGNATURE;
+  rec.Header.Version = POLICY_RECORD_VERSION;
+  rec.Header.EntryCount = (UINT8)gPolicyCount;
+  rec.Header.Source = gPolicyFromProfile;
+  rec.Header.Cpus = (UINT32)gPolicyCpus;
+  rec.Header.CpusVerified = (UINT32)gPolicyCpusVerified;
+  rec.Header.S3Replay = gS3ReplayRegistered;
+  for (i = 0; i < gPolicyCount; ++i) {
+    POLICY_ENTRY *e = &gPolicy[i];
+    POLICY_RESULT *r = &gPolicyResult[i];
+    POLICY_RECORD_ENTRY *o = &rec.Entry[i];
+
+    o->Msr = e->Msr;
+    o->Scope = e->Scope;
+    o->LockBit = e->LockBit;
+    o->Status = (UINT8)((r->Skipped ? POLICY_STATUS_SKIPPED : 0) |
+                        (r->Written + r->Unchanged ? POLICY_STATUS_APPLIED : 0) |
+                        (r->Locked ? POLICY_STATUS_LOCKED : 0) |
+                        (r->Failed ? POLICY_STATUS_FAILED : 0) |
+                        (r->Fault ? POLICY_STATUS_UNSUPPORTED : 0));
+    o->Reserved = 0;
+    o->Mask = e->Mask;
+    o->Value = e->Value;
+    o->Written = r->Written;
+    o->Unchanged = r->Unchanged;
+    o->Locked = r->Locked;
+    o->Verified = r->Verified;
+    o->Failed = r->Failed;
+
+    if (r->Fault == MSR_FAULT_READ) {
+      Log(LOG_WARN, L"MSR ");
+      OutputHex(L"", e->Msr, L" not implemented on this CPU, skipped\r\n");
+    } else if (r->Fault == MSR_FAULT_WRITE) {
+      Log(LOG_WARN, L"MSR ");
+      OutputHex(L"", e->Msr, L" rejects writes, skipped\r\n");
+    } else if (r->Skipped) {
+      OutputHex(L"MSR ", e->Msr, L" skipped: CPU family/model mismatch\r\n");
+    } else if (r->Locked) {
+      OutputHex(L"MSR ", e->Msr, L" locked on ");
+      OutputNum(L"", r->Locked, L" CPUs, not changed there\r\n");
+    }
+  }
+  RT->SetVariable(L"DisablePROCHOTPolicy", &gDisablePROCHOTVendorGuid,
+                  EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS,
+                  sizeof(rec.Header) + gPolicyCount * sizeof(rec.Entry[0]), &rec);
 }
 
-static INTN CompareMem(const void *a, const void *b, UINTN n) {
-  const UINT8 *x = a, *y = b;
-  for (UINTN i = 0; i < n; i++)
-    if (x[i] != y[i]) return (INTN)x[i] - (INTN)y[i];
-  return 0;
+// ---------------------------------------------------------------------------
+// Candidate pre-check
+//
+// A stale Boot#### (a removed disk, a deleted loader) only fails inside
+// LoadImage, after it spun up the media, read the whole file and ran Secure
+// Boot verification. Before that, each candidate on a Simple File System
+// volume gets a cheap look: open the file and read just its DOS and PE
+// headers, which must describe an x64 PE32+ EFI application or driver (what
+// LoadImage would accept). A candidate that fails is skipped with the reason.
+// Anything else (short form the firmware expands, LoadFile devices such as
+// network boot, firmware volumes) goes to LoadImage unchecked.
+// ---------------------------------------------------------------------------
+#define PE_DOS_MAGIC 0x5A4D         // 'MZ'
+#define PE_DOS_BYTES 64             // e_lfanew at 0x3C
+#define PE_NT_SIGNATURE 0x00004550  // 'PE\0\0'
+#define PE_HEADER_BYTES 94          // signature, COFF header, optional header to Subsystem
+#define PE_MACHINE_X64 0x8664
+#define PE_OPTIONAL_MAGIC_PE32PLUS 0x20B
+#define PE_SUBSYSTEM_EFI_APPLICATION 10
+#define PE_SUBSYSTEM_EFI_RUNTIME_DRIVER 12
+
+enum {
+  PRECHECK_NO_VOLUME,  // full path, but no volume or LoadFile device is on it
+  PRECHECK_NO_FILE,    // the volume is there, the file isn't
+  PRECHECK_NOT_PE,     // no DOS/PE headers, or too short for them
+  PRECHECK_MACHINE,    // not an x64 image
+  PRECHECK_SUBSYSTEM,  // not an EFI application or driver
+  PRECHECK_REASONS,
+  PRECHECK_OK = PRECHECK_REASONS
+};
+
+// Counted per reason for the timing record; always zero in the driver build.
+static UINT16 gPrecheckSkipped[PRECHECK_REASONS];
+
+// The pre-check, boot option walk, prefetch and chainload below only exist in
+// the application build.
+#ifndef DRIVER_BUILD
+static CHAR16 *const kPrecheckReasons[PRECHECK_REASONS] = {
+    L"device not present", L"file not found", L"not a PE image", L"not an x64 image",
+    L"not an EFI application or driver"};
+
+static EFI_GUID gEfiLoadFileProtocolGuid = {
+    0x56ec3091, 0x954c, 0x11d2, {0x8e, 0x3f, 0x00, 0xa0, 0xc9, 0x69, 0x72, 0x3b}};
+static EFI_GUID gEfiLoadFile2ProtocolGuid = {
+    0x4006c0c1, 0xfcb3, 0x403e, {0x99, 0x6d, 0x4a, 0x6c, 0x87, 0x24, 0xe0, 0x6d}};
+
+static BOOLEAN FilePathString(EFI_DEVICE_PATH_PROTOCOL *dp, CHAR16 *out, UINTN max);
+
+// Offset of the PE signature from a DOS header, or 0 if it isn't one.
+static UINT32 PeOffset(const UINT8 *dos) {
+  UINT16 magic;
+  UINT32 offset;
+
+  CopyMem(&magic, dos, sizeof(magic));
+  CopyMem(&offset, dos + 0x3C, sizeof(offset));
+  return magic == PE_DOS_MAGIC ? offset : 0;
 }
 
-static void CopyMem(void *d, const void *s, UINTN n) {
-  UINT8 *dd = d;
-  const UINT8 *ss = s;
-  for (UINTN i = 0; i < n; i++) dd[i] = ss[i];
+static UINT8 PeCheck(const UINT8 *pe) {
+  UINT32 signature;
+  UINT16 machine, magic, subsystem;
+
+  CopyMem(&signature, pe, sizeof(signature));
+  CopyMem(&machine, pe + 4, sizeof(machine));
+  CopyMem(&magic, pe + 24, sizeof(magic));
+  CopyMem(&subsystem, pe + 24 + 68, sizeof(subsystem));
+  if (signature != PE_NT_SIGNATURE) return PRECHECK_NOT_PE;
+  if (machine != PE_MACHINE_X64) return PRECHECK_MACHINE;
+  if (magic != PE_OPTIONAL_MAGIC_PE32PLUS) return PRECHECK_NOT_PE;
+  if (subsystem < PE_SUBSYSTEM_EFI_APPLICATION || subsystem > PE_SUBSYSTEM_EFI_RUNTIME_DRIVER)
+    return PRECHECK_SUBSYSTEM;
+  return PRECHECK_OK;
 }
 
-static void FreePool(void *p) { BS->FreePool(p); }
+// An image already in memory (the prefetched target).
+static UINT8 PrecheckBuffer(const UINT8 *image, UINTN size) {
+  UINT32 offset;
 
-static UINTN DevicePathSize(EFI_DEVICE_PATH_PROTOCOL *dp) {
-  EFI_DEVICE_PATH_PROTOCOL *n = dp;
-  UINTN sz = 0;
-  while (n) {
-    UINTN l = (UINTN)DevicePathNodeLength(n);
-    if (l < sizeof(EFI_DEVICE_PATH_PROTOCOL)) return 0;
-    sz += l;
-    if (IsDevicePathEnd(n)) return sz;
-    n = NextDevicePathNode(n);
+  if (size < PE_DOS_BYTES || !(offset = PeOffset(image)) || size < PE_HEADER_BYTES ||
+      offset > size - PE_HEADER_BYTES)
+    return PRECHECK_NOT_PE;
+  return PeCheck(image + offset);
+}
+
+static BOOLEAN ReadAt(EFI_FILE_HANDLE file, UINT64 offset, UINT8 *buf, UINTN n) {
+  UINTN got = n;
+  return !EFI_ERROR(file->SetPosition(file, offset)) &&
+         !EFI_ERROR(file->Read(file, &got, buf)) && got == n;
+}
+
+static UINT8 PrecheckCandidate(EFI_DEVICE_PATH_PROTOCOL *path) {
+  EFI_DEVICE_PATH_PROTOCOL *rest = path;
+  EFI_FILE_IO_INTERFACE *fs = NULL;
+  EFI_FILE_HANDLE root = NULL, file = NULL;
+  EFI_HANDLE device;
+  EFI_STATUS status;
+  UINT8 dos[PE_DOS_BYTES], pe[PE_HEADER_BYTES], reason = PRECHECK_NOT_PE;
+  CHAR16 name[256];
+  UINT32 offset;
+
+  if (!BS->LocateDevicePath) return PRECHECK_OK;
+  if (EFI_ERROR(BS->LocateDevicePath(&gEfiSimpleFileSystemProtocolGuid, &rest, &device))) {
+    if (DevicePathType(path) == MEDIA_DEVICE_PATH) return PRECHECK_OK;  // short form
+    rest = path;
+    if (!EFI_ERROR(BS->LocateDevicePath(&gEfiLoadFile2ProtocolGuid, &rest, &device)))
+      return PRECHECK_OK;
+    rest = path;
+    if (!EFI_ERROR(BS->LocateDevicePath(&gEfiLoadFileProtocolGuid, &rest, &device)))
+      return PRECHECK_OK;
+    return PRECHECK_NO_VOLUME;
   }
-  return 0;
+  if (!FilePathString(rest, name, sizeof(name) / sizeof(name[0])) ||
+      EFI_ERROR(BS->HandleProtocol(device, &gEfiSimpleFileSystemProtocolGuid, (void **)&fs)) ||
+      !fs || EFI_ERROR(fs->OpenVolume(fs, &root)))
+    return PRECHECK_OK;  // not a plain file path; let LoadImage decide
+  status = root->Open(root, &file, name, EFI_FILE_MODE_READ, 0);
+  root->Close(root);
+  if (status == EFI_NOT_FOUND) return PRECHECK_NO_FILE;
+  if (EFI_ERROR(status)) return PRECHECK_OK;
+  if (ReadAt(file, 0, dos, sizeof(dos)) && (offset = PeOffset(dos)) &&
+      ReadAt(file, offset, pe, sizeof(pe)))
+    reason = PeCheck(pe);
+  file->Close(file);
+  return reason;
 }
+#endif  // !DRIVER_BUILD
 
-static EFI_DEVICE_PATH_PROTOCOL *FindFilePathNode(EFI_DEVICE_PATH_PROTOCOL *dp);
+// ---------------------------------------------------------------------------
+// Boot-phase timeline
+//
+// TSC timestamps around each stage, published as FPDT boot records through the
+// EDK2 performance protocol when the firmware has one, and always as a small
+// binary record in a volatile vendor variable that the OS can read from
+// /sys/firmware/efi/efivars/DisablePROCHOTTiming-<vendor guid>.
+// ---------------------------------------------------------------------------
+enum {
+  PHASE_POLICY,        // MSR policy on all CPUs
+  PHASE_BOOT_OPTIONS,  // BootOrder / Boot#### reads and selection
+  PHASE_BUILD_PATH,    // BuildFullPath
+  PHASE_LOAD_IMAGE,    // BS->LoadImage
+  PHASE_PRECHECK,      // candidate header checks before LoadImage
+  PHASE_COUNT
+};
 
-// This firmware's Boot#### entries are short-form (HD(sig)/File, no hardware
-// prefix) and its LoadImage won't expand them (EFI_NOT_FOUND). Rebuild a FULL
-// path: the device path of the partition we were loaded from + the target's
-// File node + End. Returns NULL on failure (caller falls back to short-form).
-static EFI_DEVICE_PATH_PROTOCOL *BuildFullPath(EFI_DEVICE_PATH_PROTOCOL *target) {
-  EFI_LOADED_IMAGE *li = NULL;
-  EFI_DEVICE_PATH_PROTOCOL *devDp = NULL, *targFile, *out;
-  UINTN devLen, tlen;
-  UINT8 *p;
+#define TIMING_SIGNATURE 0x4C545044  // 'DPTL'
+#define TIMING_VERSION 2
 
-  if (EFI_ERROR(BS->HandleProtocol(IM, &gEfiLoadedImageProtocolGuid, (void **)&li)) || !li)
-    return NULL;
-  if (EFI_ERROR(BS->HandleProtocol(li->DeviceHandle, &gEfiDevicePathProtocolGuid,
-                                   (void **)&devDp)) ||
-      !devDp)
-    return NULL;
-  targFile = FindFilePathNode(target);
-  if (!targFile) return NULL;
+typedef struct __attribute__((packed)) {
+  UINT64 Ticks;  // TSC ticks spent in the phase, summed over all calls
+  UINT32 Calls;
+  UINT32 Us;  // Ticks converted with TscKhz
+} TIMING_PHASE;
 
-  devLen = DevicePathSize(devDp);
-  if (devLen < 4) return NULL;
-  devLen -= 4;  // strip the partition path's End node
-  tlen = (UINTN)DevicePathNodeLength(targFile);
+typedef struct __attribute__((packed)) {
+  UINT32 Signature;
+  UINT16 Version;
+  UINT16 PhaseCount;
+  UINT32 TscKhz;
+  UINT32 TotalUs;     // efi_main entry -> StartImage (or failure return)
+  UINT64 StartTsc;    // efi_main entry
+  UINT64 HandoffTsc;  // just before StartImage of the next stage
+  TIMING_PHASE Phase[PHASE_COUNT];
+  UINT16 Skipped[PRECHECK_REASONS];  // candidates the pre-check ruled out, per reason
+} TIMING_RECORD;
 
-  if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, devLen + tlen + 4, (void **)&out)) || !out)
-    return NULL;
-  p = (UINT8 *)out;
-  CopyMem(p, devDp, devLen);             // hardware path to our partition
-  CopyMem(p + devLen, targFile, tlen);   // target's File node
-  p[devLen + tlen + 0] = 0x7f;           // End-of-device-path
-  p[devLen + tlen + 1] = 0xff;
-  p[devLen + tlen + 2] = 0x04;
-  p[devLen + tlen + 3] = 0x00;
-  return out;
+// EDKII_PERFORMANCE_MEASUREMENT_PROTOCOL: each call becomes an FPDT record.
+typedef enum { PerfStartEntry, PerfEndEntry, PerfEntry } PERF_MEASUREMENT_ATTRIBUTE;
+typedef struct {
+  EFI_STATUS(EFIAPI *CreatePerformanceMeasurement)(const VOID *caller, const VOID *guid,
+                                                   const CHAR8 *string, UINT64 timeStamp,
+                                                   UINT64 address, UINT32 identifier,
+                                                   PERF_MEASUREMENT_ATTRIBUTE attribute);
+} PERFORMANCE_MEASUREMENT_PROTOCOL;
+
+static EFI_GUID gEdkiiPerformanceMeasurementProtocolGuid = {
+    0xc85d06be, 0x5f75, 0x48ce, {0xa8, 0x0f, 0x12, 0x36, 0xba, 0x3b, 0x87, 0xb1}};
+
+#define PERF_INMODULE_START_ID 0x40
+#define PERF_INMODULE_END_ID 0x41
+
+static const char *const kPhaseTokens[PHASE_COUNT] = {
+    "DisablePROCHOT:Policy", "DisablePROCHOT:BootOptions",
+    "DisablePROCHOT:BuildFullPath", "DisablePROCHOT:LoadImage", "DisablePROCHOT:Precheck"};
+
+static TIMING_RECORD gTiming;
+static PERFORMANCE_MEASUREMENT_PROTOCOL *gPerf;
+
+static void TimingStart(void) {
+  gTiming.Signature = TIMING_SIGNATURE;
+  gTiming.Version = TIMING_VERSION;
+  gTiming.PhaseCount = PHASE_COUNT;
+  gTiming.StartTsc = AsmReadTsc();
+  if (EFI_ERROR(BS->LocateProtocol(&gEdkiiPerformanceMeasurementProtocolGuid, NULL,
+                                   (void **)&gPerf)))
+    gPerf = NULL;
 }
 
-static void *LibGetVariableAndSize(CHAR16 *name, EFI_GUID *g, UINTN *sz) {
-  UINTN s = 0;
-  *sz = 0;
-  EFI_STATUS st = RT->GetVariable(name, g, NULL, &s, NULL);
-  if (st != EFI_BUFFER_TOO_SMALL || s == 0) return NULL;
-  void *d = NULL;
-  if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, s, &d)) || !d) return NULL;
-  if (EFI_ERROR(RT->GetVariable(name, g, NULL, &s, d))) {
-    BS->FreePool(d);
-    return NULL;
+static UINT64 PhaseBegin(UINTN phase) {
+  if (gPerf)
+    gPerf->CreatePerformanceMeasurement(IM, NULL, (const CHAR8 *)kPhaseTokens[phase], 0, 0,
+                                        PERF_INMODULE_START_ID, PerfStartEntry);
+  return AsmReadTsc();
+}
+
+static void PhaseEnd(UINTN phase, UINT64 begin) {
+  gTiming.Phase[phase].Ticks += AsmReadTsc() - begin;
+  gTiming.Phase[phase].Calls++;
+  if (gPerf)
+    gPerf->CreatePerformanceMeasurement(IM, NULL, (const CHAR8 *)kPhaseTokens[phase], 0, 0,
+                                        PERF_INMODULE_END_ID, PerfEndEntry);
+}
+
+// TSC rate in kHz: CPUID 0x15 when it names the crystal, else 1 ms of BS->Stall.
+// Measured once.
+static UINT32 TscKhz(void) {
+  static UINT32 khz;
+  uint32_t r[4];
+  UINT64 t0;
+
+  if (khz) return khz;
+  AsmCpuid(0, 0, r);
+  if (r[0] >= 0x15) {
+    AsmCpuid(0x15, 0, r);
+    if (r[0] && r[1] && r[2]) khz = (UINT32)((UINT64)r[2] * r[1] / r[0] / 1000);
+  }
+  if (!khz) {
+    t0 = AsmReadTsc();
+    BS->Stall(1000);
+    khz = (UINT32)(AsmReadTsc() - t0);
   }
-  *sz = s;
-  return d;
+  return khz;
 }
 
-// ---------------------------------------------------------------------------
-// MSR read/write helpers
-// ---------------------------------------------------------------------------
-static uint64_t AsmWriteMsr64(uint32_t index, uint64_t val) {
-  uint32_t low = (uint32_t)(val);
-  uint32_t high = (uint32_t)(val >> 32);
-  __asm__ __volatile__("wrmsr" : : "c"(index), "a"(low), "d"(high) : "memory");
-  return val;
+static UINT32 TicksToUs(UINT64 ticks) {
+  return gTiming.TscKhz ? (UINT32)(ticks * 1000 / gTiming.TscKhz) : 0;
 }
 
-static uint64_t AsmReadMsr64(uint32_t index) {
-  uint32_t low, high;
-  __asm__ __volatile__("rdmsr" : "=a"(low), "=d"(high) : "c"(index) : "memory");
-  return ((uint64_t)high << 32) | low;
+// Called right before handing off (or giving up); later calls overwrite.
+static void PublishTiming(void) {
+  UINTN i;
+
+  gTiming.HandoffTsc = AsmReadTsc();
+  if (!gTiming.TscKhz) gTiming.TscKhz = TscKhz();
+  gTiming.TotalUs = TicksToUs(gTiming.HandoffTsc - gTiming.StartTsc);
+  for (i = 0; i < PHASE_COUNT; ++i) gTiming.Phase[i].Us = TicksToUs(gTiming.Phase[i].Ticks);
+  CopyMem(gTiming.Skipped, gPrecheckSkipped, sizeof(gTiming.Skipped));
+  RT->SetVariable(L"DisablePROCHOTTiming", &gDisablePROCHOTVendorGuid,
+                  EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS,
+                  sizeof(gTiming), &gTiming);
+}
+
+#ifdef SILENT
+static void PublishLog(void) {}
+#else
+// "[<us since entry> us] <I|W|E> <text>\r\n"
+#define LOG_RENDER_CHARS (LOG_LINE_CHARS + 24)
+
+static UINTN LogAppend(CHAR16 *out, UINTN n, CHAR16 *s) {
+  while (*s) out[n++] = *s++;
+  return n;
+}
+
+static void LogRender(LOG_LINE *line, CHAR16 out[LOG_RENDER_CHARS]) {
+  CHAR16 buf[21];
+  UINTN n = 0, i;
+
+  n = LogAppend(out, n, L"[");
+  n = LogAppend(out, n, FormatDec(TicksToUs(line->Tsc - gTiming.StartTsc), buf));
+  n = LogAppend(out, n, L" us] ");
+  out[n++] = L"IWE"[line->Level];
+  out[n++] = L' ';
+  for (i = 0; i < line->Length; ++i) out[n++] = (CHAR16)line->Text[i];
+  n = LogAppend(out, n, L"\r\n");
+  out[n] = L'\0';
+}
+
+// Called next to PublishTiming. The variable always holds the whole ring; the
+// console gets each line at most once, so a retry after a failed StartImage
+// doesn't print it again.
+static void PublishLog(void) {
+  static CHAR8 text[LOG_LINES * LOG_RENDER_CHARS];
+  static UINTN printed;
+  CHAR16 line[LOG_RENDER_CHARS], buf[21], *p;
+  UINTN first = gLogLines > LOG_LINES ? gLogLines - LOG_LINES : 0, size = 0, i;
+  BOOLEAN console = gSettings.LogConsole == LOG_CONSOLE_ALWAYS ||
+                    (gSettings.LogConsole == LOG_CONSOLE_AUTO && gLogWorst >= LOG_ERROR);
+
+  if (!gTiming.TscKhz) gTiming.TscKhz = TscKhz();
+  if (first) {
+    for (p = FormatDec(first, buf); *p; ++p) text[size++] = (CHAR8)*p;
+    for (p = L" earlier lines dropped\n"; *p; ++p) text[size++] = (CHAR8)*p;
+  }
+  for (i = first; i < gLogLines; ++i) {
+    LogRender(&gLog[i % LOG_LINES], line);
+    for (p = line; *p; ++p)
+      if (*p != L'\r') text[size++] = (CHAR8)*p;
+    if (console && i >= printed) ST->ConOut->OutputString(ST->ConOut, line);
+  }
+  if (console) printed = gLogLines;
+  RT->SetVariable(L"DisablePROCHOTLog", &gDisablePROCHOTVendorGuid,
+                  EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS, size, text);
 }
+#endif
 
+#ifndef DRIVER_BUILD
 // ---------------------------------------------------------------------------
 typedef struct __attribute__((packed)) {
   UINT32 Attributes;
@@ -153,95 +3868,312 @@ static EFI_DEVICE_PATH_PROTOCOL *GetLoadedImagePath(void);
 static BOOLEAN DevicePathsMatch(EFI_DEVICE_PATH_PROTOCOL *first,
                                 EFI_DEVICE_PATH_PROTOCOL *second);
 
-static EFI_STATUS GetNextBootOption(UINTN startOffset, UINT16 *nextBootId,
-                                    UINTN *nextOffset) {
+// ---------------------------------------------------------------------------
+// Boot option snapshot
+//
+// BootOrder and each Boot#### it names are read at most once, straight into a
+// page arena (one GetVariable per variable, no pool allocations), and parsed
+// into a table. Self-identification and next-entry selection run over that.
+// ---------------------------------------------------------------------------
+typedef struct {
+  UINT16 Id;
+  BOOLEAN Read;  // Boot#### fetched (or found missing)
+  UINT32 Attributes;
+  UINT8 *Data;  // raw EFI_LOAD_OPTION in the arena; NULL if missing
+  UINTN Size;
+  EFI_DEVICE_PATH_PROTOCOL *DevicePath;  // active and has a File node, else NULL
+  EFI_DEVICE_PATH_PROTOCOL *FileNode;
+  UINT32 FileHash;  // FNV-1a of FileNode, to skip most DevicePathsMatch calls
+} BOOT_OPTION;
+
+typedef struct {
+  UINT8 *Arena;
+  UINTN Pages;
+  UINTN Used;
+  UINT16 *Order;
+  BOOT_OPTION *Options;  // one per BootOrder slot, filled lazily
+  UINTN Count;
+  UINTN Current;  // our own index in BootOrder
+  UINT8 *Cache;   // DisablePROCHOTTarget as read, or NULL
+  UINTN CacheSize;
+} BOOT_SNAPSHOT;
+
+#define ARENA_REBASE(p, from, to) \
+  ((p) ? (void *)((UINT8 *)(to) + ((UINT8 *)(p) - (UINT8 *)(from))) : NULL)
+
+// Make room for `need` more bytes. The arena only grows (by doubling) when a
+// variable doesn't fit; every pointer into it is rebased after the copy.
+static BOOLEAN ArenaReserve(BOOT_SNAPSHOT *s, UINTN need) {
+  EFI_PHYSICAL_ADDRESS addr;
+  UINT8 *old = s->Arena, *arena;
+  UINTN pages = s->Pages, i;
+
+  while (pages * EFI_PAGE_SIZE - s->Used < need) pages *= 2;
+  if (pages == s->Pages) return TRUE;
+  if (EFI_ERROR(BS->AllocatePages(AllocateAnyPages, EfiLoaderData, pages, &addr)))
+    return FALSE;
+  arena = (UINT8 *)(UINTN)addr;
+  CopyMem(arena, old, s->Used);
+
+  s->Order = ARENA_REBASE(s->Order, old, arena);
+  s->Options = ARENA_REBASE(s->Options, old, arena);
+  s->Cache = ARENA_REBASE(s->Cache, old, arena);
+  for (i = 0; s->Options && i < s->Count; ++i) {
+    BOOT_OPTION *o = &s->Options[i];
+    o->Data = ARENA_REBASE(o->Data, old, arena);
+    o->DevicePath = ARENA_REBASE(o->DevicePath, old, arena);
+    o->FileNode = ARENA_REBASE(o->FileNode, old, arena);
+  }
+  BS->FreePages((EFI_PHYSICAL_ADDRESS)(UINTN)old, s->Pages);
+  s->Arena = arena;
+  s->Pages = pages;
+  return TRUE;
+}
+
+static void *ArenaAlloc(BOOT_SNAPSHOT *s, UINTN size) {
+  UINT8 *p;
+  s->Used = (s->Used + 7) & ~(UINTN)7;
+  if (!ArenaReserve(s, size)) return NULL;
+  p = s->Arena + s->Used;
+  s->Used += size;
+  return p;
+}
+
+// A variable read straight into the arena: one GetVariable call, or two if the
+// arena had to grow first.
+static UINT8 *ArenaGetVariable(BOOT_SNAPSHOT *s, CHAR16 *name, EFI_GUID *guid,
+                               UINTN *size) {
   EFI_STATUS status;
-  UINT8 *bootOrderData = NULL;
-  UINTN bootOrderSize = 0;
-  UINT16 *bootOrder;
-  UINTN bootCount;
-  UINT16 bootCurrent = 0xFFFF;
-  UINTN i;
-  BOOLEAN found = FALSE;
-  UINTN currentIndex = 0;
-  EFI_DEVICE_PATH_PROTOCOL *loadedPath;
+  UINT8 *p;
+
+  s->Used = (s->Used + 7) & ~(UINTN)7;
+  for (;;) {
+    *size = s->Pages * EFI_PAGE_SIZE - s->Used;
+    status = RT->GetVariable(name, guid, NULL, size, s->Arena + s->Used);
+    if (status != EFI_BUFFER_TOO_SMALL) break;
+    if (!ArenaReserve(s, *size)) return NULL;
+  }
+  if (EFI_ERROR(status) || *size == 0) return NULL;
+  p = s->Arena + s->Used;
+  s->Used += *size;
+  return p;
+}
+
+static BOOT_OPTION *SnapshotOption(BOOT_SNAPSHOT *s, UINTN index) {
+  BOOT_OPTION *o = &s->Options[index];
+  CHAR16 bootVarName[9];
+  UINT8 *data;
+  UINTN size;
 
-  bootOrderData =
-      LibGetVariableAndSize(L"BootOrder", &gEfiGlobalVariableGuid, &bootOrderSize);
-  if (!bootOrderData) return EFI_NOT_FOUND;
+  if (o->Read) return o;
+  MakeBootVarName(o->Id, bootVarName);
+  data = ArenaGetVariable(s, bootVarName, &gEfiGlobalVariableGuid, &size);
+  o = &s->Options[index];  // the arena may have moved
+  o->Read = TRUE;
+  if (!data) return o;
 
-  if (bootOrderSize < sizeof(UINT16) || (bootOrderSize % sizeof(UINT16)) != 0) {
-    FreePool(bootOrderData);
-    return EFI_COMPROMISED_DATA;
+  o->Data = data;
+  o->Size = size;
+  if (size >= sizeof(EFI_LOAD_OPTION_HEADER))
+    o->Attributes = ((EFI_LOAD_OPTION_HEADER *)data)->Attributes;
+  o->DevicePath = ParseBootOption(data, size);
+  if (o->DevicePath) {
+    o->FileNode = FindFilePathNode(o->DevicePath);
+    o->FileHash = Fnv1a(o->FileNode, (UINTN)DevicePathNodeLength(o->FileNode));
   }
+  return o;
+}
 
-  bootOrder = (UINT16 *)bootOrderData;
-  bootCount = bootOrderSize / sizeof(UINT16);
+// Find our own BootOrder slot: by loaded-image path, else by BootCurrent.
+static BOOLEAN SnapshotFindSelf(BOOT_SNAPSHOT *s) {
+  EFI_DEVICE_PATH_PROTOCOL *loadedPath = GetLoadedImagePath(), *loadedFile;
+  UINT32 loadedHash = 0;
+  UINT16 bootCurrent = 0xFFFF;
+  UINTN i, size;
 
-  loadedPath = GetLoadedImagePath();
   if (loadedPath) {
-    for (i = 0; i < bootCount; ++i) {
-      UINT16 bootId = bootOrder[i];
-      CHAR16 bootVarName[9];
-      UINT8 *bootData = NULL;
-      UINTN bootSize = 0;
-      EFI_DEVICE_PATH_PROTOCOL *devicePath;
-
-      MakeBootVarName(bootId, bootVarName);
-      bootData = LibGetVariableAndSize(bootVarName, &gEfiGlobalVariableGuid, &bootSize);
-      if (!bootData) continue;
-
-      devicePath = ParseBootOption(bootData, bootSize);
-      if (devicePath && DevicePathsMatch(devicePath, loadedPath)) {
-        found = TRUE;
-        currentIndex = i;
-        FreePool(bootData);
-        break;
+    loadedFile = FindFilePathNode(loadedPath);
+    if (loadedFile)
+      loadedHash = Fnv1a(loadedFile, (UINTN)DevicePathNodeLength(loadedFile));
+    for (i = 0; i < s->Count; ++i) {
+      BOOT_OPTION *o = SnapshotOption(s, i);
+      if (!o->DevicePath) continue;
+      // A match means equal File nodes whenever we have one, so the hash
+      // rules out nearly every entry without touching the paths.
+      if (loadedFile && o->FileHash != loadedHash) continue;
+      if (DevicePathsMatch(o->DevicePath, loadedPath)) {
+        s->Current = i;
+        return TRUE;
       }
-      FreePool(bootData);
     }
   }
 
-  if (!found) {
-    UINTN size = sizeof(bootCurrent);
-    status = RT->GetVariable(L"BootCurrent", &gEfiGlobalVariableGuid, NULL, &size,
-                             &bootCurrent);
-    if (EFI_ERROR(status)) bootCurrent = 0xFFFF;
-    for (i = 0; i < bootCount; ++i) {
-      if (bootOrder[i] == bootCurrent) {
-        found = TRUE;
-        currentIndex = i;
-        break;
-      }
+  size = sizeof(bootCurrent);
+  if (EFI_ERROR(RT->GetVariable(L"BootCurrent", &gEfiGlobalVariableGuid, NULL, &size,
+                                &bootCurrent)))
+    bootCurrent = 0xFFFF;
+  for (i = 0; i < s->Count; ++i) {
+    if (s->Order[i] == bootCurrent) {
+      s->Current = i;
+      return TRUE;
     }
   }
+  return FALSE;
+}
+
+static void SnapshotFree(BOOT_SNAPSHOT *s) {
+  PartitionIndexReset();  // built for this snapshot's entries
+  if (s->Arena) BS->FreePages((EFI_PHYSICAL_ADDRESS)(UINTN)s->Arena, s->Pages);
+  s->Arena = NULL;
+}
+
+static EFI_STATUS SnapshotBootOrder(BOOT_SNAPSHOT *s) {
+  EFI_PHYSICAL_ADDRESS addr;
+  UINTN size, i;
+
+  s->Arena = NULL;
+  s->Pages = 1;
+  s->Used = 0;
+  s->Options = NULL;
+  s->Count = 0;
+  s->Cache = NULL;
+  s->CacheSize = 0;
+  if (EFI_ERROR(BS->AllocatePages(AllocateAnyPages, EfiLoaderData, 1, &addr)))
+    return EFI_OUT_OF_RESOURCES;
+  s->Arena = (UINT8 *)(UINTN)addr;
+
+  s->Order = (UINT16 *)ArenaGetVariable(s, L"BootOrder", &gEfiGlobalVariableGuid, &size);
+  if (!s->Order) return EFI_NOT_FOUND;
+  if (size < sizeof(UINT16) || (size % sizeof(UINT16)) != 0) return EFI_COMPROMISED_DATA;
+  s->Count = size / sizeof(UINT16);
+
+  s->Options = ArenaAlloc(s, s->Count * sizeof(BOOT_OPTION));
+  if (!s->Options) return EFI_OUT_OF_RESOURCES;
+  for (i = 0; i < s->Count; ++i) {
+    BOOT_OPTION *o = &s->Options[i];
+    o->Id = s->Order[i];
+    o->Read = FALSE;
+    o->Attributes = 0;
+    o->Data = NULL;
+    o->Size = 0;
+    o->DevicePath = NULL;
+    o->FileNode = NULL;
+    o->FileHash = 0;
+  }
+  return EFI_SUCCESS;
+}
+
+// ---------------------------------------------------------------------------
+// Resolved-target cache
+//
+// The full device path that last chainloaded, keyed by hashes of BootOrder and
+// of the chosen Boot#### payload, kept in a non-volatile vendor variable. A
+// warm boot reads BootOrder, that one Boot#### and the cache, and loads
+// straight from the cached path; any mismatch or load failure falls back to
+// the BootOrder walk. The variable is only rewritten when its bytes change, to
+// spare the flash.
+// ---------------------------------------------------------------------------
+#define TARGET_CACHE_SIGNATURE 0x43545044  // 'DPTC'
+#define TARGET_CACHE_VERSION 1
+
+typedef struct __attribute__((packed)) {
+  UINT32 Signature;
+  UINT16 Version;
+  UINT16 BootId;      // Boot#### that was chainloaded
+  UINT32 OrderHash;   // FNV-1a of BootOrder
+  UINT32 OptionHash;  // FNV-1a of the Boot#### payload
+  UINT32 PathSize;    // bytes of device path following this header
+  UINT32 Checksum;    // FNV-1a of everything before it, then the path
+} TARGET_CACHE;
+
+static UINT32 TargetCacheChecksum(TARGET_CACHE *c) {
+  return Fnv1aMore(Fnv1a(c, sizeof(*c) - sizeof(c->Checksum)), c + 1, c->PathSize);
+}
+
+static BOOLEAN TargetCacheValid(TARGET_CACHE *c, UINTN size) {
+  return size >= sizeof(*c) && c->Signature == TARGET_CACHE_SIGNATURE &&
+         c->Version == TARGET_CACHE_VERSION && size == sizeof(*c) + c->PathSize &&
+         c->Checksum == TargetCacheChecksum(c) &&
+         DevicePathSize((EFI_DEVICE_PATH_PROTOCOL *)(c + 1)) == c->PathSize;
+}
+
+// The cached full path if it still matches BootOrder and its Boot####, else
+// NULL. *index is the BootOrder slot it was resolved from.
+static EFI_DEVICE_PATH_PROTOCOL *TargetCacheLookup(BOOT_SNAPSHOT *s, UINTN *index) {
+  TARGET_CACHE *c;
+  BOOT_OPTION *o;
+  UINTN i;
+
+  s->Cache = ArenaGetVariable(s, L"DisablePROCHOTTarget", &gDisablePROCHOTVendorGuid,
+                              &s->CacheSize);
+  c = (TARGET_CACHE *)s->Cache;
+  if (!c) {
+    Output(L"Target cache miss\r\n");
+    return NULL;
+  }
+  if (!TargetCacheValid(c, s->CacheSize)) {
+    Log(LOG_WARN, L"Target cache corrupt\r\n");
+    return NULL;
+  }
 
-  if (!found || bootCount == 1 || startOffset >= bootCount) {
-    FreePool(bootOrderData);
-    return EFI_NOT_FOUND;
+  i = 0;
+  while (i < s->Count && s->Order[i] != c->BootId) ++i;
+  if (i < s->Count) {
+    o = SnapshotOption(s, i);
+    c = (TARGET_CACHE *)s->Cache;  // the arena may have moved
+    if (o->DevicePath && c->OrderHash == Fnv1a(s->Order, s->Count * sizeof(UINT16)) &&
+        c->OptionHash == Fnv1a(o->Data, o->Size)) {
+      Output(L"Target cache hit\r\n");
+      *index = i;
+      return (EFI_DEVICE_PATH_PROTOCOL *)(c + 1);
+    }
   }
+  Output(L"Target cache stale\r\n");
+  return NULL;
+}
+
+// Record that slot `index` loaded from `full` (or from its own path if NULL).
+static void TargetCacheStore(BOOT_SNAPSHOT *s, UINTN index, EFI_DEVICE_PATH_PROTOCOL *full) {
+  UINTN pathSize = DevicePathSize(full ? full : s->Options[index].DevicePath);
+  UINTN size = sizeof(TARGET_CACHE) + pathSize;
+  TARGET_CACHE *c;
+  BOOT_OPTION *o;
 
-  for (i = startOffset; i < bootCount; ++i) {
-    UINT16 bootId = bootOrder[(currentIndex + i) % bootCount];
-    CHAR16 bootVarName[9];
-    UINT8 *bootData = NULL;
-    UINTN bootSize = 0;
+  if (!pathSize || !(c = ArenaAlloc(s, size))) return;
+  o = &s->Options[index];  // after ArenaAlloc: the arena may have moved
+  c->Signature = TARGET_CACHE_SIGNATURE;
+  c->Version = TARGET_CACHE_VERSION;
+  c->BootId = o->Id;
+  c->OrderHash = Fnv1a(s->Order, s->Count * sizeof(UINT16));
+  c->OptionHash = Fnv1a(o->Data, o->Size);
+  c->PathSize = (UINT32)pathSize;
+  CopyMem(c + 1, full ? full : o->DevicePath, pathSize);
+  c->Checksum = TargetCacheChecksum(c);
+
+  if (s->Cache && s->CacheSize == size && CompareMem(s->Cache, c, size) == 0) return;
+  if (!EFI_ERROR(RT->SetVariable(L"DisablePROCHOTTarget", &gDisablePROCHOTVendorGuid,
+                                 EFI_VARIABLE_NON_VOLATILE |
+                                     EFI_VARIABLE_BOOTSERVICE_ACCESS |
+                                     EFI_VARIABLE_RUNTIME_ACCESS,
+                                 size, c)))
+    Output(L"Target cache updated\r\n");
+}
 
-    MakeBootVarName(bootId, bootVarName);
-    bootData = LibGetVariableAndSize(bootVarName, &gEfiGlobalVariableGuid, &bootSize);
-    if (!bootData) continue;
+// The first loadable entry at or after `startOffset` slots past our own,
+// wrapping around BootOrder.
+static EFI_STATUS GetNextBootOption(BOOT_SNAPSHOT *s, UINTN startOffset, UINTN *nextIndex,
+                                    UINTN *nextOffset) {
+  UINTN i;
 
-    if (ParseBootOption(bootData, bootSize)) {
-      *nextBootId = bootId;
+  if (s->Count == 1 || startOffset >= s->Count) return EFI_NOT_FOUND;
+  for (i = startOffset; i < s->Count; ++i) {
+    UINTN index = (s->Current + i) % s->Count;
+    if (SnapshotOption(s, index)->DevicePath) {
+      *nextIndex = index;
       *nextOffset = i;
-      FreePool(bootData);
-      FreePool(bootOrderData);
       return EFI_SUCCESS;
     }
-    FreePool(bootData);
   }
-
-  FreePool(bootOrderData);
   return EFI_NOT_FOUND;
 }
 
@@ -262,17 +4194,6 @@ static EFI_DEVICE_PATH_PROTOCOL *GetLoadedImagePath(void) {
   return NULL;
 }
 
-static EFI_DEVICE_PATH_PROTOCOL *FindFilePathNode(EFI_DEVICE_PATH_PROTOCOL *dp) {
-  EFI_DEVICE_PATH_PROTOCOL *node = dp;
-  while (node && !IsDevicePathEnd(node)) {
-    if (DevicePathType(node) == MEDIA_DEVICE_PATH &&
-        DevicePathSubType(node) == MEDIA_FILEPATH_DP)
-      return node;
-    node = NextDevicePathNode(node);
-  }
-  return NULL;
-}
-
 static BOOLEAN DevicePathHasFilePath(EFI_DEVICE_PATH_PROTOCOL *dp) {
   return FindFilePathNode(dp) != NULL;
 }
@@ -332,68 +4253,360 @@ static EFI_DEVICE_PATH_PROTOCOL *ParseBootOption(UINT8 *bootData, UINTN bootSize
   return devicePath;
 }
 
-static EFI_STATUS TryBootOrderChainload(void) {
+// ---------------------------------------------------------------------------
+// Target prefetch
+// ---------------------------------------------------------------------------
+// On a warm boot the target cache names the next loader's full path before
+// the MSR policy runs. Open that file through its partition's Simple File
+// System and, where the file protocol is revision 2, queue ReadEx in
+// PREFETCH_CHUNK pieces, each issued from the previous one's completion
+// event, so the media reads while the policy is applied on every CPU.
+// LoadImage then gets the buffer as SourceBuffer together with the same device
+// path, which Secure Boot verification and the image's FilePath still use.
+// Without ReadEx the file is read synchronously, in the same large chunks,
+// when the chainload asks for it. A stale cache just discards the buffer.
+#define PREFETCH_CHUNK (4u << 20)
+#define PREFETCH_MAX_BYTES (256u << 20)
+#define PREFETCH_CACHE_BYTES 1024  // DisablePROCHOTTarget, header + path
+
+typedef struct {
+  TARGET_CACHE *Cache;  // as read at entry; its path is what was opened
+  EFI_FILE_HANDLE File;
+  EFI_FILE_IO_TOKEN Token;  // Token.Event NULL: synchronous reads
+  UINT8 *Buffer;
+  UINTN Pages;
+  UINTN Size;  // file size
+  UINTN Done;  // bytes read so far
+  volatile BOOLEAN Pending;  // a ReadEx is in flight
+  EFI_STATUS Status;
+} PREFETCH;
+
+static PREFETCH gPrefetch;
+
+static void PrefetchIssue(void) {
   EFI_STATUS status;
-  UINT16 nextBootId;
+  UINTN n = gPrefetch.Size - gPrefetch.Done;
+
+  if (n > PREFETCH_CHUNK) n = PREFETCH_CHUNK;
+  gPrefetch.Token.Status = EFI_SUCCESS;
+  gPrefetch.Token.BufferSize = n;
+  gPrefetch.Token.Buffer = gPrefetch.Buffer + gPrefetch.Done;
+  gPrefetch.Pending = TRUE;
+  status = gPrefetch.File->ReadEx(gPrefetch.File, &gPrefetch.Token);
+  if (EFI_ERROR(status)) {  // no completion will be signalled
+    gPrefetch.Pending = FALSE;
+    gPrefetch.Status = status;
+  }
+}
+
+// TPL_CALLBACK: a chunk landed, queue the next one.
+static void EFIAPI PrefetchChunkDone(EFI_EVENT event, VOID *context) {
+  (void)event;
+  (void)context;
+
+  gPrefetch.Pending = FALSE;
+  gPrefetch.Status = gPrefetch.Token.Status;
+  if (EFI_ERROR(gPrefetch.Status)) return;
+  if (!gPrefetch.Token.BufferSize) {  // shorter than GetInfo said
+    gPrefetch.Size = gPrefetch.Done;
+    return;
+  }
+  gPrefetch.Done += gPrefetch.Token.BufferSize;
+  if (gPrefetch.Done < gPrefetch.Size) PrefetchIssue();
+}
+
+// The File node(s) after the partition as one path string.
+static BOOLEAN FilePathString(EFI_DEVICE_PATH_PROTOCOL *dp, CHAR16 *out, UINTN max) {
+  UINTN used = 0, n;
+
+  for (; !IsDevicePathEnd(dp); dp = NextDevicePathNode(dp)) {
+    if (DevicePathType(dp) != MEDIA_DEVICE_PATH || DevicePathSubType(dp) != MEDIA_FILEPATH_DP ||
+        DevicePathNodeLength(dp) < sizeof(EFI_DEVICE_PATH_PROTOCOL))
+      return FALSE;
+    n = (DevicePathNodeLength(dp) - sizeof(EFI_DEVICE_PATH_PROTOCOL)) / sizeof(CHAR16);
+    if (used + n >= max) return FALSE;
+    CopyMem(out + used, (UINT8 *)dp + sizeof(EFI_DEVICE_PATH_PROTOCOL), n * sizeof(CHAR16));
+    while (n && out[used + n - 1] == L'\0') n--;  // drop the node's terminator
+    used += n;
+  }
+  out[used] = L'\0';
+  return used != 0;
+}
+
+static void PrefetchRelease(void) {
+  while (gPrefetch.Pending) BS->Stall(10);  // never free under a read
+  if (gPrefetch.Token.Event) BS->CloseEvent(gPrefetch.Token.Event);
+  if (gPrefetch.File) gPrefetch.File->Close(gPrefetch.File);
+  if (gPrefetch.Buffer)
+    BS->FreePages((EFI_PHYSICAL_ADDRESS)(UINTN)gPrefetch.Buffer, gPrefetch.Pages);
+  if (gPrefetch.Cache) FreePool(gPrefetch.Cache);
+  gPrefetch.Cache = NULL;
+  gPrefetch.File = NULL;
+  gPrefetch.Token.Event = NULL;
+  gPrefetch.Buffer = NULL;
+  gPrefetch.Pages = gPrefetch.Size = gPrefetch.Done = 0;
+  gPrefetch.Status = EFI_SUCCESS;
+}
+
+// Called before the policy; every failure just leaves nothing prefetched.
+static void PrefetchStart(void) {
+  UINT64 info[(SIZE_OF_EFI_FILE_INFO + 512) / sizeof(UINT64)];
+  EFI_DEVICE_PATH_PROTOCOL *rest;
+  EFI_FILE_IO_INTERFACE *fs = NULL;
+  EFI_FILE_HANDLE root = NULL;
+  EFI_HANDLE device;
+  EFI_PHYSICAL_ADDRESS addr;
+  CHAR16 path[256];
+  UINTN size = PREFETCH_CACHE_BYTES;
+
+  if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, size, (void **)&gPrefetch.Cache))) {
+    gPrefetch.Cache = NULL;
+    return;
+  }
+  if (EFI_ERROR(RT->GetVariable(L"DisablePROCHOTTarget", &gDisablePROCHOTVendorGuid, NULL,
+                                &size, gPrefetch.Cache)) ||
+      !TargetCacheValid(gPrefetch.Cache, size))
+    goto fail;
+
+  rest = (EFI_DEVICE_PATH_PROTOCOL *)(gPrefetch.Cache + 1);
+  if (EFI_ERROR(BS->LocateDevicePath(&gEfiSimpleFileSystemProtocolGuid, &rest, &device)) ||
+      !FilePathString(rest, path, sizeof(path) / sizeof(path[0])) ||
+      EFI_ERROR(BS->HandleProtocol(device, &gEfiSimpleFileSystemProtocolGuid, (void **)&fs)) ||
+      !fs || EFI_ERROR(fs->OpenVolume(fs, &root)))
+    goto fail;
+  if (EFI_ERROR(root->Open(root, &gPrefetch.File, path, EFI_FILE_MODE_READ, 0)))
+    gPrefetch.File = NULL;
+  root->Close(root);
+  size = sizeof(info);
+  if (!gPrefetch.File ||
+      EFI_ERROR(gPrefetch.File->GetInfo(gPrefetch.File, &gEfiFileInfoGuid, &size, info)))
+    goto fail;
+  gPrefetch.Size = (UINTN)((EFI_FILE_INFO *)info)->FileSize;
+  if (!gPrefetch.Size || gPrefetch.Size > PREFETCH_MAX_BYTES) goto fail;
+  gPrefetch.Pages = (gPrefetch.Size + EFI_PAGE_SIZE - 1) / EFI_PAGE_SIZE;
+  if (EFI_ERROR(BS->AllocatePages(AllocateAnyPages, EfiLoaderData, gPrefetch.Pages, &addr)))
+    goto fail;
+  gPrefetch.Buffer = (UINT8 *)(UINTN)addr;
+
+  if (gPrefetch.File->Revision < EFI_FILE_PROTOCOL_REVISION2 || !gPrefetch.File->ReadEx ||
+      EFI_ERROR(BS->CreateEvent(EVT_NOTIFY_SIGNAL, TPL_CALLBACK, PrefetchChunkDone, NULL,
+                                &gPrefetch.Token.Event))) {
+    gPrefetch.Token.Event = NULL;
+    return;  // PrefetchTake reads it synchronously
+  }
+  PrefetchIssue();
+  if (gPrefetch.Status == EFI_UNSUPPORTED && !gPrefetch.Done) {  // no async I/O after all
+    BS->CloseEvent(gPrefetch.Token.Event);
+    gPrefetch.Token.Event = NULL;
+    gPrefetch.Status = EFI_SUCCESS;
+  }
+  return;
+
+fail:
+  PrefetchRelease();
+}
+
+// The prefetched image if it is the file `path` names, else NULL.
+static VOID *PrefetchTake(EFI_DEVICE_PATH_PROTOCOL *path, UINTN *size) {
+  UINTN n;
+
+  if (!gPrefetch.Buffer || gPrefetch.Cache->PathSize != DevicePathSize(path) ||
+      CompareMem(gPrefetch.Cache + 1, path, gPrefetch.Cache->PathSize) != 0)
+    return NULL;
+  while (gPrefetch.Pending) BS->Stall(10);
+  while (!gPrefetch.Token.Event && !EFI_ERROR(gPrefetch.Status) &&
+         gPrefetch.Done < gPrefetch.Size) {
+    n = gPrefetch.Size - gPrefetch.Done;
+    if (n > PREFETCH_CHUNK) n = PREFETCH_CHUNK;
+    gPrefetch.Status = gPrefetch.File->Read(gPrefetch.File, &n, gPrefetch.Buffer + gPrefetch.Done);
+    if (!n) gPrefetch.Size = gPrefetch.Done;
+    gPrefetch.Done += n;
+  }
+  if (EFI_ERROR(gPrefetch.Status) || gPrefetch.Done != gPrefetch.Size) return NULL;
+  OutputNum(L"Target prefetched, ", (gPrefetch.Size + 1023) / 1024, L" KiB\r\n");
+  *size = gPrefetch.Size;
+  return gPrefetch.Buffer;
+}
+
+// Counts a candidate the pre-check ruled out and says why; id is its Boot####,
+// or LOAD_OPTION_CACHED for the cached target.
+#define LOAD_OPTION_CACHED 0xFFFFFFFFu
+
+static void PrecheckSkip(UINT32 id, UINT8 reason) {
+  CHAR16 name[9];
+
+  gPrecheckSkipped[reason]++;
+  if (id == LOAD_OPTION_CACHED) {
+    Log(LOG_WARN, L"Cached target");
+  } else {
+    MakeBootVarName((UINT16)id, name);
+    Log(LOG_WARN, name);
+  }
+  Output(L" skipped: ");
+  Output(kPrecheckReasons[reason]);
+  Output(L"\r\n");
+}
+
+static EFI_STATUS TryBootOrderChainload(void) {
+  EFI_STATUS status, imageStatus;
+  BOOT_SNAPSHOT snap;
   UINTN offset = 1;
-  UINTN nextOffset = 0;
-  CHAR16 bootVarName[9];
-  UINT8 *bootData = NULL;
-  UINTN bootSize = 0;
+  UINTN nextIndex = 0, nextOffset = 0, cachedIndex = (UINTN)-1;
   EFI_DEVICE_PATH_PROTOCOL *devicePath;
   EFI_HANDLE nextImage;
+  UINT64 t;
+  UINT8 reason = PRECHECK_OK;
 
-  for (;;) {
-    status = GetNextBootOption(offset, &nextBootId, &nextOffset);
-    if (status == EFI_NOT_FOUND) {
-      Output(L"No next boot entry\r\n");
-      return status;
+  t = PhaseBegin(PHASE_BOOT_OPTIONS);
+  status = SnapshotBootOrder(&snap);
+  devicePath = EFI_ERROR(status) ? NULL : TargetCacheLookup(&snap, &cachedIndex);
+  PhaseEnd(PHASE_BOOT_OPTIONS, t);
+
+  if (devicePath) {
+    UINTN sourceSize = 0;
+    VOID *source;
+
+    Output(L"Chainloading cached boot entry\r\n");
+    t = PhaseBegin(PHASE_LOAD_IMAGE);
+    source = PrefetchTake(devicePath, &sourceSize);
+    PhaseEnd(PHASE_LOAD_IMAGE, t);
+    t = PhaseBegin(PHASE_PRECHECK);
+    reason = source ? PrecheckBuffer(source, sourceSize) : PrecheckCandidate(devicePath);
+    PhaseEnd(PHASE_PRECHECK, t);
+    if (reason == PRECHECK_OK) {
+      t = PhaseBegin(PHASE_LOAD_IMAGE);
+      imageStatus = BS->LoadImage(FALSE, IM, devicePath, source, sourceSize, &nextImage);
+      PhaseEnd(PHASE_LOAD_IMAGE, t);
+    } else {
+      PrecheckSkip(LOAD_OPTION_CACHED, reason);
+      imageStatus = EFI_LOAD_ERROR;
     }
-    if (EFI_ERROR(status)) {
-      Output(L"BootOrder unavailable\r\n");
-      return status;
+    PrefetchRelease();  // LoadImage copied it
+    if (!EFI_ERROR(imageStatus)) {
+      PublishTiming();
+      PublishLog();
+      imageStatus = BS->StartImage(nextImage, NULL, NULL);
+      if (!EFI_ERROR(imageStatus)) {
+        SnapshotFree(&snap);
+        return imageStatus;
+      }
+    } else {
+      if (reason == PRECHECK_OK) Log(LOG_WARN, L"Cached target failed to load\r\n");
+      cachedIndex = (UINTN)-1;  // retry it below with a freshly built path
     }
-    offset = nextOffset + 1;
+  }
+  PrefetchRelease();  // stale or no cache: the walk loads by path
 
-    MakeBootVarName(nextBootId, bootVarName);
-    bootData = LibGetVariableAndSize(bootVarName, &gEfiGlobalVariableGuid, &bootSize);
-    if (!bootData) continue;
+  if (!EFI_ERROR(status)) {
+    t = PhaseBegin(PHASE_BOOT_OPTIONS);
+    status = SnapshotFindSelf(&snap) ? EFI_SUCCESS : EFI_NOT_FOUND;
+    PhaseEnd(PHASE_BOOT_OPTIONS, t);
+  }
 
-    devicePath = ParseBootOption(bootData, bootSize);
-    if (!devicePath) {
-      FreePool(bootData);
-      continue;
-    }
+  while (!EFI_ERROR(status)) {
+    t = PhaseBegin(PHASE_BOOT_OPTIONS);
+    status = GetNextBootOption(&snap, offset, &nextIndex, &nextOffset);
+    PhaseEnd(PHASE_BOOT_OPTIONS, t);
+    if (EFI_ERROR(status)) break;
+    offset = nextOffset + 1;
+    if (nextIndex == cachedIndex) continue;  // already started and returned an error
+    devicePath = snap.Options[nextIndex].DevicePath;
 
     Output(L"Chainloading next boot entry\r\n");
-    // Expand the short-form boot path to a full path off our own partition;
-    // fall back to the raw path if that fails (e.g. firmware that expands it).
+    // Expand the short-form boot path to a full path on the partition its
+    // HD() names; fall back to the raw path if that fails (e.g. firmware that
+    // expands it).
+    t = PhaseBegin(PHASE_BUILD_PATH);
     EFI_DEVICE_PATH_PROTOCOL *full = BuildFullPath(devicePath);
-    status = BS->LoadImage(FALSE, IM, full ? full : devicePath, NULL, 0, &nextImage);
+    PhaseEnd(PHASE_BUILD_PATH, t);
+    t = PhaseBegin(PHASE_PRECHECK);
+    reason = PrecheckCandidate(full ? full : devicePath);
+    PhaseEnd(PHASE_PRECHECK, t);
+    if (reason != PRECHECK_OK) {
+      PrecheckSkip(snap.Options[nextIndex].Id, reason);
+      if (full) FreePool(full);
+      continue;
+    }
+    t = PhaseBegin(PHASE_LOAD_IMAGE);
+    imageStatus = BS->LoadImage(FALSE, IM, full ? full : devicePath, NULL, 0, &nextImage);
+    PhaseEnd(PHASE_LOAD_IMAGE, t);
+    if (!EFI_ERROR(imageStatus)) TargetCacheStore(&snap, nextIndex, full);
     if (full) FreePool(full);
-    FreePool(bootData);
-    bootData = NULL;
-    if (EFI_ERROR(status)) continue;
+    if (EFI_ERROR(imageStatus)) continue;
 
-    status = BS->StartImage(nextImage, NULL, NULL);
-    if (EFI_ERROR(status)) continue;
+    PublishTiming();
 
-    return status;
+    PublishLog();
+    imageStatus = BS->StartImage(nextImage, NULL, NULL);
+    if (EFI_ERROR(imageStatus)) continue;
+
+    SnapshotFree(&snap);
+    return imageStatus;
   }
+
+  Log(LOG_ERROR,
+      status == EFI_NOT_FOUND ? L"No next boot entry\r\n" : L"BootOrder unavailable\r\n");
+  SnapshotFree(&snap);
+  return status;
 }
+#endif  // !DRIVER_BUILD
 
+// The application build (a Boot#### entry) chainloads the next entry. The
+// driver build (-DDRIVER_BUILD, loaded from Driver#### before any boot option)
+// only applies the policy and returns; BDS then boots the OS loader itself.
+// Returning EFI_SUCCESS keeps a driver loaded, so resident mode's timer and
+// ExitBootServices pass keep running.
 EFI_STATUS EFIAPI efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *systemTable) {
   ST = systemTable;
   BS = systemTable->BootServices;
   RT = systemTable->RuntimeServices;
   IM = image;
+  TimingStart();
+
+  UINT64 t;
+#ifndef DRIVER_BUILD
+  t = PhaseBegin(PHASE_LOAD_IMAGE);
+  PrefetchStart();  // the target's reads overlap the policy below
+  PhaseEnd(PHASE_LOAD_IMAGE, t);
+#endif
 
-  Output(L"Disabling BD PROCHOT + VR Thermal Alert\r\n");
-  uint64_t powerCtl = AsmReadMsr64(0x1FC);
-  powerCtl &= ~(uint64_t)0x1;
-  powerCtl |= (uint64_t)0x1 << 24;
-  AsmWriteMsr64(0x1FC, powerCtl);
-  Output(L"BD PROCHOT + VR Thermal Alert disabled\r\n");
+  t = PhaseBegin(PHASE_POLICY);
+  SafeMsrArm();
+  LoadPolicyProfile();
+  BOOLEAN baseline = ExperimentBegin();
+  if (!baseline) {
+    ScanClamps();
+    PrepareTurbo();
+    Output(gPolicyFromProfile ? L"Applying MSR policy profile\r\n"
+                              : L"Disabling BD PROCHOT + VR Thermal Alert\r\n");
+    FirmwareSnapshot();
+    ApplyPolicyAllCpus();
+  } else {
+    ExperimentRestore();
+  }
+  PhaseEnd(PHASE_POLICY, t);
+  if (!baseline) {
+    RegisterS3Replay();
+    ReportPolicy();
+    ReportClamps();
+    ReportTurbo();
+    StartResident();
+    StartGovernor();
+  }
+  ExperimentRecord();
+  SafeMsrDisarm();
+  if (!baseline && !gPolicyFromProfile) Output(L"BD PROCHOT + VR Thermal Alert disabled\r\n");
 
-  return TryBootOrderChainload();
+#ifdef DRIVER_BUILD
+  PublishTiming();
+  PublishLog();
+  return EFI_SUCCESS;
+#else
+  EFI_STATUS status = TryBootOrderChainload();
+  StopResident();
+  StopGovernor();
+  PublishTiming();
+  PublishLog();
+  return status;
+#endif
 }
@@ -26,7 +26,7 @@ CLANG=(
 	-Wall -Wextra -Wpedantic -Wundef -Wshadow -Wpointer-arith -Wdouble-promotion -Wconversion
 	-Werror -Wno-error=pedantic  # pedantic informs but never fails the build
 	-nostdlib -fuse-ld=lld
-	-Wl,-subsystem:efi_application -Wl,-entry:efi_main -Wl,/opt:ref -Wl,/opt:icf
+	-Wl,-entry:efi_main -Wl,/opt:ref -Wl,/opt:icf
 )
 
 # --native-unsafe: the tight, this-machine build, for local use only. Smaller and
@@ -49,14 +49,26 @@ if [ "${1:-}" = "--native-unsafe" ]; then
 	echo "** --native-unsafe: silent + 0x20 align + merge + min DOS stub + -mtune=native (this CPU)"
 fi
 
+build_as() { # <subsystem> <out.efi> <src.c> [extra flags...]
+	local subsystem="$1" out="$2" src="$3"
+	shift 3
+	"${CLANG[@]}" -Wl,-subsystem:"$subsystem" "$@" -o "$out" "$src"
+	echo "Built $out ($(stat -c%s "$out") bytes)"
+}
+
 build() { # <out.efi> <src.c>
-	"${CLANG[@]}" -o "$1" "$2"
-	echo "Built $1 ($(stat -c%s "$1") bytes)"
+	build_as efi_application "$1" "$2"
 }
 
 build DisablePROCHOT.efi      DisablePROCHOT.c
 md5sum DisablePROCHOT.efi
 
+# Same source as a boot-service driver for Driver####/DriverOrder: applies the
+# policy from its entry point and returns, no chainload. The boot-option,
+# prefetch and chainload code is left out by #ifndef DRIVER_BUILD.
+build_as efi_boot_service_driver DisablePROCHOTDxe.efi DisablePROCHOT.c -DDRIVER_BUILD
+md5sum DisablePROCHOTDxe.efi
+
 # Test-harness helpers (only needed for ./test/run.sh).
 build test/ChainSuccess.efi   test/ChainSuccess.c
 build test/WrongTarget.efi    test/WrongTarget.c
@@ -0,0 +1,366 @@
+// prochotd: keeps the MSR policy DisablePROCHOT applied at boot in place while
+// Linux runs.
+//
+// The policy comes from the DisablePROCHOTPolicy variable the app leaves in
+// efivarfs: every entry that was applied at boot is re-applied, as the same
+// masked read-modify-write, on every CPU through /dev/cpu/N/msr
+//   - right away at start,
+//   - on resume, woken by a CLOCK_REALTIME timerfd with TFD_TIMER_CANCEL_ON_SET
+//     (the kernel cancels those on resume as on a clock set), so there is no
+//     polling delay,
+//   - on SIGUSR1 (for a system-sleep hook),
+//   - and whenever the periodic check finds an entry undone.
+// The periodic check also reads MSR_CORE_PERF_LIMIT_REASONS on every CPU and
+// logs when a limit reason (PROCHOT, thermal, VR, PL1/PL2...) turns active.
+//
+// MSR access goes through a small backend; the default one works on any
+// directory laid out like /dev/cpu (N/msr, pread/pwrite at the MSR index), so
+// test/prochotd/run.sh runs it against sparse files instead of hardware.
+//
+// Usage: prochotd [--once] [--interval-ms=N] [--policy=FILE] [--msr-dir=DIR]
+// Build: cc -O2 -o prochotd linux/prochotd.c
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_POLICY                                                                \
+  "/sys/firmware/efi/efivars/DisablePROCHOTPolicy-9f0c4e2a-6b1d-4c3e-8a5f-2d71c40b93e6"
+#define DEFAULT_MSR_DIR "/dev/cpu"
+
+// ---------------------------------------------------------------------------
+// Policy record (DisablePROCHOT.c, "Applied-policy record")
+// ---------------------------------------------------------------------------
+#define POLICY_RECORD_SIGNATURE 0x4C505044  // 'DPPL'
+#define POLICY_RECORD_VERSION 2
+
+#define POLICY_STATUS_SKIPPED 0x01
+#define POLICY_STATUS_APPLIED 0x02
+
+#define MAX_ENTRIES 32
+
+typedef struct __attribute__((packed)) {
+  uint32_t Signature;
+  uint16_t Version;
+  uint8_t EntryCount;
+  uint8_t Source;
+  uint32_t Cpus;
+  uint32_t CpusVerified;
+  uint8_t S3Replay;
+  uint8_t Reserved[3];
+} POLICY_RECORD_HEADER;
+
+typedef struct __attribute__((packed)) {
+  uint32_t Msr;
+  uint8_t Scope;
+  uint8_t LockBit;
+  uint8_t Status;
+  uint8_t Reserved;
+  uint64_t Mask;
+  uint64_t Value;
+  uint32_t Written;
+  uint32_t Unchanged;
+  uint32_t Locked;
+  uint32_t Verified;
+  uint32_t Failed;
+} POLICY_RECORD_ENTRY;
+
+typedef struct {
+  uint32_t Msr;
+  uint8_t LockBit;
+  uint64_t Mask;
+  uint64_t Value;
+} ENTRY;
+
+static ENTRY gEntries[MAX_ENTRIES];
+static int gEntryCount;
+
+// Entries applied at boot. Accepts the raw record or the efivarfs file (a u32
+// attribute word in front of it).
+static int LoadPolicy(const char *path) {
+  unsigned char buf[sizeof(POLICY_RECORD_HEADER) + 255 * sizeof(POLICY_RECORD_ENTRY) + 4];
+  POLICY_RECORD_HEADER h;
+  size_t off = 0, n;
+  uint32_t sig;
+  FILE *f = fopen(path, "rb");
+  int i;
+
+  if (!f) {
+    fprintf(stderr, "prochotd: %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  n = fread(buf, 1, sizeof(buf), f);
+  fclose(f);
+
+  if (n >= 8) {
+    memcpy(&sig, buf, 4);
+    if (sig != POLICY_RECORD_SIGNATURE) off = 4;
+  }
+  if (n < off + sizeof(h)) goto bad;
+  memcpy(&h, buf + off, sizeof(h));
+  if (h.Signature != POLICY_RECORD_SIGNATURE || h.Version != POLICY_RECORD_VERSION ||
+      n < off + sizeof(h) + h.EntryCount * sizeof(POLICY_RECORD_ENTRY))
+    goto bad;
+
+  gEntryCount = 0;
+  for (i = 0; i < h.EntryCount && gEntryCount < MAX_ENTRIES; ++i) {
+    POLICY_RECORD_ENTRY e;
+    memcpy(&e, buf + off + sizeof(h) + (size_t)i * sizeof(e), sizeof(e));
+    if (!(e.Status & POLICY_STATUS_APPLIED) || (e.Status & POLICY_STATUS_SKIPPED)) continue;
+    gEntries[gEntryCount].Msr = e.Msr;
+    gEntries[gEntryCount].LockBit = e.LockBit;
+    gEntries[gEntryCount].Mask = e.Mask;
+    gEntries[gEntryCount].Value = e.Value & e.Mask;
+    gEntryCount++;
+  }
+  return 0;
+
+bad:
+  fprintf(stderr, "prochotd: %s: not a DisablePROCHOT policy record\n", path);
+  return -1;
+}
+
+// ---------------------------------------------------------------------------
+// MSR backend
+// ---------------------------------------------------------------------------
+#define MAX_CPUS 1024
+
+// CPUs are 0..Count-1 here; Number maps them to the kernel's numbering.
+typedef struct {
+  int (*Read)(void *ctx, int cpu, uint32_t msr, uint64_t *value);
+  int (*Write)(void *ctx, int cpu, uint32_t msr, uint64_t value);
+  void *Ctx;
+  int Count;
+  const int *Number;
+} MSR_BACKEND;
+
+// Directory backend: <dir>/<cpu>/msr, opened once per CPU.
+typedef struct {
+  int Fd[MAX_CPUS];
+  int Cpu[MAX_CPUS];
+  int Count;
+} MSR_DIR;
+
+static int DirRead(void *ctx, int cpu, uint32_t msr, uint64_t *value) {
+  MSR_DIR *d = ctx;
+  return pread(d->Fd[cpu], value, 8, msr) == 8 ? 0 : -1;
+}
+
+static int DirWrite(void *ctx, int cpu, uint32_t msr, uint64_t value) {
+  MSR_DIR *d = ctx;
+  return pwrite(d->Fd[cpu], &value, 8, msr) == 8 ? 0 : -1;
+}
+
+static int CompareInt(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+// Open every <dir>/<N>/msr; backend CPU i is the i-th lowest N.
+static int OpenMsrDir(const char *path, MSR_DIR *d, MSR_BACKEND *b) {
+  DIR *dir = opendir(path);
+  struct dirent *de;
+  char file[4096];
+  int i;
+
+  if (!dir) {
+    fprintf(stderr, "prochotd: %s: %s (is the msr module loaded?)\n", path,
+            strerror(errno));
+    return -1;
+  }
+  d->Count = 0;
+  while ((de = readdir(dir)) && d->Count < MAX_CPUS) {
+    char *end;
+    long cpu = strtol(de->d_name, &end, 10);
+    if (end == de->d_name || *end || cpu < 0) continue;
+    d->Cpu[d->Count++] = (int)cpu;
+  }
+  closedir(dir);
+  qsort(d->Cpu, (size_t)d->Count, sizeof(d->Cpu[0]), CompareInt);
+
+  for (i = 0; i < d->Count; ++i) {
+    snprintf(file, sizeof(file), "%s/%d/msr", path, d->Cpu[i]);
+    d->Fd[i] = open(file, O_RDWR | O_CLOEXEC);
+    if (d->Fd[i] < 0) {
+      fprintf(stderr, "prochotd: %s: %s\n", file, strerror(errno));
+      return -1;
+    }
+  }
+  if (!d->Count) {
+    fprintf(stderr, "prochotd: %s: no CPUs\n", path);
+    return -1;
+  }
+  b->Read = DirRead;
+  b->Write = DirWrite;
+  b->Ctx = d;
+  b->Count = d->Count;
+  b->Number = d->Cpu;
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Re-apply and watch
+// ---------------------------------------------------------------------------
+#define MSR_CORE_PERF_LIMIT_REASONS 0x64F
+
+static MSR_BACKEND gMsr;
+static MSR_DIR gDir;
+static uint32_t gLastReasons[MAX_CPUS];
+static int gNoLimitReasons;  // the MSR faulted once; don't try again
+
+static uint64_t NowUs(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+// One pass over every CPU and entry; returns how many MSRs were rewritten.
+// Entries that are locked or can't be read are left alone.
+static int ApplyPolicy(int *locked) {
+  int cpu, i, rewrites = 0;
+
+  *locked = 0;
+  for (cpu = 0; cpu < gMsr.Count; ++cpu) {
+    for (i = 0; i < gEntryCount; ++i) {
+      const ENTRY *e = &gEntries[i];
+      uint64_t v;
+
+      if (gMsr.Read(gMsr.Ctx, cpu, e->Msr, &v)) continue;
+      if ((v & e->Mask) == e->Value) continue;
+      if (e->LockBit < 64 && ((v >> e->LockBit) & 1)) {
+        (*locked)++;
+        continue;
+      }
+      if (!gMsr.Write(gMsr.Ctx, cpu, e->Msr, (v & ~e->Mask) | e->Value)) rewrites++;
+    }
+  }
+  return rewrites;
+}
+
+// Logs rewrites, and locked MSRs when their count changes.
+static void Reapply(const char *why) {
+  static int lastLocked;
+  uint64_t t0 = NowUs(CLOCK_MONOTONIC);
+  int locked, rewrites = ApplyPolicy(&locked);
+
+  if (!rewrites && locked == lastLocked) return;
+  lastLocked = locked;
+  printf("prochotd: %s: rewrote %d MSRs in %" PRIu64 " us", why, rewrites,
+         NowUs(CLOCK_MONOTONIC) - t0);
+  if (locked) printf(", %d locked", locked);
+  printf("\n");
+  fflush(stdout);
+}
+
+static const char *const kLimitReasons[16] = {
+    "PROCHOT", "thermal", NULL, NULL, "residency", "thermal-average", "VR-thermal",
+    "VR-TDC", "other", NULL, "PL1", "PL2", "max-turbo", "turbo-attenuation", NULL, NULL,
+};
+
+// Log CPUs whose active limit reasons (bits 15:0) changed since the last look.
+static void WatchLimitReasons(void) {
+  int cpu, bit;
+
+  if (gNoLimitReasons) return;
+  for (cpu = 0; cpu < gMsr.Count; ++cpu) {
+    uint64_t v;
+    uint32_t active;
+
+    if (gMsr.Read(gMsr.Ctx, cpu, MSR_CORE_PERF_LIMIT_REASONS, &v)) {
+      gNoLimitReasons = 1;
+      return;
+    }
+    active = (uint32_t)v & 0xFFFF;
+    if (active == gLastReasons[cpu]) continue;
+    gLastReasons[cpu] = active;
+    printf("prochotd: CPU %d limit reasons 0x%04x", gMsr.Number[cpu], active);
+    for (bit = 0; bit < 16; ++bit)
+      if ((active >> bit) & 1) printf(" %s", kLimitReasons[bit] ? kLimitReasons[bit] : "?");
+    printf("\n");
+  }
+  fflush(stdout);
+}
+
+static volatile sig_atomic_t gKick, gStop;
+
+static void OnSignal(int sig) {
+  if (sig == SIGUSR1) gKick = 1;
+  else gStop = 1;
+}
+
+// A CLOCK_REALTIME timer that is cancelled on clock set and on resume.
+static int ArmResumeTimer(int fd) {
+  struct itimerspec its = {{0, 0}, {INT32_MAX, 0}};
+  return timerfd_settime(fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL);
+}
+
+int main(int argc, char **argv) {
+  const char *policy = DEFAULT_POLICY, *msrDir = DEFAULT_MSR_DIR;
+  int once = 0, intervalMs = 1000, i, fd;
+  uint64_t sleptUs;
+  struct sigaction sa;
+
+  for (i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--once")) once = 1;
+    else if (!strncmp(argv[i], "--policy=", 9)) policy = argv[i] + 9;
+    else if (!strncmp(argv[i], "--msr-dir=", 10)) msrDir = argv[i] + 10;
+    else if (!strncmp(argv[i], "--interval-ms=", 14) && atoi(argv[i] + 14) >= 10)
+      intervalMs = atoi(argv[i] + 14);
+    else {
+      fprintf(stderr,
+              "usage: prochotd [--once] [--interval-ms=N] [--policy=FILE] [--msr-dir=DIR]\n");
+      return 2;
+    }
+  }
+
+  if (LoadPolicy(policy) || OpenMsrDir(msrDir, &gDir, &gMsr)) return 1;
+  printf("prochotd: %d entries on %d CPUs\n", gEntryCount, gMsr.Count);
+  Reapply("start");
+  if (once) return 0;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = OnSignal;
+  sigaction(SIGUSR1, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+
+  fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC);
+  if (fd < 0 || ArmResumeTimer(fd)) {
+    fprintf(stderr, "prochotd: timerfd: %s\n", strerror(errno));
+    return 1;
+  }
+  sleptUs = NowUs(CLOCK_BOOTTIME) - NowUs(CLOCK_MONOTONIC);
+  WatchLimitReasons();
+
+  while (!gStop) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    int r = poll(&pfd, 1, intervalMs);
+    uint64_t ticks;
+
+    if (r > 0 && read(fd, &ticks, sizeof(ticks)) < 0 && errno == ECANCELED) {
+      // Resume, or someone set the clock. Both are cheap to handle the same
+      // way; BOOTTIME running ahead of MONOTONIC tells them apart for the log.
+      uint64_t slept = NowUs(CLOCK_BOOTTIME) - NowUs(CLOCK_MONOTONIC);
+      Reapply(slept > sleptUs + 1000 ? "resume" : "clock set");
+      sleptUs = slept;
+      ArmResumeTimer(fd);
+    } else if (gKick) {
+      gKick = 0;
+      Reapply("signal");
+    } else if (r == 0) {
+      Reapply("clamp re-asserted");
+      WatchLimitReasons();
+    }
+  }
+  close(fd);
+  return 0;
+}
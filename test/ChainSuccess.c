@@ -1,10 +1,210 @@
 // Minimal EFI app used for testing chainload functionality.
-// Prints a success message and triggers system shutdown.
+// Copies DisablePROCHOT's deferred log to the console, checks the boot-phase
+// timing record DisablePROCHOT left behind, as the app or as the Driver####
+// build (and the resident-mode and experiment records, when there are any),
+// prints the TSC time from DisablePROCHOT's start to here and how many boot
+// candidates it pre-checked and skipped on the way, checks its own image
+// FilePath, prints a success message and triggers system shutdown.
 #include <efi.h>
 
+// Mirrors DisablePROCHOT.c's TIMING_RECORD (version 2).
+typedef struct __attribute__((packed)) {
+  UINT64 Ticks;
+  UINT32 Calls;
+  UINT32 Us;
+} TIMING_PHASE;
+
+typedef struct __attribute__((packed)) {
+  UINT32 Signature;
+  UINT16 Version;
+  UINT16 PhaseCount;
+  UINT32 TscKhz;
+  UINT32 TotalUs;
+  UINT64 StartTsc;
+  UINT64 HandoffTsc;
+  TIMING_PHASE Phase[5];  // Policy, BootOptions, BuildFullPath, LoadImage, Precheck
+  UINT16 Skipped[5];      // per pre-check reason
+} TIMING_RECORD;
+
+static EFI_GUID gDisablePROCHOTVendorGuid = {
+    0x9f0c4e2a, 0x6b1d, 0x4c3e, {0x8a, 0x5f, 0x2d, 0x71, 0xc4, 0x0b, 0x93, 0xe6}};
+
+static TIMING_RECORD gTiming;
+
+// NULL: missing or malformed. The driver build never reads boot options or
+// loads an image, so those phases stay empty there.
+static CHAR16 *CheckTimingRecord(EFI_RUNTIME_SERVICES *rt) {
+  TIMING_RECORD *rec = &gTiming;
+  UINTN size = sizeof(*rec);
+
+  if (EFI_ERROR(rt->GetVariable(L"DisablePROCHOTTiming", &gDisablePROCHOTVendorGuid, NULL,
+                                &size, rec)))
+    return NULL;
+  if (size != sizeof(*rec) || rec->Signature != 0x4C545044 || rec->Version != 2 ||
+      rec->PhaseCount != 5 || rec->TscKhz == 0 || rec->HandoffTsc <= rec->StartTsc ||
+      rec->Phase[0].Calls != 1)
+    return NULL;
+  if (rec->Phase[1].Calls >= 1 && rec->Phase[3].Calls >= 1 && rec->Phase[4].Calls >= 1)
+    return L"Timing record OK\r\n";
+  if (rec->Phase[1].Calls == 0 && rec->Phase[3].Calls == 0 && rec->Phase[4].Calls == 0)
+    return L"Timing record OK (driver)\r\n";
+  return NULL;
+}
+
+static UINT64 ReadTsc(void) {
+  UINT32 low, high;
+  __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+  return ((UINT64)high << 32) | low;
+}
+
+static void OutputDec(SIMPLE_TEXT_OUTPUT_INTERFACE *conOut, CHAR16 *prefix, UINT64 v,
+                      CHAR16 *suffix) {
+  CHAR16 buf[32], *p = buf + 31;
+
+  *p = L'\0';
+  do {
+    *--p = (CHAR16)(L'0' + v % 10);
+    v /= 10;
+  } while (v);
+  conOut->OutputString(conOut, prefix);
+  conOut->OutputString(conOut, p);
+  conOut->OutputString(conOut, suffix);
+}
+
+// "Boot latency: <us> us", DisablePROCHOT's efi_main entry -> our entry, then
+// "Boot walk: <n> pre-checked, <n> skipped", the candidates the walk looked at.
+static void OutputLatency(SIMPLE_TEXT_OUTPUT_INTERFACE *conOut, UINT64 now) {
+  UINT64 skipped = 0;
+  UINTN i;
+
+  OutputDec(conOut, L"Boot latency: ", (now - gTiming.StartTsc) * 1000 / gTiming.TscKhz,
+            L" us\r\n");
+  for (i = 0; i < 5; ++i) skipped += gTiming.Skipped[i];
+  OutputDec(conOut, L"Boot walk: ", gTiming.Phase[4].Calls, L" pre-checked, ");
+  OutputDec(conOut, L"", skipped, L" skipped\r\n");
+}
+
+// Mirrors DisablePROCHOT.c's RESIDENT_RECORD (version 2).
+typedef struct __attribute__((packed)) {
+  UINT32 Signature;
+  UINT16 Version;
+  UINT16 Watched;
+  UINT32 IntervalMs;
+  UINT32 Checks;
+  UINT32 Reasserted;
+  UINT32 Rewrites;
+  UINT16 Cpus;
+  UINT16 ExitCpus;
+  UINT32 BspOnlyTicks;
+} RESIDENT_RECORD;
+
+// NULL: no record (resident mode off); otherwise the verdict. Nothing else
+// uses the APs meanwhile, so every tick must have reached them.
+static CHAR16 *CheckResidentRecord(EFI_RUNTIME_SERVICES *rt) {
+  RESIDENT_RECORD rec;
+  UINTN size = sizeof(rec);
+
+  if (EFI_ERROR(rt->GetVariable(L"DisablePROCHOTResident", &gDisablePROCHOTVendorGuid, NULL,
+                                &size, &rec)))
+    return NULL;
+  return size == sizeof(rec) && rec.Signature == 0x53525044 && rec.Version == 2 &&
+                 rec.Watched != 0 && rec.IntervalMs != 0 && rec.Cpus != 0 &&
+                 rec.ExitCpus == 1 && rec.BspOnlyTicks == 0
+             ? L"Resident record OK\r\n"
+             : L"Resident record malformed\r\n";
+}
+
+// DisablePROCHOT only prints its log on failure; the rest of the time it is in
+// the DisablePROCHOTLog variable, which we copy to the console for run.sh.
+static BOOLEAN DumpLog(EFI_RUNTIME_SERVICES *rt, SIMPLE_TEXT_OUTPUT_INTERFACE *conOut) {
+  static CHAR8 text[8192];
+  CHAR16 line[128];
+  UINTN size = sizeof(text), i, n = 0;
+
+  if (EFI_ERROR(rt->GetVariable(L"DisablePROCHOTLog", &gDisablePROCHOTVendorGuid, NULL, &size,
+                                text)))
+    return FALSE;
+  conOut->OutputString(conOut, L"DisablePROCHOT log:\r\n");
+  for (i = 0; i < size; ++i) {
+    if (text[i] != '\n' && n < 125) line[n++] = (CHAR16)text[i];
+    if (text[i] != '\n' && i + 1 < size) continue;
+    line[n++] = L'\r';
+    line[n++] = L'\n';
+    line[n] = L'\0';
+    conOut->OutputString(conOut, line);
+    n = 0;
+  }
+  return TRUE;
+}
+
+// Mirrors the header of DisablePROCHOT.c's EXPERIMENT_RESULTS (version 2).
+typedef struct __attribute__((packed)) {
+  UINT32 Signature;
+  UINT16 Version;
+  UINT16 Rounds;
+  UINT16 Count;
+  UINT16 Next;
+  UINT8 Complete;
+  UINT8 Reserved[3];
+  UINT32 TscKhz;
+} EXPERIMENT_HEADER;
+
+// NULL: no experiment has run; otherwise the verdict. Every sample needs a
+// throughput (IterationsPerMs, at byte 12 of each 24-byte sample) unless it is
+// flagged contaminated (0x08 in the flags byte 3), which isn't measured.
+static CHAR16 *CheckExperimentRecord(EFI_RUNTIME_SERVICES *rt) {
+  static UINT8 buf[1024];
+  EXPERIMENT_HEADER *h = (EXPERIMENT_HEADER *)buf;
+  UINTN size = sizeof(buf), i;
+
+  if (EFI_ERROR(rt->GetVariable(L"DisablePROCHOTExperimentResults", &gDisablePROCHOTVendorGuid,
+                                NULL, &size, buf)))
+    return NULL;
+  if (size != sizeof(*h) + 32 * 24 || h->Signature != 0x52585044 || h->Version != 2 ||
+      !h->Count || h->Count > 32)
+    return L"Experiment record malformed\r\n";
+  for (i = 0; i < h->Count; ++i) {
+    UINT8 *s = buf + sizeof(*h) + i * 24;
+    if (!(s[3] & 0x08) && !*(UINT32 *)(s + 12)) return L"Experiment record malformed\r\n";
+  }
+  if (!h->Complete) return L"Experiment record OK (running)\r\n";
+  return L"Experiment record OK (complete)\r\n";
+}
+
+// Loaded from a buffer (the target prefetch) or by path, our LoadedImage
+// FilePath must still be the File node LoadImage was given.
+static BOOLEAN CheckImagePath(EFI_HANDLE image, EFI_BOOT_SERVICES *bs) {
+  static EFI_GUID loadedImageGuid = LOADED_IMAGE_PROTOCOL;
+  EFI_LOADED_IMAGE *li = NULL;
+  EFI_DEVICE_PATH_PROTOCOL *dp;
+
+  if (EFI_ERROR(bs->HandleProtocol(image, &loadedImageGuid, (void **)&li)) || !li)
+    return FALSE;
+  for (dp = li->FilePath; dp && !IsDevicePathEnd(dp); dp = NextDevicePathNode(dp))
+    if (DevicePathType(dp) == MEDIA_DEVICE_PATH && DevicePathSubType(dp) == MEDIA_FILEPATH_DP)
+      return TRUE;
+  return FALSE;
+}
+
 EFI_STATUS EFIAPI efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *systemTable) {
-  (void)image;
+  UINT64 now = ReadTsc();
   SIMPLE_TEXT_OUTPUT_INTERFACE *conOut = systemTable->ConOut;
+  if (!DumpLog(systemTable->RuntimeServices, conOut))
+    conOut->OutputString(conOut, L"DisablePROCHOT log missing\r\n");
+  CHAR16 *timing = CheckTimingRecord(systemTable->RuntimeServices);
+  if (timing) {
+    conOut->OutputString(conOut, timing);
+    OutputLatency(conOut, now);
+  } else {
+    conOut->OutputString(conOut, L"Timing record missing or malformed\r\n");
+  }
+  CHAR16 *resident = CheckResidentRecord(systemTable->RuntimeServices);
+  if (resident) conOut->OutputString(conOut, resident);
+  CHAR16 *experiment = CheckExperimentRecord(systemTable->RuntimeServices);
+  if (experiment) conOut->OutputString(conOut, experiment);
+  conOut->OutputString(conOut, CheckImagePath(image, systemTable->BootServices)
+                                   ? L"Image file path OK\r\n"
+                                   : L"Image file path missing\r\n");
   conOut->OutputString(conOut, L"Chainload successful\r\n");
   conOut->OutputString(conOut, L"Shutting down\r\n");
   systemTable->RuntimeServices->ResetSystem(EfiResetShutdown, EFI_SUCCESS, 0,
@@ -1,5 +1,14 @@
 // Test helper: set up BootOrder with DisablePROCHOT -> ChainSuccess (plus a
 // few decoy entries), then launch DisablePROCHOT to exercise the chainload.
+// An optional \EFI\BOOT\SCENARIO file on the ESP (written by run.sh) picks a
+// variant for multi-boot tests:
+//   stale-cache    BootOrder differs from the one the target cache was built for
+//   corrupt-cache  DisablePROCHOTTarget is overwritten with garbage
+//   experiment     DisablePROCHOTExperiment is set to one round (two boots)
+//   bench N S T    N generated entries instead of the decoys, DisablePROCHOT at
+//                  slot S and ChainSuccess at slot T; every other entry is
+//                  unloadable (inactive, missing file in full or short form,
+//                  or no file path), so the walk from S to T visits them all
 //
 // Self-contained: GNU-EFI headers for TYPES only, no GNU-EFI lib, so it builds
 // straight to PE-COFF with clang/lld like the main app.
@@ -15,9 +24,24 @@ static EFI_GUID gEfiGlobalVariableGuid = EFI_GLOBAL_VARIABLE;
 static EFI_GUID gEfiLoadedImageProtocolGuid = LOADED_IMAGE_PROTOCOL;
 static EFI_GUID gEfiDevicePathProtocolGuid = {
     0x09576e91, 0x6d3f, 0x11d2, {0x8e, 0x39, 0x00, 0xa0, 0xc9, 0x69, 0x72, 0x3b}};
+static EFI_GUID gEfiSimpleFileSystemProtocolGuid = SIMPLE_FILE_SYSTEM_PROTOCOL;
+static EFI_GUID gDisablePROCHOTVendorGuid = {
+    0x9f0c4e2a, 0x6b1d, 0x4c3e, {0x8a, 0x5f, 0x2d, 0x71, 0xc4, 0x0b, 0x93, 0xe6}};
 
 static void Out(CHAR16 *s) { ST->ConOut->OutputString(ST->ConOut, s); }
 
+static void OutDec(CHAR16 *prefix, UINTN v, CHAR16 *suffix) {
+  CHAR16 buf[21], *p = buf + 20;
+  *p = L'\0';
+  do {
+    *--p = (CHAR16)(L'0' + v % 10);
+    v /= 10;
+  } while (v);
+  Out(prefix);
+  Out(p);
+  Out(suffix);
+}
+
 static UINTN StrLen16(CHAR16 *s) {
   UINTN n = 0;
   while (s[n]) n++;
@@ -30,6 +54,33 @@ static void CopyMem8(void *d, const void *s, UINTN n) {
   for (UINTN i = 0; i < n; i++) dd[i] = ss[i];
 }
 
+// TRUE if the first bytes of `s` are the ASCII word `w`.
+static BOOLEAN AsciiIs(CHAR8 *s, UINTN n, const char *w) {
+  UINTN i;
+  for (i = 0; w[i]; i++)
+    if (i >= n || s[i] != (CHAR8)w[i]) return FALSE;
+  return i == n || s[i] == '\n' || s[i] == '\r' || s[i] == ' ';
+}
+
+// Read \EFI\BOOT\SCENARIO (ASCII, no BOM) from our volume; 0 bytes if absent.
+static UINTN ReadScenario(EFI_HANDLE dev, CHAR8 *buf, UINTN max) {
+  EFI_FILE_IO_INTERFACE *fs = NULL;
+  EFI_FILE_HANDLE root = NULL, file = NULL;
+  UINTN n = max;
+
+  if (EFI_ERROR(BS->HandleProtocol(dev, &gEfiSimpleFileSystemProtocolGuid, (void **)&fs)) ||
+      !fs || EFI_ERROR(fs->OpenVolume(fs, &root)))
+    return 0;
+  if (EFI_ERROR(root->Open(root, &file, L"\\EFI\\BOOT\\SCENARIO", EFI_FILE_MODE_READ, 0))) {
+    root->Close(root);
+    return 0;
+  }
+  if (EFI_ERROR(file->Read(file, &n, buf))) n = 0;
+  file->Close(file);
+  root->Close(root);
+  return n;
+}
+
 static UINTN DevPathSize(EFI_DEVICE_PATH_PROTOCOL *dp) {
   EFI_DEVICE_PATH_PROTOCOL *n = dp;
   UINTN sz = 0;
@@ -72,25 +123,30 @@ static EFI_DEVICE_PATH_PROTOCOL *FileDevicePath16(EFI_HANDLE dev, CHAR16 *file)
   return (EFI_DEVICE_PATH_PROTOCOL *)out;
 }
 
-static EFI_STATUS CreateBootOption(UINT16 bootId, CHAR16 *description,
-                                   CHAR16 *filePath, EFI_HANDLE deviceHandle) {
+// Cut a full path down to the short form firmware stores: HD(...)/File/End.
+// Works in place; returns FALSE if there is no HD node.
+static BOOLEAN ShortFormPath(EFI_DEVICE_PATH_PROTOCOL *dp) {
+  EFI_DEVICE_PATH_PROTOCOL *n = dp;
+  while (!IsDevicePathEnd(n)) {
+    if (DevicePathType(n) == MEDIA_DEVICE_PATH && DevicePathSubType(n) == MEDIA_HARDDRIVE_DP) {
+      UINTN size = DevPathSize(n);
+      CopyMem8(dp, n, size);  // forward overlap: byte copy is fine
+      return TRUE;
+    }
+    n = NextDevicePathNode(n);
+  }
+  return FALSE;
+}
+
+// Boot#### or Driver#### (kind L"Boot" / L"Driver").
+static EFI_STATUS WriteLoadOption(CHAR16 *kind, UINT16 bootId, UINT32 attributes,
+                                  CHAR16 *description, EFI_DEVICE_PATH_PROTOCOL *devicePath) {
   EFI_STATUS status;
-  UINT8 endDevicePath[] = {0x7f, 0xff, 0x04, 0x00};
-  EFI_DEVICE_PATH_PROTOCOL *devicePath;
-  UINTN devicePathSize, descSize, totalSize;
+  UINTN devicePathSize = DevPathSize(devicePath), descSize, totalSize;
   UINT8 *buffer, *ptr;
-  CHAR16 varName[9];
+  CHAR16 varName[11];
   const CHAR16 hex[] = L"0123456789ABCDEF";
 
-  if (filePath) {
-    devicePath = FileDevicePath16(deviceHandle, filePath);
-    if (!devicePath) return EFI_OUT_OF_RESOURCES;
-    devicePathSize = DevPathSize(devicePath);
-  } else {
-    devicePath = (EFI_DEVICE_PATH_PROTOCOL *)endDevicePath;
-    devicePathSize = sizeof(endDevicePath);
-  }
-
   descSize = (StrLen16(description) + 1) * sizeof(CHAR16);
   totalSize = sizeof(UINT32) + sizeof(UINT16) + descSize + devicePathSize;
 
@@ -98,7 +154,7 @@ static EFI_STATUS CreateBootOption(UINT16 bootId, CHAR16 *description,
     return EFI_OUT_OF_RESOURCES;
 
   ptr = buffer;
-  *(UINT32 *)ptr = bootId == 0x0005 ? 0 : 0x00000001;  // LOAD_OPTION_ACTIVE
+  *(UINT32 *)ptr = attributes;
   ptr += sizeof(UINT32);
   *(UINT16 *)ptr = (UINT16)devicePathSize;
   ptr += sizeof(UINT16);
@@ -106,15 +162,13 @@ static EFI_STATUS CreateBootOption(UINT16 bootId, CHAR16 *description,
   ptr += descSize;
   CopyMem8(ptr, devicePath, devicePathSize);
 
-  varName[0] = L'B';
-  varName[1] = L'o';
-  varName[2] = L'o';
-  varName[3] = L't';
-  varName[4] = hex[(bootId >> 12) & 0xF];
-  varName[5] = hex[(bootId >> 8) & 0xF];
-  varName[6] = hex[(bootId >> 4) & 0xF];
-  varName[7] = hex[bootId & 0xF];
-  varName[8] = L'\0';
+  UINTN k = StrLen16(kind);
+  CopyMem8(varName, kind, k * sizeof(CHAR16));
+  varName[k + 0] = hex[(bootId >> 12) & 0xF];
+  varName[k + 1] = hex[(bootId >> 8) & 0xF];
+  varName[k + 2] = hex[(bootId >> 4) & 0xF];
+  varName[k + 3] = hex[bootId & 0xF];
+  varName[k + 4] = L'\0';
 
   status = RT->SetVariable(varName, &gEfiGlobalVariableGuid,
                            EFI_VARIABLE_NON_VOLATILE |
@@ -125,13 +179,122 @@ static EFI_STATUS CreateBootOption(UINT16 bootId, CHAR16 *description,
   return status;
 }
 
+static EFI_STATUS CreateBootOption(UINT16 bootId, CHAR16 *description,
+                                   CHAR16 *filePath, EFI_HANDLE deviceHandle) {
+  UINT8 endDevicePath[] = {0x7f, 0xff, 0x04, 0x00};
+  EFI_DEVICE_PATH_PROTOCOL *devicePath = (EFI_DEVICE_PATH_PROTOCOL *)endDevicePath;
+  UINT32 attributes = bootId == 0x0005 ? 0 : 0x00000001;  // LOAD_OPTION_ACTIVE
+  EFI_STATUS status;
+
+  if (filePath) {
+    devicePath = FileDevicePath16(deviceHandle, filePath);
+    if (!devicePath) return EFI_OUT_OF_RESOURCES;
+  }
+  status = WriteLoadOption(L"Boot", bootId, attributes, description, devicePath);
+  if (filePath) BS->FreePool(devicePath);
+  return status;
+}
+
+// Decimal fields of "bench N S T", after the word.
+static BOOLEAN ParseBench(CHAR8 *s, UINTN n, UINTN out[3]) {
+  UINTN i = 5, f;  // past "bench"
+  for (f = 0; f < 3; f++) {
+    while (i < n && s[i] == ' ') i++;
+    if (i == n || s[i] < '0' || s[i] > '9') return FALSE;
+    out[f] = 0;
+    while (i < n && s[i] >= '0' && s[i] <= '9') out[f] = out[f] * 10 + (UINTN)(s[i++] - '0');
+  }
+  return out[0] >= 2 && out[0] <= 1000 && out[1] < out[0] && out[2] < out[0] &&
+         out[1] != out[2];
+}
+
+// Bench BootOrder: Boot1000.. in order, self and target at their slots, the
+// rest cycling through the four unloadable forms.
+static EFI_STATUS CreateBenchEntries(EFI_HANDLE dev, UINTN count, UINTN self, UINTN target,
+                                     UINT16 *order) {
+  UINT8 endDevicePath[] = {0x7f, 0xff, 0x04, 0x00};
+  EFI_DEVICE_PATH_PROTOCOL *missing = FileDevicePath16(dev, L"\\EFI\\stale\\vendor.efi");
+  EFI_DEVICE_PATH_PROTOCOL *missingShort = FileDevicePath16(dev, L"\\EFI\\stale\\vendor.efi");
+  UINTN i;
+
+  if (!missing || !missingShort || !ShortFormPath(missingShort)) return EFI_OUT_OF_RESOURCES;
+  for (i = 0; i < count; i++) {
+    UINT16 id = (UINT16)(0x1000 + i);
+    EFI_STATUS status;
+    order[i] = id;
+    if (i == self)
+      status = CreateBootOption(id, L"DisablePROCHOT", L"\\EFI\\BOOT\\DisablePROCHOT.efi", dev);
+    else if (i == target)
+      status = CreateBootOption(id, L"ChainSuccess", L"\\EFI\\BOOT\\ChainSuccess.efi", dev);
+    else if (i % 4 == 0)
+      status = WriteLoadOption(L"Boot", id, 0, L"Inactive", missing);
+    else if (i % 4 == 1)
+      status = WriteLoadOption(L"Boot", id, 1, L"Stale vendor entry", missing);
+    else if (i % 4 == 2)
+      status = WriteLoadOption(L"Boot", id, 1, L"Stale vendor entry (short)", missingShort);
+    else
+      status = WriteLoadOption(L"Boot", id, 1, L"EFI Network",
+                               (EFI_DEVICE_PATH_PROTOCOL *)endDevicePath);
+    if (EFI_ERROR(status)) return status;
+  }
+  BS->FreePool(missing);
+  BS->FreePool(missingShort);
+  return EFI_SUCCESS;
+}
+
+// "driver": DisablePROCHOTDxe.efi as Driver0000. The first boot registers it
+// and resets (QEMU exits, -no-reboot); on the next one BDS has loaded it before
+// running us, so its timing record is there and ChainSuccess is started
+// directly, with no DisablePROCHOT boot entry in between.
+static EFI_STATUS DriverScenario(EFI_HANDLE image, EFI_HANDLE dev) {
+  UINT8 timing[128];
+  UINTN size = sizeof(timing);
+  UINT16 driverOrder = 0x0000;
+  EFI_DEVICE_PATH_PROTOCOL *dp;
+  EFI_HANDLE chain;
+  EFI_STATUS status;
+
+  if (!EFI_ERROR(RT->GetVariable(L"DisablePROCHOTTiming", &gDisablePROCHOTVendorGuid, NULL,
+                                 &size, timing))) {
+    Out(L"DisablePROCHOT driver ran before boot options\r\n");
+    dp = FileDevicePath16(dev, L"\\EFI\\BOOT\\ChainSuccess.efi");
+    if (!dp || EFI_ERROR(BS->LoadImage(FALSE, image, dp, NULL, 0, &chain))) {
+      Out(L"Failed to load ChainSuccess.efi\r\n");
+      return EFI_LOAD_ERROR;
+    }
+    return BS->StartImage(chain, NULL, NULL);
+  }
+
+  dp = FileDevicePath16(dev, L"\\EFI\\BOOT\\DisablePROCHOTDxe.efi");
+  if (!dp) return EFI_OUT_OF_RESOURCES;
+  status = WriteLoadOption(L"Driver", 0x0000, 0x00000001, L"DisablePROCHOT", dp);
+  BS->FreePool(dp);
+  if (!EFI_ERROR(status))
+    status = RT->SetVariable(L"DriverOrder", &gEfiGlobalVariableGuid,
+                             EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS |
+                                 EFI_VARIABLE_RUNTIME_ACCESS,
+                             sizeof(driverOrder), &driverOrder);
+  if (EFI_ERROR(status)) {
+    Out(L"Failed to create Driver0000\r\n");
+    return status;
+  }
+  Out(L"Created Driver0000 -> DisablePROCHOTDxe.efi, resetting\r\n");
+  RT->ResetSystem(EfiResetCold, EFI_SUCCESS, 0, NULL);
+  return EFI_SUCCESS;  // ResetSystem does not return
+}
+
 EFI_STATUS EFIAPI efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *systemTable) {
   EFI_STATUS status;
   EFI_LOADED_IMAGE *loadedImage = NULL;
   EFI_HANDLE deviceHandle, disableImage;
   EFI_DEVICE_PATH_PROTOCOL *disablePath;
   UINT16 bootOrder[7] = {0x0002, 0x0006, 0x0005, 0x0004, 0x0003, 0x0000, 0x0001};
+  UINT16 *order = bootOrder;
+  UINTN bootOrderSize = sizeof(bootOrder);
   UINT16 staleBootCurrent = 0x0000;
+  CHAR8 scenario[32];
+  UINTN scenarioLen, bench[3];
+  BOOLEAN isBench;
 
   ST = systemTable;
   BS = systemTable->BootServices;
@@ -148,37 +311,88 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *systemTable) {
     return EFI_LOAD_ERROR;
   }
   deviceHandle = loadedImage->DeviceHandle;
+  scenarioLen = ReadScenario(deviceHandle, scenario, sizeof(scenario));
+  if (AsciiIs(scenario, scenarioLen, "driver")) return DriverScenario(image, deviceHandle);
 
-  if (EFI_ERROR(CreateBootOption(0x0002, L"DisablePROCHOT",
-                                 L"\\EFI\\BOOT\\DisablePROCHOT.efi", deviceHandle))) {
-    Out(L"Failed to create Boot0002\r\n");
-    return EFI_LOAD_ERROR;
+  isBench = AsciiIs(scenario, 5, "bench") && ParseBench(scenario, scenarioLen, bench);
+  if (isBench) {
+    if (EFI_ERROR(BS->AllocatePool(EfiLoaderData, bench[0] * sizeof(UINT16),
+                                   (void **)&order)) ||
+        EFI_ERROR(CreateBenchEntries(deviceHandle, bench[0], bench[1], bench[2], order))) {
+      Out(L"Failed to create bench entries\r\n");
+      return EFI_OUT_OF_RESOURCES;
+    }
+    bootOrderSize = bench[0] * sizeof(UINT16);
+    OutDec(L"Created ", bench[0], L" bench entries");
+    OutDec(L", DisablePROCHOT at ", bench[1], L"");
+    OutDec(L", ChainSuccess at ", bench[2], L"\r\n");
+  } else {
+    if (EFI_ERROR(CreateBootOption(0x0002, L"DisablePROCHOT",
+                                   L"\\EFI\\BOOT\\DisablePROCHOT.efi", deviceHandle))) {
+      Out(L"Failed to create Boot0002\r\n");
+      return EFI_LOAD_ERROR;
+    }
+    Out(L"Created Boot0002 -> DisablePROCHOT.efi\r\n");
+
+    CreateBootOption(0x0000, L"StaleCurrent", L"\\EFI\\BOOT\\Missing.efi", deviceHandle);
+    Out(L"Created Boot0000 -> StaleCurrent\r\n");
+    CreateBootOption(0x0001, L"WrongTarget", L"\\EFI\\BOOT\\WrongTarget.efi", deviceHandle);
+    Out(L"Created Boot0001 -> WrongTarget.efi\r\n");
+    CreateBootOption(0x0004, L"EFI USB Device", NULL, deviceHandle);
+    Out(L"Created Boot0004 -> EFI USB Device\r\n");
+    CreateBootOption(0x0005, L"Inactive", L"\\EFI\\BOOT\\Inactive.efi", deviceHandle);
+    Out(L"Created Boot0005 -> Inactive\r\n");
+    CreateBootOption(0x0006, L"Missing", L"\\EFI\\BOOT\\Missing.efi", deviceHandle);
+    Out(L"Created Boot0006 -> Missing\r\n");
+    CreateBootOption(0x0003, L"ChainSuccess", L"\\EFI\\BOOT\\ChainSuccess.efi", deviceHandle);
+    Out(L"Created Boot0003 -> ChainSuccess.efi\r\n");
+
+    if (AsciiIs(scenario, scenarioLen, "stale-cache")) {
+      // Drop Boot0006: same target, but the cached BootOrder hash no longer holds.
+      bootOrder[1] = 0x0005;
+      bootOrder[2] = 0x0004;
+      bootOrder[3] = 0x0003;
+      bootOrder[4] = 0x0000;
+      bootOrder[5] = 0x0001;
+      bootOrderSize -= sizeof(UINT16);
+    }
   }
-  Out(L"Created Boot0002 -> DisablePROCHOT.efi\r\n");
-
-  CreateBootOption(0x0000, L"StaleCurrent", L"\\EFI\\BOOT\\Missing.efi", deviceHandle);
-  Out(L"Created Boot0000 -> StaleCurrent\r\n");
-  CreateBootOption(0x0001, L"WrongTarget", L"\\EFI\\BOOT\\WrongTarget.efi", deviceHandle);
-  Out(L"Created Boot0001 -> WrongTarget.efi\r\n");
-  CreateBootOption(0x0004, L"EFI USB Device", NULL, deviceHandle);
-  Out(L"Created Boot0004 -> EFI USB Device\r\n");
-  CreateBootOption(0x0005, L"Inactive", L"\\EFI\\BOOT\\Inactive.efi", deviceHandle);
-  Out(L"Created Boot0005 -> Inactive\r\n");
-  CreateBootOption(0x0006, L"Missing", L"\\EFI\\BOOT\\Missing.efi", deviceHandle);
-  Out(L"Created Boot0006 -> Missing\r\n");
-  CreateBootOption(0x0003, L"ChainSuccess", L"\\EFI\\BOOT\\ChainSuccess.efi", deviceHandle);
-  Out(L"Created Boot0003 -> ChainSuccess.efi\r\n");
 
   status = RT->SetVariable(L"BootOrder", &gEfiGlobalVariableGuid,
                            EFI_VARIABLE_NON_VOLATILE |
                                EFI_VARIABLE_BOOTSERVICE_ACCESS |
                                EFI_VARIABLE_RUNTIME_ACCESS,
-                           sizeof(bootOrder), bootOrder);
+                           bootOrderSize, order);
   if (EFI_ERROR(status)) {
     Out(L"Failed to set BootOrder\r\n");
     return status;
   }
-  Out(L"Set BootOrder = {0002, 0006, 0005, 0004, 0003, 0000, 0001}\r\n");
+  if (isBench)
+    Out(L"Set bench BootOrder\r\n");
+  else if (bootOrderSize == sizeof(bootOrder))
+    Out(L"Set BootOrder = {0002, 0006, 0005, 0004, 0003, 0000, 0001}\r\n");
+  else
+    Out(L"Set BootOrder = {0002, 0005, 0004, 0003, 0000, 0001} (stale-cache)\r\n");
+
+  if (AsciiIs(scenario, scenarioLen, "corrupt-cache")) {
+    UINT8 garbage[32];
+    for (UINTN i = 0; i < sizeof(garbage); i++) garbage[i] = (UINT8)(0x5A ^ i);
+    RT->SetVariable(L"DisablePROCHOTTarget", &gDisablePROCHOTVendorGuid,
+                    EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS |
+                        EFI_VARIABLE_RUNTIME_ACCESS,
+                    sizeof(garbage), garbage);
+    Out(L"Overwrote DisablePROCHOTTarget with garbage (corrupt-cache)\r\n");
+  }
+
+  if (AsciiIs(scenario, scenarioLen, "experiment")) {
+    // EXPERIMENT_CONTROL: 'DPXC', version 1, 1 round, 0 boots done.
+    UINT16 control[6] = {0x5044, 0x4358, 1, 1, 0, 0};
+    RT->SetVariable(L"DisablePROCHOTExperiment", &gDisablePROCHOTVendorGuid,
+                    EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS |
+                        EFI_VARIABLE_RUNTIME_ACCESS,
+                    sizeof(control), control);
+    Out(L"Started a one-round DisablePROCHOT experiment\r\n");
+  }
 
   RT->SetVariable(L"BootCurrent", &gEfiGlobalVariableGuid,
                   EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS,
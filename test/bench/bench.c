@@ -0,0 +1,577 @@
+// Hosted benchmark for the boot-selection path (snapshot, target cache,
+// self-identification, next-entry walk, BuildFullPath).
+//
+// DisablePROCHOT.c is compiled into this Linux binary as-is, against mock boot
+// and runtime services. The mocks keep an in-memory NVRAM, count every
+// GetVariable/SetVariable/AllocatePool/AllocatePages call and can inject a
+// per-call latency, as SPI-flash variable stores have. TryBootOrderChainload
+// then runs over generated BootOrders; LoadImage only succeeds for the
+// intended target, whose headers the candidate pre-check reads from a mock
+// Simple File System, and StartImage returns straight away.
+//
+// Usage: bench [--check] [--iterations=N] [--getvar-us=N] [--setvar-us=N]
+//              [--alloc-us=N]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../../DisablePROCHOT.c"
+
+// ---------------------------------------------------------------------------
+// Mock services
+// ---------------------------------------------------------------------------
+#define MAX_VARS 1024
+
+typedef struct {
+  CHAR16 Name[40];
+  EFI_GUID Guid;
+  UINT8 *Data;
+  UINTN Size;
+} MOCK_VAR;
+
+static MOCK_VAR gVars[MAX_VARS];
+static UINTN gVarCount;
+
+static struct {
+  UINTN GetVariable, SetVariable, AllocatePool, AllocatePages;
+} gCalls;
+
+static UINT64 gGetVarNs, gSetVarNs, gAllocNs;
+static UINT64 gMockNs;  // time spent inside the mocks, latency included
+
+static UINT64 NowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (UINT64)ts.tv_sec * 1000000000ull + (UINT64)ts.tv_nsec;
+}
+
+static void Spin(UINT64 ns) {
+  UINT64 t0 = NowNs();
+  while (NowNs() - t0 < ns) {
+  }
+}
+
+static UINTN StrLen16(const CHAR16 *s) {
+  UINTN n = 0;
+  while (s[n]) n++;
+  return n;
+}
+
+static MOCK_VAR *FindVar(const CHAR16 *name, const EFI_GUID *guid) {
+  UINTN i, n = StrLen16(name);
+  for (i = 0; i < gVarCount; ++i)
+    if (StrLen16(gVars[i].Name) == n && !memcmp(gVars[i].Name, name, n * sizeof(CHAR16)) &&
+        !memcmp(&gVars[i].Guid, guid, sizeof(*guid)))
+      return &gVars[i];
+  return NULL;
+}
+
+static void PutVar(const CHAR16 *name, const EFI_GUID *guid, const void *data, UINTN size) {
+  MOCK_VAR *v = FindVar(name, guid);
+  UINTN n = StrLen16(name);
+
+  if (!v) {
+    if (gVarCount == MAX_VARS || n >= 40) abort();
+    v = &gVars[gVarCount++];
+    memcpy(v->Name, name, (n + 1) * sizeof(CHAR16));
+    v->Guid = *guid;
+    v->Data = NULL;
+  }
+  free(v->Data);
+  v->Data = malloc(size);
+  memcpy(v->Data, data, size);
+  v->Size = size;
+}
+
+static void DeleteVar(const CHAR16 *name, const EFI_GUID *guid) {
+  MOCK_VAR *v = FindVar(name, guid);
+  if (!v) return;
+  free(v->Data);
+  *v = gVars[--gVarCount];
+}
+
+static void ResetNvram(void) {
+  while (gVarCount) free(gVars[--gVarCount].Data);
+}
+
+static EFI_STATUS EFIAPI MockGetVariable(CHAR16 *name, EFI_GUID *guid, UINT32 *attributes,
+                                         UINTN *size, VOID *data) {
+  UINT64 t0 = NowNs();
+  MOCK_VAR *v = FindVar(name, guid);
+  EFI_STATUS status = EFI_SUCCESS;
+
+  gCalls.GetVariable++;
+  Spin(gGetVarNs);
+  if (!v) {
+    status = EFI_NOT_FOUND;
+  } else if (*size < v->Size) {
+    *size = v->Size;
+    status = EFI_BUFFER_TOO_SMALL;
+  } else {
+    memcpy(data, v->Data, v->Size);
+    *size = v->Size;
+    if (attributes) *attributes = EFI_VARIABLE_BOOTSERVICE_ACCESS;
+  }
+  gMockNs += NowNs() - t0;
+  return status;
+}
+
+static EFI_STATUS EFIAPI MockSetVariable(CHAR16 *name, EFI_GUID *guid, UINT32 attributes,
+                                         UINTN size, VOID *data) {
+  UINT64 t0 = NowNs();
+  (void)attributes;
+  gCalls.SetVariable++;
+  Spin(gSetVarNs);
+  if (size) PutVar(name, guid, data, size);
+  else DeleteVar(name, guid);
+  gMockNs += NowNs() - t0;
+  return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI MockAllocatePool(EFI_MEMORY_TYPE type, UINTN size, VOID **out) {
+  UINT64 t0 = NowNs();
+  (void)type;
+  gCalls.AllocatePool++;
+  Spin(gAllocNs);
+  *out = malloc(size);
+  gMockNs += NowNs() - t0;
+  return *out ? EFI_SUCCESS : EFI_OUT_OF_RESOURCES;
+}
+
+static EFI_STATUS EFIAPI MockFreePool(VOID *p) {
+  free(p);
+  return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI MockAllocatePages(EFI_ALLOCATE_TYPE type, EFI_MEMORY_TYPE memType,
+                                           UINTN pages, EFI_PHYSICAL_ADDRESS *addr) {
+  UINT64 t0 = NowNs();
+  void *p;
+  (void)type;
+  (void)memType;
+  gCalls.AllocatePages++;
+  Spin(gAllocNs);
+  p = aligned_alloc(EFI_PAGE_SIZE, pages * EFI_PAGE_SIZE);
+  *addr = (EFI_PHYSICAL_ADDRESS)(UINTN)p;
+  gMockNs += NowNs() - t0;
+  return p ? EFI_SUCCESS : EFI_OUT_OF_RESOURCES;
+}
+
+static EFI_STATUS EFIAPI MockFreePages(EFI_PHYSICAL_ADDRESS addr, UINTN pages) {
+  (void)pages;
+  free((void *)(UINTN)addr);
+  return EFI_SUCCESS;
+}
+
+// Our image and the partition it was loaded from; the target is on a second
+// disk, which only the partition index can expand a short-form path to.
+static UINT8 gPartitionPath[128], gImageFullPath[256], gImageFilePath[128];
+static UINT8 gTargetPartitionPath[128];
+static EFI_LOADED_IMAGE gLoadedImage;
+static EFI_FILE_IO_INTERFACE gSelfFs, gTargetFs;  // Simple File System on each
+static UINT8 gImageHandle, gDeviceHandle, gTargetDeviceHandle, gNextImage;
+
+static EFI_STATUS EFIAPI MockHandleProtocol(EFI_HANDLE handle, EFI_GUID *guid, VOID **out) {
+  if (handle == &gImageHandle && !CompareMem(guid, &gEfiLoadedImageProtocolGuid, sizeof(*guid)))
+    *out = &gLoadedImage;
+  else if (handle == &gImageHandle &&
+           !CompareMem(guid, &gEfiLoadedImageDevicePathProtocolGuid, sizeof(*guid)))
+    *out = gImageFullPath;
+  else if (handle == &gDeviceHandle &&
+           !CompareMem(guid, &gEfiDevicePathProtocolGuid, sizeof(*guid)))
+    *out = gPartitionPath;
+  else if (handle == &gTargetDeviceHandle &&
+           !CompareMem(guid, &gEfiDevicePathProtocolGuid, sizeof(*guid)))
+    *out = gTargetPartitionPath;
+  else if (handle == &gDeviceHandle &&
+           !CompareMem(guid, &gEfiSimpleFileSystemProtocolGuid, sizeof(*guid)))
+    *out = &gSelfFs;
+  else if (handle == &gTargetDeviceHandle &&
+           !CompareMem(guid, &gEfiSimpleFileSystemProtocolGuid, sizeof(*guid)))
+    *out = &gTargetFs;
+  else
+    return EFI_UNSUPPORTED;
+  return EFI_SUCCESS;
+}
+
+// Two partitions: ours and the target's. The handle buffer is the firmware's
+// allocation, not counted against the app.
+static EFI_STATUS EFIAPI MockLocateHandleBuffer(EFI_LOCATE_SEARCH_TYPE type, EFI_GUID *guid,
+                                                VOID *key, UINTN *count, EFI_HANDLE **out) {
+  (void)type;
+  (void)key;
+  if (CompareMem(guid, &gEfiBlockIoProtocolGuid, sizeof(*guid))) return EFI_NOT_FOUND;
+  if (!(*out = malloc(2 * sizeof(EFI_HANDLE)))) return EFI_OUT_OF_RESOURCES;
+  (*out)[0] = &gDeviceHandle;
+  (*out)[1] = &gTargetDeviceHandle;
+  *count = 2;
+  return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI MockLocateProtocol(EFI_GUID *guid, VOID *registration, VOID **out) {
+  (void)guid;
+  (void)registration;
+  *out = NULL;
+  return EFI_NOT_FOUND;
+}
+
+static UINT8 gTargetFile[128];  // File node LoadImage accepts
+static UINTN gLoads, gStarts;
+
+// Simple File System on both partitions, for the candidate pre-check: only the
+// target's file exists, and its first bytes are an x64 EFI application's
+// DOS and PE headers.
+static EFI_FILE gSelfRoot, gTargetRoot, gTargetImage;
+static UINT8 gTargetHeaders[256];
+static UINT64 gTargetPosition;
+
+static BOOLEAN PathHasPrefix(EFI_DEVICE_PATH_PROTOCOL *path, UINT8 *prefix) {
+  UINTN n = DevicePathSize((EFI_DEVICE_PATH_PROTOCOL *)prefix) - 4;
+  return DevicePathSize(path) > n && !CompareMem(path, prefix, n);
+}
+
+static EFI_STATUS EFIAPI MockLocateDevicePath(EFI_GUID *guid, EFI_DEVICE_PATH_PROTOCOL **path,
+                                              EFI_HANDLE *device) {
+  if (CompareMem(guid, &gEfiSimpleFileSystemProtocolGuid, sizeof(*guid))) return EFI_NOT_FOUND;
+  if (PathHasPrefix(*path, gTargetPartitionPath)) {
+    *device = &gTargetDeviceHandle;
+    *path = (EFI_DEVICE_PATH_PROTOCOL *)((UINT8 *)*path +
+                                         DevicePathSize((void *)gTargetPartitionPath) - 4);
+  } else if (PathHasPrefix(*path, gPartitionPath)) {
+    *device = &gDeviceHandle;
+    *path = (EFI_DEVICE_PATH_PROTOCOL *)((UINT8 *)*path +
+                                         DevicePathSize((void *)gPartitionPath) - 4);
+  } else {
+    return EFI_NOT_FOUND;
+  }
+  return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI MockOpenVolume(EFI_FILE_IO_INTERFACE *fs, EFI_FILE_HANDLE *root) {
+  *root = fs == &gTargetFs ? &gTargetRoot : &gSelfRoot;
+  return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI MockOpen(EFI_FILE_HANDLE dir, EFI_FILE_HANDLE *out, CHAR16 *name,
+                                  UINT64 mode, UINT64 attributes) {
+  static const char kTarget[] = "\\EFI\\target\\grubx64.efi";
+  UINTN i;
+  (void)mode;
+  (void)attributes;
+  if (dir != &gTargetRoot) return EFI_NOT_FOUND;
+  for (i = 0; kTarget[i]; ++i)
+    if (name[i] != (CHAR16)kTarget[i]) return EFI_NOT_FOUND;
+  if (name[i]) return EFI_NOT_FOUND;
+  gTargetPosition = 0;
+  *out = &gTargetImage;
+  return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI MockClose(EFI_FILE_HANDLE file) {
+  (void)file;
+  return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI MockRead(EFI_FILE_HANDLE file, UINTN *size, VOID *buf) {
+  (void)file;
+  if (gTargetPosition >= sizeof(gTargetHeaders)) {
+    *size = 0;
+  } else {
+    if (*size > sizeof(gTargetHeaders) - gTargetPosition)
+      *size = sizeof(gTargetHeaders) - (UINTN)gTargetPosition;
+    memcpy(buf, gTargetHeaders + gTargetPosition, *size);
+    gTargetPosition += *size;
+  }
+  return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI MockSetPosition(EFI_FILE_HANDLE file, UINT64 position) {
+  (void)file;
+  gTargetPosition = position;
+  return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI MockLoadImage(BOOLEAN bootPolicy, EFI_HANDLE parent,
+                                       EFI_DEVICE_PATH_PROTOCOL *path, VOID *source,
+                                       UINTN sourceSize, EFI_HANDLE *image) {
+  EFI_DEVICE_PATH_PROTOCOL *file = FindFilePathNode(path);
+  (void)bootPolicy;
+  (void)parent;
+  (void)source;
+  (void)sourceSize;
+  gLoads++;
+  if (!file || CompareMem(file, gTargetFile, DevicePathNodeLength(file)) != 0 ||
+      CompareMem(path, gTargetPartitionPath, DevicePathSize(
+                     (EFI_DEVICE_PATH_PROTOCOL *)gTargetPartitionPath) - 4) != 0)
+    return EFI_NOT_FOUND;  // wrong file, or not on the target's disk
+  *image = &gNextImage;
+  return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI MockStartImage(EFI_HANDLE image, UINTN *exitSize, CHAR16 **exitData) {
+  (void)exitSize;
+  (void)exitData;
+  if (image != &gNextImage) return EFI_INVALID_PARAMETER;
+  gStarts++;
+  return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI MockStall(UINTN us) {
+  Spin((UINT64)us * 1000);
+  return EFI_SUCCESS;
+}
+
+static EFI_BOOT_SERVICES gMockBS;
+static EFI_RUNTIME_SERVICES gMockRT;
+static EFI_SYSTEM_TABLE gMockST;
+
+static void InstallMocks(void) {
+  gMockBS.AllocatePages = MockAllocatePages;
+  gMockBS.FreePages = MockFreePages;
+  gMockBS.AllocatePool = MockAllocatePool;
+  gMockBS.FreePool = MockFreePool;
+  gMockBS.HandleProtocol = MockHandleProtocol;
+  gMockBS.LocateHandleBuffer = MockLocateHandleBuffer;
+  gMockBS.LocateProtocol = MockLocateProtocol;
+  gMockBS.LocateDevicePath = MockLocateDevicePath;
+  gMockBS.LoadImage = MockLoadImage;
+  gMockBS.StartImage = MockStartImage;
+  gMockBS.Stall = MockStall;
+  gMockRT.GetVariable = MockGetVariable;
+  gMockRT.SetVariable = MockSetVariable;
+  gSelfFs.OpenVolume = gTargetFs.OpenVolume = MockOpenVolume;
+  gSelfRoot.Open = gTargetRoot.Open = MockOpen;
+  gSelfRoot.Close = gTargetRoot.Close = gTargetImage.Close = MockClose;
+  gTargetImage.Read = MockRead;
+  gTargetImage.SetPosition = MockSetPosition;
+  gTargetHeaders[0] = 'M';  // e_magic
+  gTargetHeaders[1] = 'Z';
+  gTargetHeaders[0x3C] = 0x80;  // e_lfanew
+  memcpy(gTargetHeaders + 0x80, "PE\0\0\x64\x86", 6);  // signature, machine x64
+  gTargetHeaders[0x80 + 24] = 0x0B;  // PE32+
+  gTargetHeaders[0x80 + 25] = 0x02;
+  gTargetHeaders[0x80 + 92] = 10;  // EFI application
+  gMockST.BootServices = &gMockBS;
+  gMockST.RuntimeServices = &gMockRT;
+  ST = &gMockST;
+  BS = &gMockBS;
+  RT = &gMockRT;
+  IM = &gImageHandle;
+}
+
+// ---------------------------------------------------------------------------
+// Generated boot configurations
+// ---------------------------------------------------------------------------
+static UINTN AppendNode(UINT8 *p, UINT8 type, UINT8 subType, const void *payload, UINTN len) {
+  p[0] = type;
+  p[1] = subType;
+  p[2] = (UINT8)(4 + len);
+  p[3] = (UINT8)((4 + len) >> 8);
+  if (len) memcpy(p + 4, payload, len);
+  return 4 + len;
+}
+
+static UINTN AppendEnd(UINT8 *p) { return AppendNode(p, 0x7F, 0xFF, NULL, 0); }
+
+// HD(1,GPT,<sig>) payload: partition number, start, size, signature, format, type.
+static UINTN AppendHd(UINT8 *p, UINT8 sig) {
+  UINT8 hd[38] = {1};
+  memset(hd + 20, sig, 16);
+  hd[36] = 2;  // GPT
+  hd[37] = 2;  // GUID signature
+  return AppendNode(p, MEDIA_DEVICE_PATH, 0x01, hd, sizeof(hd));
+}
+
+static UINTN AppendFile(UINT8 *p, const char *path) {
+  CHAR16 wide[64];
+  UINTN n = strlen(path), i;
+  for (i = 0; i <= n; ++i) wide[i] = (CHAR16)path[i];
+  return AppendNode(p, MEDIA_DEVICE_PATH, MEDIA_FILEPATH_DP, wide, (n + 1) * sizeof(CHAR16));
+}
+
+enum { ENTRY_SELF, ENTRY_TARGET, ENTRY_OTHER, ENTRY_INVALID, ENTRY_INACTIVE, ENTRY_MISSING };
+
+// Boot#### as firmware stores it: short-form HD()/File path.
+static void PutBootOption(UINT16 id, int kind) {
+  UINT8 buf[512];
+  EFI_LOAD_OPTION_HEADER *h = (EFI_LOAD_OPTION_HEADER *)buf;
+  CHAR16 name[9];
+  char file[64];
+  UINTN n = sizeof(*h), pathStart, fileStart;
+
+  if (kind == ENTRY_MISSING) return;
+  snprintf(file, sizeof(file), kind == ENTRY_SELF     ? "\\EFI\\BOOT\\DisablePROCHOT.efi"
+                               : kind == ENTRY_TARGET ? "\\EFI\\target\\grubx64.efi"
+                                                      : "\\EFI\\other\\%04X.efi",
+           id);
+  buf[n] = 'x';  // description "x"
+  buf[n + 1] = 0;
+  buf[n + 2] = buf[n + 3] = 0;
+  n += 4;
+  pathStart = n;
+  n += AppendHd(buf + n, kind == ENTRY_TARGET ? 0x5A : 0xA5);
+  fileStart = n;
+  n += AppendFile(buf + n, file);
+  if (kind == ENTRY_TARGET) memcpy(gTargetFile, buf + fileStart, n - fileStart);
+  n += AppendEnd(buf + n);
+  h->Attributes = kind == ENTRY_INACTIVE ? 0 : LOAD_OPTION_ACTIVE;
+  h->FilePathListLength = (UINT16)(n - pathStart);
+  if (kind == ENTRY_INVALID) h->FilePathListLength = (UINT16)(n - pathStart + 64);  // overruns
+
+  MakeBootVarName(id, name);
+  PutVar(name, &gEfiGlobalVariableGuid, buf, n);
+}
+
+typedef struct {
+  UINTN Count;  // BootOrder length
+  UINTN Self;   // our slot
+  UINTN Bad;    // invalid/inactive/missing entries between us and the target
+} SCENARIO;
+
+// Self at its slot, Bad unusable entries right after it (wrapping), then the
+// target, then loadable entries that are never reached.
+static void BuildScenario(const SCENARIO *sc) {
+  static const int kBad[] = {ENTRY_INVALID, ENTRY_INACTIVE, ENTRY_MISSING};
+  UINT16 order[512];
+  UINTN d, n = 0;
+
+  ResetNvram();
+  memset(gTargetFile, 0, sizeof(gTargetFile));
+  for (d = 0; d < sc->Count; ++d) {
+    UINTN slot = (sc->Self + d) % sc->Count;
+    int kind = d == 0              ? ENTRY_SELF
+               : d <= sc->Bad      ? kBad[(d - 1) % 3]
+               : d == sc->Bad + 1  ? ENTRY_TARGET
+                                   : ENTRY_OTHER;
+    order[slot] = (UINT16)(0x100 + slot);
+    PutBootOption(order[slot], kind);
+  }
+  PutVar(L"BootOrder", &gEfiGlobalVariableGuid, order, sc->Count * sizeof(UINT16));
+
+  n += AppendNode(gPartitionPath, ACPI_DEVICE_PATH, 0x01, "\xD0\x41\x03\x0A\0\0\0\0", 8);
+  n += AppendNode(gPartitionPath + n, HARDWARE_DEVICE_PATH, 0x01, "\x00\x1F", 2);
+  n += AppendHd(gPartitionPath + n, 0xA5);
+  AppendEnd(gPartitionPath + n);
+  d = AppendNode(gTargetPartitionPath, ACPI_DEVICE_PATH, 0x01, "\xD0\x41\x03\x0A\0\0\0\0", 8);
+  d += AppendNode(gTargetPartitionPath + d, HARDWARE_DEVICE_PATH, 0x01, "\x00\x1D", 2);
+  d += AppendHd(gTargetPartitionPath + d, 0x5A);
+  AppendEnd(gTargetPartitionPath + d);
+  memcpy(gImageFullPath, gPartitionPath, n);
+  d = AppendFile(gImageFullPath + n, "\\EFI\\BOOT\\DisablePROCHOT.efi");
+  AppendEnd(gImageFullPath + n + d);
+  AppendEnd(gImageFilePath + AppendFile(gImageFilePath, "\\EFI\\BOOT\\DisablePROCHOT.efi"));
+  gLoadedImage.DeviceHandle = &gDeviceHandle;
+  gLoadedImage.FilePath = (EFI_DEVICE_PATH_PROTOCOL *)gImageFilePath;
+}
+
+// ---------------------------------------------------------------------------
+// Runs
+// ---------------------------------------------------------------------------
+typedef struct {
+  UINTN GetVariable, SetVariable, AllocatePool, AllocatePages;
+  double TotalUs, AppUs;  // per run; AppUs excludes time inside the mocks
+  BOOLEAN Correct;
+} RESULT;
+
+static RESULT Run(const SCENARIO *sc, BOOLEAN warm, UINTN iterations) {
+  BOOLEAN haveTarget = sc->Count > 1 && sc->Bad + 1 < sc->Count;
+  RESULT r = {0};
+  UINT64 total = 0, mock = 0;
+  UINTN it;
+
+  r.Correct = TRUE;
+  for (it = 0; it < iterations; ++it) {
+    EFI_STATUS status;
+    UINT64 t0;
+
+    if (!warm) DeleteVar(L"DisablePROCHOTTarget", &gDisablePROCHOTVendorGuid);
+    memset(&gCalls, 0, sizeof(gCalls));
+    gLoads = gStarts = 0;
+    gMockNs = 0;
+    t0 = NowNs();
+    status = TryBootOrderChainload();
+    total += NowNs() - t0;
+    mock += gMockNs;
+    if (haveTarget ? EFI_ERROR(status) || gStarts != 1 : status != EFI_NOT_FOUND)
+      r.Correct = FALSE;
+  }
+  r.GetVariable = gCalls.GetVariable;
+  r.SetVariable = gCalls.SetVariable;
+  r.AllocatePool = gCalls.AllocatePool;
+  r.AllocatePages = gCalls.AllocatePages;
+  r.TotalUs = (double)total / 1000.0 / (double)iterations;
+  r.AppUs = (double)(total - mock) / 1000.0 / (double)iterations;
+  return r;
+}
+
+// Call budget the selection path must stay within: one GetVariable per
+// variable it needs (BootOrder, the cache, the entries up to and including us,
+// the ones from us to the target, BootCurrent), plus one retry per arena
+// growth; a single pool allocation (BuildFullPath); one cache write when cold.
+static BOOLEAN WithinBudget(const SCENARIO *sc, BOOLEAN warm, const RESULT *r) {
+  UINTN growths = r->AllocatePages ? r->AllocatePages - 1 : 0;
+  UINTN reads = warm ? 3 : 3 + (sc->Self + 1) + (sc->Bad + 1);
+  return r->GetVariable <= reads + growths && r->AllocatePool <= 1 &&
+         r->SetVariable <= (warm ? 1u : 2u);
+}
+
+static UINTN ParseOpt(const char *arg, const char *name, UINTN *out) {
+  UINTN n = strlen(name);
+  if (strncmp(arg, name, n) != 0 || arg[n] != '=') return 0;
+  *out = (UINTN)strtoull(arg + n + 1, NULL, 10);
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  static const UINTN kCounts[] = {1, 2, 5, 10, 20, 50, 100, 200, 500};
+  static const UINTN kBad[] = {0, 1, 10, 100};
+  UINTN iterations = 20, getUs = 0, setUs = 0, allocUs = 0, c, p, b, failures = 0;
+  BOOLEAN check = FALSE;
+  int i;
+
+  for (i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--check")) check = TRUE;
+    else if (!ParseOpt(argv[i], "--iterations", &iterations) &&
+             !ParseOpt(argv[i], "--getvar-us", &getUs) &&
+             !ParseOpt(argv[i], "--setvar-us", &setUs) &&
+             !ParseOpt(argv[i], "--alloc-us", &allocUs)) {
+      fprintf(stderr, "usage: %s [--check] [--iterations=N] [--getvar-us=N] "
+                      "[--setvar-us=N] [--alloc-us=N]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (!iterations) iterations = 1;
+  gGetVarNs = getUs * 1000;
+  gSetVarNs = setUs * 1000;
+  gAllocNs = allocUs * 1000;
+  InstallMocks();
+
+  printf("%-5s %-4s %-4s %-5s %6s %6s %5s %6s %10s %10s\n", "count", "self", "bad", "cache",
+         "getvar", "setvar", "pool", "pages", "total_us", "app_us");
+  for (c = 0; c < sizeof(kCounts) / sizeof(kCounts[0]); ++c) {
+    UINTN count = kCounts[c];
+    UINTN selves[3] = {0, count / 2, count - 1};
+    for (p = 0; p < 3; ++p) {
+      if (p && selves[p] == selves[p - 1]) continue;
+      for (b = 0; b < sizeof(kBad) / sizeof(kBad[0]); ++b) {
+        SCENARIO sc = {count, selves[p], kBad[b]};
+        int warm;
+        if (b && kBad[b] + 2 > count) continue;
+        BuildScenario(&sc);
+        for (warm = 0; warm < 2; ++warm) {
+          RESULT r = Run(&sc, (BOOLEAN)warm, iterations);
+          BOOLEAN ok = r.Correct && (!check || WithinBudget(&sc, (BOOLEAN)warm, &r));
+          printf("%-5zu %-4zu %-4zu %-5s %6zu %6zu %5zu %6zu %10.1f %10.1f%s\n", count,
+                 sc.Self, sc.Bad, warm ? "warm" : "cold", r.GetVariable, r.SetVariable,
+                 r.AllocatePool, r.AllocatePages, r.TotalUs, r.AppUs,
+                 ok ? "" : r.Correct ? "  OVER BUDGET" : "  WRONG TARGET");
+          if (!ok) failures++;
+        }
+      }
+    }
+  }
+  ResetNvram();
+  if (failures) fprintf(stderr, "%zu runs failed\n", failures);
+  return failures ? 1 : 0;
+}
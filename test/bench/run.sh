@@ -0,0 +1,26 @@
+#!/bin/bash
+set -euo pipefail
+
+# Hosted benchmark of the boot-selection path: builds test/bench/bench.c (which
+# includes DisablePROCHOT.c) as a normal Linux binary against mock firmware
+# services and runs the sweep. Extra arguments go to the binary, e.g.
+#   ./test/bench/run.sh --getvar-us=50 --setvar-us=500
+# Without arguments it runs in --check mode, failing on a wrong target or a
+# call count over budget.
+
+ROOT_DIR="$(cd -- "$(dirname -- "${BASH_SOURCE[0]}")/../.." && pwd)"
+TMP_DIR="${ROOT_DIR}/test/tmp"
+mkdir -p "${TMP_DIR}"
+
+# Same GNU-EFI type headers and MS-ABI as build.sh, but hosted: libc, -O2.
+# Unused-function warnings are expected: only the selection path is driven.
+cc -std=gnu17 -O2 -fshort-wchar \
+	-isystem /usr/include/efi -isystem /usr/include/efi/x86_64 \
+	-DHAVE_USE_MS_ABI -Dx86_64 -DSILENT \
+	-Wall -Wextra -Wno-unused-function -Werror \
+	-o "${TMP_DIR}/bench" "${ROOT_DIR}/test/bench/bench.c"
+
+if [ "$#" -eq 0 ]; then
+	set -- --check
+fi
+"${TMP_DIR}/bench" "$@"
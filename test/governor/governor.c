@@ -0,0 +1,171 @@
+// Hosted test: resident mode and the thermal governor on the same MSR.
+//
+// DisablePROCHOT.c is compiled in with -DMOCK_MSR against a small MSR table
+// and a CPU with a digital thermal sensor and no HWP. The policy keeps
+// IA32_PERF_CTL at ratio 0x20 (as "set fix_min_ratio=on" would) next to the
+// 0x1FC unlock; both timers are then ticked by hand. A throttle must survive
+// resident mode's next tick, while 0x1FC is still kept.
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../../DisablePROCHOT.c"
+
+static struct {
+  uint32_t Index;
+  uint64_t Value;
+} gMsrs[16];
+static UINTN gMsrCount;
+
+static uint64_t *MockMsr(uint32_t index) {
+  UINTN i;
+  for (i = 0; i < gMsrCount; ++i)
+    if (gMsrs[i].Index == index) return &gMsrs[i].Value;
+  if (gMsrCount == sizeof(gMsrs) / sizeof(gMsrs[0])) abort();
+  gMsrs[gMsrCount].Index = index;
+  gMsrs[gMsrCount].Value = 0;
+  return &gMsrs[gMsrCount++].Value;
+}
+
+static uint64_t AsmWriteMsr64(uint32_t index, uint64_t val) { return *MockMsr(index) = val; }
+static uint64_t AsmReadMsr64(uint32_t index) { return *MockMsr(index); }
+
+// Family 6 model 0x8C, leaf 6 with DTS only.
+static void AsmCpuid(uint32_t leaf, uint32_t subleaf, uint32_t r[4]) {
+  (void)subleaf;
+  r[0] = r[1] = r[2] = r[3] = 0;
+  if (leaf == 0) r[0] = 6;
+  if (leaf == 1) r[0] = 0x806C1;
+  if (leaf == 6) r[0] = CPUID6_DTS;
+}
+
+static int gEvent;
+
+static EFI_STATUS EFIAPI MockCreateEvent(UINT32 type, EFI_TPL tpl, EFI_EVENT_NOTIFY fn,
+                                         VOID *ctx, EFI_EVENT *event) {
+  (void)type;
+  (void)tpl;
+  (void)fn;
+  (void)ctx;
+  *event = &gEvent;
+  return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI MockSetTimer(EFI_EVENT event, EFI_TIMER_DELAY type, UINT64 time) {
+  (void)event;
+  (void)type;
+  (void)time;
+  return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI MockCloseEvent(EFI_EVENT event) {
+  (void)event;
+  return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI MockSetVariable(CHAR16 *name, EFI_GUID *guid, UINT32 attributes,
+                                         UINTN size, VOID *data) {
+  (void)name;
+  (void)guid;
+  (void)attributes;
+  (void)size;
+  (void)data;
+  return EFI_SUCCESS;
+}
+
+// No MP Services: resident mode dispatches on the BSP alone.
+static EFI_STATUS EFIAPI MockLocateProtocol(EFI_GUID *guid, VOID *registration, VOID **out) {
+  (void)guid;
+  (void)registration;
+  *out = NULL;
+  return EFI_NOT_FOUND;
+}
+
+static EFI_BOOT_SERVICES gMockBS;
+static EFI_RUNTIME_SERVICES gMockRT;
+static EFI_SYSTEM_TABLE gMockST;
+static int gFailures;
+
+static void Expect(const char *what, uint32_t msr, uint64_t want) {
+  uint64_t got = *MockMsr(msr);
+  if (got == want) return;
+  fprintf(stderr, "%s: MSR 0x%X = 0x%llX, expected 0x%llX\n", what, msr,
+          (unsigned long long)got, (unsigned long long)want);
+  gFailures++;
+}
+
+// Core temperature as TjMax (100 C) minus the readout, valid bit set.
+static void SetTemperature(UINT8 c) {
+  *MockMsr(MSR_THERM_STATUS) = THERM_READOUT_VALID | (uint64_t)(100 - c) << 16;
+}
+
+int main(void) {
+  gMockBS.CreateEvent = MockCreateEvent;
+  gMockBS.SetTimer = MockSetTimer;
+  gMockBS.CloseEvent = MockCloseEvent;
+  gMockBS.LocateProtocol = MockLocateProtocol;
+  gMockRT.SetVariable = MockSetVariable;
+  gMockST.BootServices = &gMockBS;
+  gMockST.RuntimeServices = &gMockRT;
+  ST = &gMockST;
+  BS = &gMockBS;
+  RT = &gMockRT;
+
+  gPolicy[1] = (POLICY_ENTRY){MSR_PERF_CTL, SCOPE_THREAD, LOCK_NONE, MATCH_ANY, MATCH_ANY,
+                              PERF_CTL_RATIO_MASK, 0x2000};
+  gPolicyCount = 2;
+  *MockMsr(MSR_POWER_CTL) = POWER_CTL_VR_THERM_ALERT_DISABLE;  // as applied
+  *MockMsr(MSR_PERF_CTL) = 0x2000;
+  *MockMsr(MSR_TEMPERATURE_TARGET) = 100ULL << 16;
+  SetTemperature(60);
+  gSettings.Resident = TRUE;
+  gSettings.ResidentIntervalMs = 10;
+  gSettings.Governor = TRUE;
+  gSettings.GovernorIntervalMs = 10;
+
+  StartResident();
+  StartGovernor();
+  if (gResident.Watch != 1 || gResident.Dispatch.Watch != 1 || gResident.Rec.Cpus != 1 ||
+      gGovernor.Msr != MSR_PERF_CTL) {
+    fprintf(stderr, "governor did not take PERF_CTL from resident mode (watch 0x%X)\n",
+            gResident.Watch);
+    gFailures++;
+  }
+
+  // Hot: throttled to ratio 8, and the resident tick must leave it there
+  // while it still puts back a re-asserted BD PROCHOT.
+  SetTemperature(97);
+  GovernorTick(NULL, NULL);
+  Expect("throttled", MSR_PERF_CTL, 0x0800);
+  *MockMsr(MSR_POWER_CTL) = POWER_CTL_VR_THERM_ALERT_DISABLE | POWER_CTL_BD_PROCHOT;
+  ResidentTick(NULL, NULL);
+  Expect("resident tick while throttled", MSR_PERF_CTL, 0x0800);
+  Expect("resident tick while throttled", MSR_POWER_CTL, POWER_CTL_VR_THERM_ALERT_DISABLE);
+
+  // Cooled down: the policy ratio comes back.
+  SetTemperature(80);
+  GovernorTick(NULL, NULL);
+  Expect("released", MSR_PERF_CTL, 0x2000);
+
+  // A request already below the governor ratio is never raised to it.
+  *MockMsr(MSR_PERF_CTL) = 0x0600;
+  SetTemperature(97);
+  GovernorTick(NULL, NULL);
+  Expect("throttled below ratio", MSR_PERF_CTL, 0x0600);
+  SetTemperature(80);
+  GovernorTick(NULL, NULL);
+  Expect("released below ratio", MSR_PERF_CTL, 0x0600);
+  *MockMsr(MSR_PERF_CTL) = 0x2000;
+
+  // Hot again at ExitBootServices: both passes run, the OS gets the policy ratio.
+  SetTemperature(99);
+  GovernorTick(NULL, NULL);
+  ResidentExitBootServices(NULL, NULL);
+  GovernorExitBootServices(NULL, NULL);
+  Expect("ExitBootServices", MSR_PERF_CTL, 0x2000);
+
+  StopResident();
+  StopGovernor();
+  if (gFailures) return 1;
+  printf("governor tests passed\n");
+  return 0;
+}
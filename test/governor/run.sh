@@ -0,0 +1,18 @@
+#!/bin/bash
+set -euo pipefail
+
+# Resident mode and the thermal governor together, hosted: test/governor/
+# governor.c includes DisablePROCHOT.c built with -DMOCK_MSR, so MSRs and CPUID
+# come from a table and the timers are ticked by hand. No VM, no hardware.
+
+ROOT_DIR="$(cd -- "$(dirname -- "${BASH_SOURCE[0]}")/../.." && pwd)"
+TMP_DIR="${ROOT_DIR}/test/tmp"
+mkdir -p "${TMP_DIR}"
+
+# Same flags as the hosted benchmark, plus the MSR seam.
+cc -std=gnu17 -O2 -fshort-wchar \
+	-isystem /usr/include/efi -isystem /usr/include/efi/x86_64 \
+	-DHAVE_USE_MS_ABI -Dx86_64 -DSILENT -DMOCK_MSR \
+	-Wall -Wextra -Wno-unused-function -Werror \
+	-o "${TMP_DIR}/governor" "${ROOT_DIR}/test/governor/governor.c"
+"${TMP_DIR}/governor"
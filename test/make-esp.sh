@@ -4,6 +4,7 @@ set -euo pipefail
 ROOT_DIR="$(cd -- "$(dirname -- "${BASH_SOURCE[0]}")/.." && pwd)"
 ESP_IMG="${ROOT_DIR}/test/esp.img"
 EFI_DISABLE="${ROOT_DIR}/DisablePROCHOT.efi"
+EFI_DRIVER="${ROOT_DIR}/DisablePROCHOTDxe.efi"
 EFI_CHAIN="${ROOT_DIR}/test/ChainSuccess.efi"
 EFI_WRONG="${ROOT_DIR}/test/WrongTarget.efi"
 EFI_SETBOOT="${ROOT_DIR}/test/SetBootOrder.efi"
@@ -20,7 +21,7 @@ need mkfs.vfat
 need mcopy
 need mmd
 
-if [ ! -f "${EFI_DISABLE}" ] || [ ! -f "${EFI_CHAIN}" ] || [ ! -f "${EFI_WRONG}" ] || [ ! -f "${EFI_SETBOOT}" ]; then
+if [ ! -f "${EFI_DISABLE}" ] || [ ! -f "${EFI_DRIVER}" ] || [ ! -f "${EFI_CHAIN}" ] || [ ! -f "${EFI_WRONG}" ] || [ ! -f "${EFI_SETBOOT}" ]; then
 	echo "Missing EFI binaries. Run ./build.sh first." >&2
 	exit 1
 fi
@@ -38,3 +39,6 @@ MTOOLS_SKIP_CHECK=1 mcopy -i "${ESP_IMG}" "${EFI_SETBOOT}" ::/EFI/BOOT/BOOTX64.E
 MTOOLS_SKIP_CHECK=1 mcopy -i "${ESP_IMG}" "${EFI_DISABLE}" ::/EFI/BOOT/DisablePROCHOT.efi
 MTOOLS_SKIP_CHECK=1 mcopy -i "${ESP_IMG}" "${EFI_CHAIN}" ::/EFI/BOOT/ChainSuccess.efi
 MTOOLS_SKIP_CHECK=1 mcopy -i "${ESP_IMG}" "${EFI_WRONG}" ::/EFI/BOOT/WrongTarget.efi
+
+# DisablePROCHOTDxe.efi is only loaded by the driver scenario, as Driver0000
+MTOOLS_SKIP_CHECK=1 mcopy -i "${ESP_IMG}" "${EFI_DRIVER}" ::/EFI/BOOT/DisablePROCHOTDxe.efi
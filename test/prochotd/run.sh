@@ -0,0 +1,99 @@
+#!/bin/bash
+set -euo pipefail
+
+# prochotd against a fake /dev/cpu: four sparse files stand in for the CPUs'
+# msr devices (pread/pwrite at the MSR index) and a hand-built
+# DisablePROCHOTPolicy record, efivarfs attribute word included, stands in
+# for the variable. No root, no msr module, no hardware.
+
+ROOT_DIR="$(cd -- "$(dirname -- "${BASH_SOURCE[0]}")/../.." && pwd)"
+TMP_DIR="${ROOT_DIR}/test/tmp/prochotd"
+rm -rf "${TMP_DIR}"
+mkdir -p "${TMP_DIR}"
+
+BIN="${TMP_DIR}/prochotd"
+cc -std=gnu17 -O2 -Wall -Wextra -Werror -o "${BIN}" "${ROOT_DIR}/linux/prochotd.c"
+
+MSR_DIR="${TMP_DIR}/cpu"
+POLICY="${TMP_DIR}/DisablePROCHOTPolicy"
+
+le() {  # le <bytes> <value>: little-endian bytes as printf escapes
+	local i v=$2
+	for ((i = 0; i < $1; i++)); do
+		printf '\\x%02x' $((v & 0xFF))
+		v=$((v >> 8))
+	done
+}
+
+# entry <msr> <lock bit> <status> <mask> <value>, scope package, counts zero.
+entry() {
+	printf '%s' "$(le 4 "$1")$(le 1 8)$(le 1 "$2")$(le 1 "$3")$(le 1 0)$(le 8 "$4")$(le 8 "$5")$(le 20 0)"
+}
+
+set_msr() {  # set_msr <cpu> <msr> <value>
+	printf "$(le 8 "$3")" | dd of="${MSR_DIR}/$1/msr" bs=1 seek=$(($2)) conv=notrunc status=none
+}
+
+get_msr() {  # get_msr <cpu> <msr> -> 0x%016x
+	printf '0x%016x\n' "0x$(od -An -tx8 -j $(($2)) -N8 "${MSR_DIR}/$1/msr" | tr -d ' ')"
+}
+
+expect_msr() {  # expect_msr <cpu> <msr> <value>
+	local got
+	got=$(get_msr "$1" "$2")
+	if [ "${got}" != "$(printf '0x%016x' "$3")" ]; then
+		echo "CPU $1 MSR $2: ${got}, expected $3" >&2
+		exit 1
+	fi
+}
+
+for cpu in 0 1 2 3; do
+	mkdir -p "${MSR_DIR}/${cpu}"
+	truncate -s 4096 "${MSR_DIR}/${cpu}/msr"
+	set_msr "${cpu}" 0x1FC 0x1  # firmware state: BD PROCHOT on
+done
+set_msr 2 0xE2 0x8000  # package C-state control locked on CPU 2
+
+# Header: 'DPPL', version 2, 3 entries, from a profile, 4/4 CPUs, no S3 replay.
+# Entries: the unlock (applied), 0xE2 limit (applied, lock bit 15) and 0x610
+# (skipped at boot, so never touched here).
+printf "$(le 4 7)$(le 4 0x4C505044)$(le 2 2)$(le 1 3)$(le 1 1)$(le 4 4)$(le 4 4)$(le 4 0)" >"${POLICY}"
+printf "$(entry 0x1FC 0xFF 0x02 0x1000001 0x1000000)" >>"${POLICY}"
+printf "$(entry 0xE2 15 0x02 0xF 0x1)" >>"${POLICY}"
+printf "$(entry 0x610 63 0x01 0x7FFF 0x118)" >>"${POLICY}"
+
+log="${TMP_DIR}/once.log"
+"${BIN}" --once --policy="${POLICY}" --msr-dir="${MSR_DIR}" | tee "${log}"
+grep -q "prochotd: 2 entries on 4 CPUs" "${log}"
+grep -q "prochotd: start: rewrote 7 MSRs in [0-9]* us, 1 locked" "${log}"
+for cpu in 0 1 2 3; do
+	expect_msr "${cpu}" 0x1FC 0x1000000
+	expect_msr "${cpu}" 0x610 0
+done
+expect_msr 0 0xE2 0x1
+expect_msr 2 0xE2 0x8000
+
+# Daemon: a clamp put back at runtime is undone by the periodic check, a
+# limit reason turning active is logged, SIGUSR1 re-applies at once.
+log="${TMP_DIR}/daemon.log"
+"${BIN}" --interval-ms=20 --policy="${POLICY}" --msr-dir="${MSR_DIR}" >"${log}" &
+pid=$!
+trap 'kill "${pid}" 2>/dev/null || true' EXIT
+sleep 0.2
+set_msr 1 0x1FC 0x1000001
+set_msr 3 0x64F 0x1
+sleep 0.3
+expect_msr 1 0x1FC 0x1000000
+set_msr 0 0x1FC 0x1
+kill -USR1 "${pid}"
+sleep 0.1
+expect_msr 0 0x1FC 0x1000000
+kill "${pid}"
+wait "${pid}"
+trap - EXIT
+cat "${log}"
+grep -q "prochotd: clamp re-asserted: rewrote 1 MSRs" "${log}"
+grep -q "prochotd: CPU 3 limit reasons 0x0001 PROCHOT" "${log}"
+grep -q "prochotd: \(signal\|clamp re-asserted\): rewrote 1 MSRs" "${log}"
+
+echo "prochotd tests passed"
@@ -32,18 +32,38 @@ if [ ! -f "${OVMF_VARS}" ]; then
 	exit 1
 fi
 
-cp -f "${OVMF_VARS}" "${VARS_COPY}"
-
-env TMPDIR="${TMP_DIR}" timeout 30s qemu-system-x86_64 \
-	-machine q35,accel=kvm:tcg \
-	-m 256 \
-	-drive if=pflash,format=raw,readonly=on,file="${OVMF_CODE}" \
-	-drive if=pflash,format=raw,file="${VARS_COPY}" \
-	-device qemu-xhci,id=xhci \
-	-drive if=none,id=esp,format=raw,file="${ESP_IMG}" \
-	-device usb-storage,bus=xhci.0,drive=esp,removable=on,bootindex=1 \
-	-nographic \
-	-no-reboot 2>&1 | tee "${LOG_FILE}"
+# fresh_vars: start the next boot from pristine NVRAM.
+fresh_vars() {
+	cp -f "${OVMF_VARS}" "${VARS_COPY}"
+}
+
+# set_scenario [name]: the SetBootOrder.efi variant for the next boot (none = default).
+set_scenario() {
+	MTOOLS_SKIP_CHECK=1 mdel -i "${ESP_IMG}" ::/EFI/BOOT/SCENARIO 2>/dev/null || true
+	if [ -n "${1:-}" ]; then
+		printf '%s\n' "$1" > "${TMP_DIR}/SCENARIO"
+		MTOOLS_SKIP_CHECK=1 mcopy -i "${ESP_IMG}" "${TMP_DIR}/SCENARIO" ::/EFI/BOOT/SCENARIO
+	fi
+}
+
+# run_qemu <log> [extra qemu args...]: boot the ESP on the current vars copy.
+run_qemu() {
+	local log="$1"
+	shift
+	env TMPDIR="${TMP_DIR}" timeout 30s qemu-system-x86_64 \
+		-machine q35,accel=kvm:tcg \
+		-m 256 \
+		-drive if=pflash,format=raw,readonly=on,file="${OVMF_CODE}" \
+		-drive if=pflash,format=raw,file="${VARS_COPY}" \
+		-device qemu-xhci,id=xhci \
+		-drive if=none,id=esp,format=raw,file="${ESP_IMG}" \
+		-device usb-storage,bus=xhci.0,drive=esp,removable=on,bootindex=1 \
+		-nographic \
+		-no-reboot "$@" 2>&1 | tee "${log}"
+}
+
+fresh_vars
+run_qemu "${LOG_FILE}"
 
 grep -q "Created Boot0004 -> EFI USB Device" "${LOG_FILE}"
 grep -q "Created Boot0005 -> Inactive" "${LOG_FILE}"
@@ -51,3 +71,216 @@ grep -q "Created Boot0006 -> Missing" "${LOG_FILE}"
 grep -q "BootCurrent = 0000 (stale test value)" "${LOG_FILE}"
 ! grep -q "Wrong chainload target" "${LOG_FILE}"
 grep -q "Chainload successful" "${LOG_FILE}"
+grep -q "Timing record OK" "${LOG_FILE}"
+grep -q "DisablePROCHOT log:" "${LOG_FILE}"
+grep -q "^\[[0-9]* us\] I Chainloading next boot entry" "${LOG_FILE}"
+grep -q "^\[[0-9]* us\] W Boot0006 skipped: file not found" "${LOG_FILE}"
+grep -q "Image file path OK" "${LOG_FILE}"
+grep -q "Target cache miss" "${LOG_FILE}"
+grep -q "Target cache updated" "${LOG_FILE}"
+grep -q "Capability cache miss" "${LOG_FILE}"
+grep -q "Capability cache updated, [0-9]* MSRs" "${LOG_FILE}"
+
+# Resolved-target cache, on the NVRAM the boot above left behind:
+# unchanged BootOrder -> hit (and no rewrite, nor of the capability cache);
+# changed BootOrder -> stale; garbage in the variable -> corrupt. The last two
+# must rebuild the cache.
+log="${TMP_DIR}/qemu-cache-hit.log"
+run_qemu "${log}"
+grep -q "Target cache hit" "${log}"
+! grep -q "Target cache updated" "${log}"
+grep -q "Capability cache hit, [0-9]* MSRs" "${log}"
+! grep -q "Capability cache updated" "${log}"
+grep -q "Target prefetched, [0-9]* KiB" "${log}"
+grep -q "Image file path OK" "${log}"
+grep -q "Chainload successful" "${log}"
+
+for scenario in stale corrupt; do
+	log="${TMP_DIR}/qemu-cache-${scenario}.log"
+	set_scenario "${scenario}-cache"
+	run_qemu "${log}"
+	grep -q "Target cache ${scenario}" "${log}"
+	grep -q "Target cache updated" "${log}"
+	! grep -q "Wrong chainload target" "${log}"
+	grep -q "Chainload successful" "${log}"
+done
+set_scenario
+
+# Driver#### build: the first boot registers Driver0000 and resets; on the
+# second, BDS loads the driver before any boot option and SetBootOrder starts
+# ChainSuccess directly. Whether the driver's output reaches the serial console
+# depends on when BDS connects it, so its timing record is what's checked.
+fresh_vars
+set_scenario driver
+log="${TMP_DIR}/qemu-driver-setup.log"
+run_qemu "${log}"
+grep -q "Created Driver0000 -> DisablePROCHOTDxe.efi" "${log}"
+log="${TMP_DIR}/qemu-driver.log"
+run_qemu "${log}"
+grep -q "DisablePROCHOT driver ran before boot options" "${log}"
+grep -q "Timing record OK (driver)" "${log}"
+grep -q "Chainload successful" "${log}"
+set_scenario
+
+# A/B experiment, one round: SetBootOrder writes the control variable, the
+# first boot is the baseline (no policy), the second applies the policy and
+# ends the experiment; a third boot is back to normal.
+fresh_vars
+set_scenario experiment
+log="${TMP_DIR}/qemu-experiment-baseline.log"
+run_qemu "${log}"
+grep -q "Started a one-round DisablePROCHOT experiment" "${log}"
+grep -q "Experiment: boot 1 of 2, baseline (policy not applied)" "${log}"
+! grep -q "Disabling BD PROCHOT" "${log}"
+! grep -q "baseline contaminated" "${log}"
+grep -q "Experiment record OK (running)" "${log}"
+set_scenario
+log="${TMP_DIR}/qemu-experiment-policy.log"
+run_qemu "${log}"
+grep -q "Experiment: boot 2 of 2, policy" "${log}"
+grep -q "Disabling BD PROCHOT" "${log}"
+grep -q "Experiment complete, policy stays on" "${log}"
+grep -q "Experiment record OK (complete)" "${log}"
+log="${TMP_DIR}/qemu-experiment-after.log"
+run_qemu "${log}"
+! grep -q "Experiment: boot" "${log}"
+grep -q "Disabling BD PROCHOT" "${log}"
+grep -q "Chainload successful" "${log}"
+
+# Policy profile next to DisablePROCHOT.efi replaces the built-in table.
+log="${TMP_DIR}/qemu-profile.log"
+MTOOLS_SKIP_CHECK=1 mcopy -i "${ESP_IMG}" "${ROOT_DIR}/test/DisablePROCHOT.cfg" ::/EFI/BOOT/DisablePROCHOT.cfg
+fresh_vars
+run_qemu "${log}"
+MTOOLS_SKIP_CHECK=1 mdel -i "${ESP_IMG}" ::/EFI/BOOT/DisablePROCHOT.cfg
+grep -q "Policy profile line 5 ignored" "${log}"
+grep -q "Policy profile: 3 entries" "${log}"
+grep -q "Low-latency profile: 3 entries" "${log}"
+grep -q "MSR 0x610 skipped: CPU family/model mismatch" "${log}"
+grep -q "MSR 0x802 not implemented on this CPU, skipped" "${log}"
+grep -q "HWP: not supported on 1 CPUs" "${log}"
+grep -Eq "Clamp scan: ([0-9]+ found, [0-9]+ removed|not an Intel family 6 CPU, skipped)" "${log}"
+grep -Eq "Turbo ratio limits: (not an Intel family 6 CPU|not programmable on this CPU), skipped|Turbo ratio limits: MSR 0x1AD set on" "${log}"
+grep -q "Diagnostics: 1 cores sampled" "${log}"
+grep -q "Chainload successful" "${log}"
+
+# An oversized profile is rejected as a whole, never parsed up to a cut line.
+log="${TMP_DIR}/qemu-profile-large.log"
+{ cat "${ROOT_DIR}/test/DisablePROCHOT.cfg"; for i in $(seq 1 64); do
+	printf '# padding %064d\n' "${i}"; done; } >"${TMP_DIR}/large.cfg"
+MTOOLS_SKIP_CHECK=1 mcopy -i "${ESP_IMG}" "${TMP_DIR}/large.cfg" ::/EFI/BOOT/DisablePROCHOT.cfg
+fresh_vars
+run_qemu "${log}"
+MTOOLS_SKIP_CHECK=1 mdel -i "${ESP_IMG}" ::/EFI/BOOT/DisablePROCHOT.cfg
+grep -q "Policy profile over 4096 bytes, using built-in policy" "${log}"
+! grep -q "Policy profile: " "${log}"
+grep -q "Chainload successful" "${log}"
+
+# Resident mode: the profile turns it on; the chainloaded app must still find
+# the timer armed (record published) when it runs, with every tick reaching
+# both CPUs.
+log="${TMP_DIR}/qemu-resident.log"
+MTOOLS_SKIP_CHECK=1 mcopy -i "${ESP_IMG}" "${ROOT_DIR}/test/Resident.cfg" ::/EFI/BOOT/DisablePROCHOT.cfg
+fresh_vars
+run_qemu "${log}" -smp 2
+MTOOLS_SKIP_CHECK=1 mdel -i "${ESP_IMG}" ::/EFI/BOOT/DisablePROCHOT.cfg
+grep -q "Resident mode: keeping 1 entries on 2 CPUs, every 10 ms" "${log}"
+grep -q "Resident record OK" "${log}"
+! grep -q "MP dispatch: pass" "${log}"
+grep -q "Thermal governor: no digital thermal sensor, not started" "${log}"
+grep -q "Chainload successful" "${log}"
+
+# S3 enabled: OVMF now has the S3 Save State protocol, but like any EDK2
+# firmware it has locked the boot script before Boot#### runs, so the replay
+# must be refused, and reported as such, without breaking the boot.
+log="${TMP_DIR}/qemu-s3.log"
+fresh_vars
+run_qemu "${log}" -global ICH9-LPC.disable_s3=0
+grep -q "S3 resume replay not registered: boot script rejected it" "${log}"
+! grep -q "S3 resume replay registered" "${log}"
+grep -q "Chainload successful" "${log}"
+
+# Multi-processor dispatch: every enabled CPU must run the policy and read it
+# back, across socket/core/thread layouts. TCG ignores MSR 0x1FC writes, so the
+# runs use test/Smp.cfg, whose entry holds on every thread.
+MTOOLS_SKIP_CHECK=1 mcopy -i "${ESP_IMG}" "${ROOT_DIR}/test/Smp.cfg" ::/EFI/BOOT/DisablePROCHOT.cfg
+for smp in "2" "4,sockets=2,cores=2,threads=1" "8,sockets=2,cores=2,threads=2"; do
+	cpus="${smp%%,*}"
+	log="${TMP_DIR}/qemu-smp${cpus}.log"
+	fresh_vars
+	run_qemu "${log}" -smp "${smp}"
+	grep -q "Policy profile: 1 entries" "${log}"
+	grep -q "Unlock readback: ${cpus}/${cpus} CPUs" "${log}"
+	! grep -q "MP dispatch: pass" "${log}"
+	grep -q "Chainload successful" "${log}"
+done
+MTOOLS_SKIP_CHECK=1 mdel -i "${ESP_IMG}" ::/EFI/BOOT/DisablePROCHOT.cfg
+
+# Boot-latency sweep: SetBootOrder generates N entries with DisablePROCHOT
+# first and ChainSuccess last, every entry in between unloadable, so the walk
+# visits all of them. ChainSuccess reports the TSC time since DisablePROCHOT
+# started and how many candidates the walk pre-checked and skipped.
+#
+# The walk is checked exactly: cold, only the missing-file entries and the
+# target are pre-checked; warm, only the cached target. The time limits come
+# from this host. A 2-entry boot, with nothing to skip, is the baseline for
+# each cache state, and the first size's cold run calibrates the cost per
+# entry. A warm run jumps straight to the target, so it must stay within
+# BENCH_FACTOR times the warm baseline whatever N is; a cold run within
+# BENCH_FACTOR times the cold baseline plus N entries.
+BENCH_SIZES="${BENCH_SIZES:-10 50 100 300}"
+BENCH_FACTOR="${BENCH_FACTOR:-3}"
+bench_report=""
+bench_failed=0
+base_cold=""
+base_warm=""
+entry_us=""
+for n in 2 ${BENCH_SIZES}; do
+	set_scenario "bench ${n} 0 $((n - 1))"
+	fresh_vars
+	missing=0
+	for ((i = 1; i <= n - 2; i++)); do
+		if [ $((i % 4)) -eq 1 ] || [ $((i % 4)) -eq 2 ]; then missing=$((missing + 1)); fi
+	done
+	for cache in cold warm; do
+		log="${TMP_DIR}/qemu-bench${n}-${cache}.log"
+		run_qemu "${log}" >/dev/null
+		grep -q "Chainload successful" "${log}"
+		us="$(sed -n 's/^Boot latency: \([0-9]*\) us.*/\1/p' "${log}" | head -n1)"
+		walk="$(sed -n 's/^Boot walk: \([0-9]*\) pre-checked, \([0-9]*\) skipped.*/\1 \2/p' \
+			"${log}" | head -n1)"
+		if [ "${cache}" = cold ]; then
+			want="$((missing + 1)) ${missing}"
+		else
+			want="1 0"
+		fi
+		verdict="ok"
+		if [ -z "${us}" ] || [ "${walk}" != "${want}" ]; then
+			verdict="WALK ${walk:-?}, want ${want}"
+			bench_failed=1
+		elif [ "${n}" -eq 2 ]; then
+			verdict="baseline"
+			if [ "${cache}" = cold ]; then base_cold="${us}"; else base_warm="${us}"; fi
+		else
+			if [ "${cache}" = cold ] && [ -z "${entry_us}" ]; then
+				entry_us=$(((us > base_cold ? us - base_cold : 0) / (n - 2)))
+				verdict="calibrates ${entry_us} us/entry"
+			fi
+			if [ "${cache}" = cold ]; then
+				limit=$((BENCH_FACTOR * (base_cold + n * entry_us)))
+			else
+				limit=$((BENCH_FACTOR * base_warm))
+			fi
+			if [ "${us}" -gt "${limit}" ]; then
+				verdict="OVER ${limit}"
+				bench_failed=1
+			fi
+		fi
+		bench_report+="$(printf '%8s %6s %12s %9s  %s' "${n}" "${cache}" "${us:-?}" \
+			"${walk// //}" "${verdict}")"$'\n'
+	done
+done
+set_scenario
+printf '%8s %6s %12s %9s\n' entries cache latency_us walk
+printf '%s' "${bench_report}"
+[ "${bench_failed}" -eq 0 ]
@@ -0,0 +1,19 @@
+#!/bin/bash
+set -euo pipefail
+
+# The S3 replay stub, hosted: test/s3/s3.c includes DisablePROCHOT.c built
+# with -DMOCK_MSR, registers the replay with a mock S3 Save State protocol and
+# calls the stub's copy the way the resume boot script would. rdmsr/wrmsr are
+# emulated from a SIGSEGV handler. No VM, no hardware.
+
+ROOT_DIR="$(cd -- "$(dirname -- "${BASH_SOURCE[0]}")/../.." && pwd)"
+TMP_DIR="${ROOT_DIR}/test/tmp"
+mkdir -p "${TMP_DIR}"
+
+# Same flags as the governor test.
+cc -std=gnu17 -O2 -fshort-wchar \
+	-isystem /usr/include/efi -isystem /usr/include/efi/x86_64 \
+	-DHAVE_USE_MS_ABI -Dx86_64 -DSILENT -DMOCK_MSR \
+	-Wall -Wextra -Wno-unused-function -Werror \
+	-o "${TMP_DIR}/s3" "${ROOT_DIR}/test/s3/s3.c"
+"${TMP_DIR}/s3"
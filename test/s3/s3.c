@@ -0,0 +1,171 @@
+// Hosted test: the S3 replay stub, run from its NVS copy.
+//
+// DisablePROCHOT.c is compiled in with -DMOCK_MSR. A mock S3 Save State
+// protocol accepts the registration, so RegisterS3Replay copies the stub and
+// its table into a page below 4 GB and hands back the DISPATCH_2 entry point
+// and context. The test then does what the boot script executor does on
+// resume: it calls the copy on the table. rdmsr/wrmsr fault in user mode; the
+// SIGSEGV handler emulates them against the same MSR table and steps over
+// them, so the stub's own instructions are what runs.
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+
+#include "../../DisablePROCHOT.c"
+
+static struct {
+  uint32_t Index;
+  uint64_t Value;
+} gMsrs[16];
+static UINTN gMsrCount;
+
+static uint64_t *MockMsr(uint32_t index) {
+  UINTN i;
+  for (i = 0; i < gMsrCount; ++i)
+    if (gMsrs[i].Index == index) return &gMsrs[i].Value;
+  if (gMsrCount == sizeof(gMsrs) / sizeof(gMsrs[0])) abort();
+  gMsrs[gMsrCount].Index = index;
+  gMsrs[gMsrCount].Value = 0;
+  return &gMsrs[gMsrCount++].Value;
+}
+
+static uint64_t AsmWriteMsr64(uint32_t index, uint64_t val) { return *MockMsr(index) = val; }
+static uint64_t AsmReadMsr64(uint32_t index) { return *MockMsr(index); }
+
+static void AsmCpuid(uint32_t leaf, uint32_t subleaf, uint32_t r[4]) {
+  (void)leaf;
+  (void)subleaf;
+  r[0] = r[1] = r[2] = r[3] = 0;
+}
+
+static UINTN gRdmsr, gWrmsr;
+
+// #GP from rdmsr (0F 32) or wrmsr (0F 30) in the stub: emulate and step over.
+static void EmulateMsr(int sig, siginfo_t *info, void *context) {
+  greg_t *g = ((ucontext_t *)context)->uc_mcontext.gregs;
+  const UINT8 *ip = (const UINT8 *)g[REG_RIP];
+  uint32_t index = (uint32_t)g[REG_RCX];
+  (void)sig;
+  (void)info;
+
+  if (ip[0] != 0x0F || (ip[1] != 0x32 && ip[1] != 0x30)) abort();
+  if (ip[1] == 0x32) {
+    uint64_t v = *MockMsr(index);
+    g[REG_RAX] = (greg_t)(uint32_t)v;
+    g[REG_RDX] = (greg_t)(v >> 32);
+    gRdmsr++;
+  } else {
+    *MockMsr(index) = (uint32_t)g[REG_RAX] | (uint64_t)(uint32_t)g[REG_RDX] << 32;
+    gWrmsr++;
+  }
+  g[REG_RIP] += 2;
+}
+
+static EFI_PHYSICAL_ADDRESS gEntry, gContext;
+static UINTN gPages;
+
+static EFI_STATUS EFIAPI MockWrite(const S3_SAVE_STATE_PROTOCOL *self, UINTN opCode, ...) {
+  __builtin_ms_va_list args;
+  (void)self;
+
+  if (opCode != BOOT_SCRIPT_DISPATCH_2_OPCODE) return EFI_UNSUPPORTED;
+  __builtin_ms_va_start(args, opCode);
+  gEntry = __builtin_va_arg(args, EFI_PHYSICAL_ADDRESS);
+  gContext = __builtin_va_arg(args, EFI_PHYSICAL_ADDRESS);
+  __builtin_ms_va_end(args);
+  return EFI_SUCCESS;
+}
+
+static S3_SAVE_STATE_PROTOCOL gMockS3 = {MockWrite, NULL, NULL, NULL};
+
+static EFI_STATUS EFIAPI MockLocateProtocol(EFI_GUID *guid, VOID *registration, VOID **out) {
+  (void)registration;
+  if (CompareMem(guid, &gEfiS3SaveStateProtocolGuid, sizeof(*guid))) return EFI_NOT_FOUND;
+  *out = &gMockS3;
+  return EFI_SUCCESS;
+}
+
+// One executable page below 4 GB, standing in for ACPI NVS.
+static EFI_STATUS EFIAPI MockAllocatePages(EFI_ALLOCATE_TYPE type, EFI_MEMORY_TYPE memType,
+                                           UINTN pages, EFI_PHYSICAL_ADDRESS *addr) {
+  void *p;
+
+  if (type != AllocateMaxAddress || memType != EfiACPIMemoryNVS || pages != 1)
+    return EFI_INVALID_PARAMETER;
+  p = mmap(NULL, 4096, PROT_READ | PROT_WRITE | PROT_EXEC,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+  if (p == MAP_FAILED || (EFI_PHYSICAL_ADDRESS)(UINTN)p + 4096 - 1 > *addr)
+    return EFI_OUT_OF_RESOURCES;
+  *addr = (EFI_PHYSICAL_ADDRESS)(UINTN)p;
+  gPages++;
+  return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI MockFreePages(EFI_PHYSICAL_ADDRESS addr, UINTN pages) {
+  munmap((void *)(UINTN)addr, pages * 4096);
+  gPages--;
+  return EFI_SUCCESS;
+}
+
+static EFI_BOOT_SERVICES gMockBS;
+static int gFailures;
+
+static void Expect(const char *what, uint64_t got, uint64_t want) {
+  if (got == want) return;
+  fprintf(stderr, "%s: 0x%llX, expected 0x%llX\n", what, (unsigned long long)got,
+          (unsigned long long)want);
+  gFailures++;
+}
+
+int main(void) {
+  struct sigaction sa = {0};
+  EFI_STATUS(EFIAPI * stub)(EFI_HANDLE, VOID *);
+  S3_REPLAY_TABLE *table;
+
+  sa.sa_sigaction = EmulateMsr;
+  sa.sa_flags = SA_SIGINFO;
+  sigaction(SIGSEGV, &sa, NULL);
+  gMockBS.LocateProtocol = MockLocateProtocol;
+  gMockBS.AllocatePages = MockAllocatePages;
+  gMockBS.FreePages = MockFreePages;
+  BS = &gMockBS;
+
+  // test/Smp.cfg's fast-strings entry, written by the apply; a package power
+  // limit whose lock bit the firmware sets again on resume; and an entry the
+  // CPU model ruled out, which must stay out of the table.
+  gPolicy[0] = (POLICY_ENTRY){0x1A0, SCOPE_THREAD, LOCK_NONE, MATCH_ANY, MATCH_ANY, 0x1, 0x1};
+  gPolicy[1] = (POLICY_ENTRY){0x610, SCOPE_PACKAGE, 63, MATCH_ANY, MATCH_ANY, 0x7FFF, 0x100};
+  gPolicy[2] = (POLICY_ENTRY){0x1FC, SCOPE_PACKAGE, LOCK_NONE, MATCH_ANY, MATCH_ANY, 0x1, 0x0};
+  gPolicyCount = 3;
+  gPolicyResult[0].Written = 1;
+  gPolicyResult[1].Unchanged = 1;
+  gPolicyResult[2].Skipped = TRUE;
+
+  RegisterS3Replay();
+  if (!gS3ReplayRegistered || gPages != 1) {
+    fprintf(stderr, "replay not registered\n");
+    return 1;
+  }
+  table = (S3_REPLAY_TABLE *)(UINTN)gContext;
+  Expect("table offset", gContext - gEntry, S3_REPLAY_TABLE_OFFSET);
+  Expect("table entries", table->Count, 2);
+
+  // Resume: firmware init cleared fast strings and locked the power limit.
+  *MockMsr(0x1A0) = 0x850088;
+  *MockMsr(0x610) = 1ULL << 63 | 0x42;
+  *MockMsr(0x1FC) = 0x1;
+  stub = (EFI_STATUS(EFIAPI *)(EFI_HANDLE, VOID *))(UINTN)gEntry;
+  Expect("stub status", stub(NULL, table), EFI_SUCCESS);
+  Expect("MSR 0x1A0", *MockMsr(0x1A0), 0x850089);
+  Expect("locked MSR 0x610", *MockMsr(0x610), 1ULL << 63 | 0x42);
+  Expect("skipped MSR 0x1FC", *MockMsr(0x1FC), 0x1);
+  Expect("rdmsr", gRdmsr, 2);
+  Expect("wrmsr", gWrmsr, 1);
+
+  if (gFailures) return 1;
+  printf("S3 replay tests passed\n");
+  return 0;
+}